@@ -12,15 +12,30 @@
 
  */
 
+#define _GNU_SOURCE     //O_DIRECT
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
 
 struct particle_struct
 {
     double drx_so_far,dry_so_far;
     double x,y;                         //x,y coordinate of the particles
+    double ux,uy;                       //unwrapped coordinates, never put back in the box
     double fx,fy;                       //fx,fy forces acting on the particle
     int color;                          //this is to distinguish the particles
     int ID;                             //ID of a particle
@@ -35,19 +50,308 @@ struct pinning_struct
 
 
 
+#define MAX_SPECIES 4   //max number of particle colors
+#define OBSTACLE_COLOR 2 //static obstacles are a species of their own
+
 double SX,SY;           //system size x,y direction
 double SX2,SY2;         //half of the system size x,y direction
 int N;                  //number of particles
+int N_mobile;           //particles 0..N_mobile-1 move, N_mobile..N-1 are static obstacles
 int N_pins;             //number of pinningsites
 double dt;              //length of a single time step
 int t;                  //time - time steps so far
+
+#ifndef TOTAL_TIME
+#define TOTAL_TIME 100000   //time steps in a run
+#endif
+#ifndef NR_OBSTACLES
+#define NR_OBSTACLES 0      //static obstacles added to every run (-DNR_OBSTACLES=40)
+#endif
 FILE *moviefile;        //file to store the coordinates of the particles
+
+//movie output: MOVIE_RAW is the 20 bytes per particle cmovie of
+//write_cmovie, MOVIE_PACKED the compressed format of write_packed_movie,
+//MOVIE_CONTAINER the same frames in chunks, with the run parameters in
+//a header (write_chunk); all three are written by the output thread
+//(plot reads all three as "cmovie", it recognizes the headers)
+#define MOVIE_RAW       0
+#define MOVIE_PACKED    1
+#define MOVIE_CONTAINER 2
+int movie_format = MOVIE_CONTAINER;
+int movie_interval = 10;        //a frame every movie_interval steps
+int movie_bits = 16;            //packed: x,y quantized to 2^movie_bits steps of the box
+int movie_block = 32;           //packed: a key frame every movie_block frames (a chunk)
+int movie_force = 0;            //container: also store fx,fy of every particle
+
+//movie filters, applied by the output thread (movie_filter): only the
+//particles inside the window, of the species set in movie_species (bit s
+//for species s), and of those every movie_every-th one are written.
+//With movie_adaptive the step loop hands over a frame every
+//movie_fine_interval steps; the output thread writes it when
+//movie_interval steps have passed since the last frame written, or
+//sooner when the mean velocity of the mobile particles has changed by
+//more than movie_velocity_change since then
+int movie_window = 0;
+double movie_xmin = 0.0, movie_xmax = 0.0;
+double movie_ymin = 0.0, movie_ymax = 0.0;
+unsigned int movie_species = ~0u;
+int movie_every = 1;
+int movie_adaptive = 0;
+int movie_fine_interval = 1;
+double movie_velocity_change = 0.01;
+
+//how the movie reaches the disk: MOVIE_IO_STDIO is fwrite; MOVIE_IO_PWRITE
+//and MOVIE_IO_URING collect it in aligned buffers of movie_io_size bytes,
+//written with pwrite, or submitted to io_uring and completed while the
+//next buffers fill (without io_uring in the kernel it falls back to
+//pwrite). movie_direct opens the file with O_DIRECT (page cache bypassed)
+#define MOVIE_IO_STDIO  0
+#define MOVIE_IO_PWRITE 1
+#define MOVIE_IO_URING  2
+int movie_io = MOVIE_IO_STDIO;
+int movie_io_size = 1<<20;      //a multiple of MOVIE_IO_ALIGN
+int movie_direct = 0;
+
+#define MOVIE_IO_BUFFERS 4
+#define MOVIE_IO_ALIGN 4096
+struct movie_io_struct
+{
+    int fd;
+    int backend;                        //movie_io, unless it fell back
+    char *buffer[MOVIE_IO_BUFFERS];
+    size_t length[MOVIE_IO_BUFFERS];    //submitted: bytes, and where they go
+    off_t at[MOVIE_IO_BUFFERS];
+    int busy[MOVIE_IO_BUFFERS];         //submitted, not yet completed
+    int current;                        //the buffer being filled
+    size_t fill;
+    off_t offset;                       //where the current buffer goes
+    long long bytes;
+    double start;                       //wall_seconds() at the open
+    double wait;                        //seconds the writer waited for the disk
+    double io_time;                     //seconds inside pwrite and io_uring_enter
+} mio;
+
+unsigned int random_seed = 1;   //srand() at the start, kept in the movie header
+
+//state of the packed writer: the quantized positions of the previous
+//frame (the next one is coded as the differences to them)
+#define PACK_MAGIC "ZMV1"
+#define PACK_ESCAPE 24          //a quotient this long is followed by the raw value
+unsigned int *pack_qx = NULL, *pack_qy = NULL;
+int pack_n;                     //particles in the previous frame, 0 before the first
+int pack_frames;                //frames written since the last key frame
+unsigned int *pack_u = NULL;   //the values to be coded, 4*N
+unsigned char *pack_buffer = NULL;
+int *pack_id = NULL;            //particles of the previous frame
+
+//what a movie frame needs, copied in the step loop so that the
+//output thread can code it while the simulation goes on
+struct movie_snapshot_struct
+{
+    int t;
+    int n;
+    double *x,*y;
+    double *fx,*fy;
+    int *color;
+    int *id;                    //index of the particle (filtered frames skip some)
+    int allocated;
+};
+
+//what the filters kept, and the last frame written (movie_adaptive)
+struct movie_snapshot_struct movie_filtered;
+long movie_frames_offered, movie_frames_kept;
+long long movie_particles_offered, movie_particles_kept;
+int movie_last_t;
+double movie_last_vx, movie_last_vy;
+
+#define CONTAINER_MAGIC "MDT1"
+#define CHUNK_MAGIC "CHNK"
+
+//the chunk being collected by the output thread
+unsigned char *chunk_data = NULL;   //the frames, one after the other
+int chunk_bytes, chunk_allocated;
+int chunk_frames;
+int *chunk_offset = NULL, *chunk_time = NULL;   //offset in chunk_data until written
+
+//per species statistics, recalculated every time step
+//and written to statistics_file every stat_interval steps
+struct species_stats_struct
+{
+    int n;                      //particles of this species
+    double mean_vx,mean_vy;
+    double var_vx,var_vy;
+    double mobile_fraction;     //fraction moving faster than mobile_velocity
+} species_stats[MAX_SPECIES];
+
 FILE *statistics_file;
+int stat_interval = 100;
+double mobile_velocity = 0.05;
+
+//potential energy and virial tensor W_ab = sum over pairs of f_a*r_b
+//they are summed inside the force kernels, only on sampling steps
+//(sample_observables is set), and written to observables_file
+struct observables_struct
+{
+    double e_pot;
+    double wxx,wxy,wyy;
+} observables;
+
+//bond order and coordination of the mobile particles, from analyze_defects
+struct defects_struct
+{
+    double psi6_local, psi6_global;
+    int n5, n6, n7, n_other;
+} defects;
+
+//output thread: the step loop copies what is to be written into
+//output_ring[output_head%OUTPUT_SLOTS] and the output thread formats and
+//writes output_ring[output_tail%OUTPUT_SLOTS]. Only the step loop moves
+//output_head and only the output thread output_tail, so the ring needs
+//no lock; with every slot taken the step loop waits (output_stalls).
+//A side that has to wait sleeps on output_wake until the other side
+//moves its index; output_lock is only taken to sleep and to wake it
+#define OUTPUT_MOVIE        0
+#define OUTPUT_STATISTICS   1
+#define OUTPUT_OBSERVABLES  2
+#define OUTPUT_PROGRESS     3
+#define OUTPUT_DEFECTS      4
+#define OUTPUT_SLOTS 8
+struct output_job_struct
+{
+    int kind;
+    int t;
+    struct movie_snapshot_struct movie;             //OUTPUT_MOVIE
+    struct species_stats_struct stats[MAX_SPECIES]; //OUTPUT_STATISTICS
+    double drive[MAX_SPECIES];
+    struct observables_struct observables;          //OUTPUT_OBSERVABLES
+    struct defects_struct defects;                  //OUTPUT_DEFECTS
+} output_ring[OUTPUT_SLOTS];
+atomic_uint output_head, output_tail;
+atomic_int output_quit, output_sleepers;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t output_wake = PTHREAD_COND_INITIALIZER;
+long output_jobs, output_stalls;
+pthread_t output_thread;
+
+int sample_observables;
+FILE *observables_file;
+
+//pair distribution function g(r), one histogram per pair type
+//it is filled by the observables variant of the force kernels from the
+//distances they already have; the range of pair type k is its cutoff,
+//up to there the Verlet list is complete
+#define N_GR_BINS 200
+
+long gr_hist[MAX_SPECIES*MAX_SPECIES][N_GR_BINS];
+double gr_r2_max[MAX_SPECIES*MAX_SPECIES];
+double gr_per_dr[MAX_SPECIES*MAX_SPECIES];     //N_GR_BINS/r_max
+long gr_samples;
+
+//structure factor S(k) of the mobile particles on the grid
+//k = 2pi (nx/SX, ny/SY), 0 <= nx <= sk_n_max, -sk_n_max <= ny <= sk_n_max
+//(S(-k) = S(k), the other half plane is not needed)
+#define SK_N_MAX 32
+
+int sk_n_max = 16;
+int sk_interval = 1000;
+double sk_sum[SK_N_MAX+1][2*SK_N_MAX+1];
+long sk_samples;
+
+/*
+Bond orientational order and defects
+
+ Every defect_interval steps the neighbors of the mobile particles are
+ found with a cell list of cell size >= r_nn, two particles are neighbors
+ closer than r_nn = 1.3 * the triangular lattice constant of the density.
+ psi6 of particle i = 1/z_i sum_j exp(6 i theta_ij), z_i = number of neighbors
+ In a triangular crystal z = 6 everywhere, the 5 and 7 fold particles are
+ the defects.
+ */
+
+#define MAX_COORDINATION 12     //z above this is counted as MAX_COORDINATION
+
+int *cell_head = NULL;      //first particle in the cell, -1 if empty
+int *cell_next = NULL;      //next particle in the same cell
+int N_cells_x,N_cells_y;
+double r_nn;
+
+int defect_interval = 1000;
+FILE *defects_file;
+long coordination_hist[MAX_COORDINATION+1];
+long coordination_samples;
+
+/*
+Velocity-force (depinning) analysis
+
+ Every time step the mean x velocity of each mobile species is put
+ into the bin of the drive that species feels at that time.
+ The bins keep a running mean and variance (Welford), so the
+ curve is ready at the end of the run without a per-step file.
+ */
+
+#define N_VF_BINS 100
+
+struct vf_bin_struct
+{
+    long count;
+    double mean;        //mean velocity
+    double m2;          //sum of squared deviations from the mean
+};
+
+struct vf_analyzer_struct
+{
+    double f_min,f_max;         //drive range seen in the run
+    double bins_per_force;      //N_VF_BINS/(f_max-f_min)
+    struct vf_bin_struct bins[N_VF_BINS];
+} vf_analyzers[MAX_SPECIES];
+
+//a species counts as depinned once its mean velocity along the drive exceeds this
+double depinning_velocity = 0.05;
+
+/*
+Mean squared displacement (multi-tau)
+
+ The MSD is measured on the unwrapped coordinates ux,uy every
+ msd_interval steps. Level 0 keeps the last MSD_BUFFER samples, level l
+ receives every 2^l-th sample and keeps MSD_BUFFER of those, so lags up
+ to MSD_BUFFER*2^(MSD_LEVELS-1) samples are reached with
+ MSD_LEVELS*MSD_BUFFER stored positions per particle.
+
+ level 0 lags: 1,2,...,MSD_BUFFER-1 samples
+ level l lags: j*2^l for j = MSD_BUFFER/2 ... MSD_BUFFER-1
+
+ The center of mass of every species is stored the same way,
+ the drift corrected MSD subtracts its displacement:
+ <|dr_i - dR|^2> = <|dr_i|^2> - |dR|^2
+ */
+
+#define MSD_BUFFER 16
+#define MSD_LEVELS 12
+
+double *msd_x = NULL;   //stored positions: [(level*MSD_BUFFER+slot)*N_mobile+i]
+double *msd_y = NULL;
+double msd_cx[MAX_SPECIES][MSD_LEVELS][MSD_BUFFER];    //stored centers of mass
+double msd_cy[MAX_SPECIES][MSD_LEVELS][MSD_BUFFER];
+int msd_head[MSD_LEVELS];       //slot of the newest sample
+int msd_stored[MSD_LEVELS];     //samples kept on the level (max MSD_BUFFER)
+long msd_samples;
+
+double msd_sum[MAX_SPECIES][MSD_LEVELS][MSD_BUFFER];   //sum of <|dr|^2>
+double msd_drift[MAX_SPECIES][MSD_LEVELS][MSD_BUFFER]; //sum of |dR|^2
+long msd_count[MSD_LEVELS][MSD_BUFFER];
+
+int msd_interval = 10;
 
 //Verlet list variables
 int *vlist1=NULL;
 int *vlist2=NULL;
 int N_vlist;
+int N_vlist_allocated = 0;
+
+//a pair enters the list if it is closer than its cutoff + verlet_skin
+//the list is rebuilt once a particle moved verlet_skin
+double verlet_skin;
+double verlet_r2[MAX_SPECIES][MAX_SPECIES];
 
 //this flag will tell me whether
 //I need to rebuild the Verlet list
@@ -70,9 +374,86 @@ What the Verlet list stores:
  */
 
 //variables for tabulating the force
-double *tabulated_f_per_r;
+//all species pairs share the same r^2 grid, their tables are stored
+//one after the other: the table of pair type k starts at k*(N_tabulated+1)
+//the extra last entry of every table is 0.0 (beyond the cutoff)
+double *tabulated_f_per_r = NULL;
+double *tabulated_u = NULL;     //pair energy on the same grid, same layout
 int N_tabulated;
 double tabulalt_start, tabulalt_lepes;
+double tabulalt_per_lepes;      //1/tabulalt_lepes
+
+/*
+Pair potentials
+
+ Every interaction is described by a potential type from the registry
+ (potential_types[]) plus the parameters of one species pair.
+ The species of a particle is its color, so the pair i,j uses
+ pair_potentials[particles[i].color][particles[j].color]
+
+ The same description is used for the direct calculation of the force
+ and for building the force table, so the two always agree.
+ */
+
+#define POT_SCREENED_COULOMB 0  //f = A exp(-kappa r)/r^2, the original force of this code
+#define POT_YUKAWA           1  //U = A exp(-kappa r)/r
+#define POT_WCA              2  //Lennard-Jones cut and shifted at 2^(1/6) sigma
+#define POT_SOFT_DISK        3  //harmonic overlap U = A/2 (1-r/sigma)^2
+#define N_POTENTIAL_TYPES    4
+
+struct pair_potential_struct
+{
+    int type;                   //index into potential_types[]
+    double A;                   //strength (prefactor, or epsilon for WCA)
+    double kappa;               //inverse screening length
+    double sigma;               //particle diameter for the short range potentials
+    double r_min;               //closer than this the force is taken at r_min
+    double r_cut;               //no interaction beyond this distance
+} pair_potentials[MAX_SPECIES][MAX_SPECIES];
+
+int N_species;          //number of species (colors) in use
+
+//pair type of colors a,b is a*N_species+b, it selects the force table
+#define PAIR_TYPE(a,b) ((a)*N_species+(b))
+
+//the particles are sorted by color: species s is
+//particles[species_start[s]] ... particles[species_start[s+1]-1]
+//(the obstacles have the largest color, so they stay at the end)
+int species_start[MAX_SPECIES+1];
+
+/*
+Drive schedules
+
+ The external force on species s is evaluated once per time step
+ into current_drive[s] and then added to the whole range of that
+ species, without looking at the color of the single particles.
+ */
+
+#define DRIVE_LINEAR     0  //f0 + rate*t
+#define DRIVE_STEP       1  //f0 + amplitude*(t/period), a staircase
+#define DRIVE_SINUSOIDAL 2  //amplitude*sin(2 pi t/period)
+#define DRIVE_AC_DC      3  //f0 + rate*t + amplitude*sin(2 pi t/period)
+#define N_DRIVE_TYPES    4
+
+struct drive_schedule_struct
+{
+    int type;
+    double f0;          //constant (DC) part
+    double rate;        //change of the DC part per time step
+    double amplitude;   //AC amplitude or height of a step
+    int period;         //AC period or length of a step, in time steps
+} drive_schedules[MAX_SPECIES];
+
+double current_drive[MAX_SPECIES];      //x direction drive at time t
+
+const char *drive_type_names[N_DRIVE_TYPES] = {"linear","step","sinusoidal","ac_dc"};
+
+struct potential_type_struct
+{
+    const char *name;
+    double (*force)(struct pair_potential_struct *p, double r);    //f(r), positive is repulsive
+    double (*energy)(struct pair_potential_struct *p, double r);   //U(r), not shifted
+};
 
 //these are for time keeping purposes
 //to count how many seconds the simulation ran
@@ -109,29 +490,267 @@ void program_timing_end(int nrparticles, int run_type)
     fclose(f);
 }
 
-void tabulate_forces()
+//exponential integral E1(x), x>0
+//series for small x, continued fraction (Numerical Recipes expint) otherwise
+double exponential_integral_e1(double x)
 {
-    int i;
-    double x_min,x_max;
-    double x2,x;
-    double f;
+    int k;
+    double sum,term,a,b,c,d,h,del;
 
-    x_min = 0.1;
-    x_max = 6.0;
+    if (x < 1.0)
+    {
+        sum = 0.0;
+        term = 1.0;
+        for(k=1;k<100;k++)
+        {
+            term *= -x/k;
+            del = -term/k;
+            sum += del;
+            if (fabs(del) < fabs(sum)*1e-16) break;
+        }
+        return -0.5772156649015329 - log(x) + sum;
+    }
 
-    N_tabulated = 50000;
-    tabulated_f_per_r = (double *) malloc(N_tabulated*sizeof(double));
-    for(i=0;i<N_tabulated;i++)
+    b = x + 1.0;
+    c = 1.0/1e-300;
+    d = 1.0/b;
+    h = d;
+    for(k=1;k<200;k++)
+    {
+        a = -(double)k*k;
+        b += 2.0;
+        d = 1.0/(a*d+b);
+        c = b+a/c;
+        del = c*d;
+        h *= del;
+        if (fabs(del-1.0) < 1e-16) break;
+    }
+    return h*exp(-x);
+}
+
+double screened_coulomb_force(struct pair_potential_struct *p, double r)
+{
+    return p->A / (r*r) * exp(-p->kappa*r);
+}
+
+//integral of the force from r to infinity
+double screened_coulomb_energy(struct pair_potential_struct *p, double r)
+{
+    if (p->kappa == 0.0) return p->A / r;
+    return p->A * (exp(-p->kappa*r)/r - p->kappa*exponential_integral_e1(p->kappa*r));
+}
+
+double yukawa_force(struct pair_potential_struct *p, double r)
+{
+    return p->A * exp(-p->kappa*r) * (1.0 + p->kappa*r) / (r*r);
+}
+
+double yukawa_energy(struct pair_potential_struct *p, double r)
+{
+    return p->A * exp(-p->kappa*r) / r;
+}
+
+double wca_force(struct pair_potential_struct *p, double r)
+{
+    double sr6;
+
+    if (r >= 1.122462048309373*p->sigma) return 0.0;
+    sr6 = pow(p->sigma/r,6.0);
+    return 24.0 * p->A * (2.0*sr6*sr6 - sr6) / r;
+}
+
+double wca_energy(struct pair_potential_struct *p, double r)
+{
+    double sr6;
+
+    if (r >= 1.122462048309373*p->sigma) return 0.0;
+    sr6 = pow(p->sigma/r,6.0);
+    return 4.0 * p->A * (sr6*sr6 - sr6) + p->A;
+}
+
+double soft_disk_force(struct pair_potential_struct *p, double r)
+{
+    if (r >= p->sigma) return 0.0;
+    return p->A / p->sigma * (1.0 - r/p->sigma);
+}
+
+double soft_disk_energy(struct pair_potential_struct *p, double r)
+{
+    if (r >= p->sigma) return 0.0;
+    return 0.5 * p->A * (1.0 - r/p->sigma) * (1.0 - r/p->sigma);
+}
+
+//the potential registry, indexed by the POT_ constants
+struct potential_type_struct potential_types[N_POTENTIAL_TYPES] =
+{
+    {"screened_coulomb", screened_coulomb_force, screened_coulomb_energy},
+    {"yukawa",           yukawa_force,           yukawa_energy},
+    {"wca",              wca_force,              wca_energy},
+    {"soft_disk",        soft_disk_force,        soft_disk_energy}
+};
+
+int find_potential_type(const char *name)
+{
+    int k;
+
+    for(k=0;k<N_POTENTIAL_TYPES;k++)
+        if (strcmp(potential_types[k].name,name)==0) return k;
+
+    printf("Unknown potential %s\n",name);
+    exit(1);
+}
+
+//sets the interaction of species a and b (and b and a)
+//r_cut <= 0 selects the natural range of the short range potentials
+void set_pair_potential(int a, int b, int type, double A, double kappa, double sigma, double r_cut)
+{
+    struct pair_potential_struct p;
+
+    p.type = type;
+    p.A = A;
+    p.kappa = kappa;
+    p.sigma = sigma;
+    p.r_min = 0.1;
+    p.r_cut = r_cut;
+    if (r_cut <= 0.0)
+    {
+        if (type == POT_WCA)            p.r_cut = 1.122462048309373*sigma;
+        else if (type == POT_SOFT_DISK) p.r_cut = sigma;
+        else
+        {
+            printf("Potential %s needs a cutoff\n",potential_types[type].name);
+            exit(1);
+        }
+    }
+    if (type == POT_WCA) p.r_min = 0.5*sigma;
+
+    pair_potentials[a][b] = p;
+    pair_potentials[b][a] = p;
+}
+
+/*
+ Reads the species pair interaction matrix, one pair per line:
+
+ species_a species_b potential A kappa sigma r_cut
+
+ e.g.
+ 0 0 screened_coulomb 1.0 0.25 0.0 4.0
+ 0 1 wca 1.0 0.0 1.0 0.0
+ */
+void load_pair_potentials(FILE *f)
+{
+    int a,b;
+    char name[64];
+    double A,kappa,sigma,r_cut;
+
+    while (fscanf(f,"%d %d %63s %lf %lf %lf %lf",&a,&b,name,&A,&kappa,&sigma,&r_cut)==7)
+    {
+        if ((a<0)||(b<0)||(a>=N_species)||(b>=N_species))
+        {
+            printf("Interaction %d-%d: no such species\n",a,b);
+            exit(1);
+        }
+        set_pair_potential(a,b,find_potential_type(name),A,kappa,sigma,r_cut);
+    }
+}
+
+//default interactions: every pair feels the original screened repulsion
+//cut off at 4.0; the file interactions.txt, if present, overrides pairs
+//species 0 and 1 are the two mobile colors, OBSTACLE_COLOR the obstacles
+void setup_pair_potentials()
+{
+    int a,b;
+    FILE *f;
+
+    N_species = 3;
+    for(a=0;a<N_species;a++)
+        for(b=a;b<N_species;b++)
+            set_pair_potential(a,b,POT_SCREENED_COULOMB,1.0,0.25,0.0,4.0);
+
+    f = fopen("interactions.txt","rt");
+    if (f!=NULL)
     {
-        x2 = i*(x_max*x_max-x_min*x_min)/(N_tabulated-1.0) + x_min*x_min;
-        x = sqrt(x2);
-        f = 1/x2 * exp(-0.25*x);
-        tabulated_f_per_r[i] = f/x;
-        //printf("%d %lf %lf %lf %lf\n",i,x,x2,f,tabulated_f_per_r[i]);
+        load_pair_potentials(f);
+        fclose(f);
     }
 
+    //instead of 4*4 I take 6*6 for the Verlet list
+    verlet_skin = 2.0;
+    for(a=0;a<N_species;a++)
+        for(b=0;b<N_species;b++)
+            verlet_r2[a][b] = (pair_potentials[a][b].r_cut + verlet_skin)*
+                              (pair_potentials[a][b].r_cut + verlet_skin);
+}
+
+//f/r for a pair at distance^2 dr2, calculated directly
+double pair_force_per_r(struct pair_potential_struct *p, double dr2)
+{
+    double dr;
+
+    if (dr2 >= p->r_cut*p->r_cut) return 0.0;
+
+    dr = sqrt(dr2);
+    if (dr < p->r_min) return potential_types[p->type].force(p,p->r_min)/dr;
+    return potential_types[p->type].force(p,dr)/dr;
+}
+
+//U(r) shifted to zero at the cutoff
+double pair_energy(struct pair_potential_struct *p, double dr2)
+{
+    double dr;
+
+    if (dr2 >= p->r_cut*p->r_cut) return 0.0;
+
+    dr = sqrt(dr2);
+    if (dr < p->r_min) dr = p->r_min;
+    return potential_types[p->type].energy(p,dr) - potential_types[p->type].energy(p,p->r_cut);
+}
+
+void tabulate_forces()
+{
+    int i,a,b,k;
+    double x_min,x_max;
+    double x2;
+    double *table,*table_u;
+
+    //one grid for all pairs, wide enough for the largest range
+    x_min = pair_potentials[0][0].r_min;
+    x_max = pair_potentials[0][0].r_cut;
+    for(a=0;a<N_species;a++)
+        for(b=0;b<N_species;b++)
+        {
+            if (pair_potentials[a][b].r_min < x_min) x_min = pair_potentials[a][b].r_min;
+            if (pair_potentials[a][b].r_cut > x_max) x_max = pair_potentials[a][b].r_cut;
+        }
+
+    N_tabulated = 50000;
     tabulalt_start = x_min * x_min;
     tabulalt_lepes = (x_max*x_max-x_min*x_min)/(N_tabulated-1.0);
+    tabulalt_per_lepes = 1.0/tabulalt_lepes;
+
+    tabulated_f_per_r = (double *) realloc(tabulated_f_per_r,
+                        N_species*N_species*(N_tabulated+1)*sizeof(double));
+    tabulated_u = (double *) realloc(tabulated_u,
+                  N_species*N_species*(N_tabulated+1)*sizeof(double));
+
+    for(a=0;a<N_species;a++)
+        for(b=0;b<N_species;b++)
+        {
+            k = PAIR_TYPE(a,b);
+            table = tabulated_f_per_r + k*(N_tabulated+1);
+            table_u = tabulated_u + k*(N_tabulated+1);
+            for(i=0;i<N_tabulated;i++)
+            {
+                x2 = i*tabulalt_lepes + tabulalt_start;
+                table[i] = pair_force_per_r(&pair_potentials[a][b],x2);
+                table_u[i] = pair_energy(&pair_potentials[a][b],x2);
+                //printf("%d %lf %lf\n",i,x2,table[i]);
+            }
+            table[N_tabulated] = 0.0;
+            table_u[N_tabulated] = 0.0;
+            printf("Tabulalt %d-%d %s r_cut = %lf\n",a,b,
+                   potential_types[pair_potentials[a][b].type].name,pair_potentials[a][b].r_cut);
+        }
     printf("Tabulalt start = %lf, lepes = %lf\n",tabulalt_start,tabulalt_lepes);
 
     /*
@@ -146,6 +765,8 @@ void tabulate_forces()
 
      index = (int)floor( ( dr^2 - tabulalt_start) / tabulalt_lepes )
 
+     pair types k: table k starts at tabulated_f_per_r[k*(N_tabulated+1)]
+
 
      */
 }
@@ -158,10 +779,11 @@ void rebuild_verlet_list()
     //printf("rebuilding Verlet\n");fflush(stdout);
 
     N_vlist = 0;
-    vlist1 = (int *) realloc(vlist1,N_vlist*sizeof(int));
-    vlist2 = (int *) realloc(vlist2,N_vlist*sizeof(int));
 
-    for(i=0;i<N;i++)
+    //i runs over the mobile particles only, so obstacle-obstacle
+    //pairs never enter the list (they never move, and the forces
+    //acting on obstacles are never used)
+    for(i=0;i<N_mobile;i++)
         for(j=i+1;j<N;j++)
         {
             dx = particles[i].x - particles[j].x;
@@ -176,11 +798,17 @@ void rebuild_verlet_list()
 
             dr2 = dx*dx+dy*dy;
 
-            if (dr2<=36.0) //instead of 4*4 I will take 6*6
+            //every species pair has its own list radius
+            if (dr2<=verlet_r2[particles[i].color][particles[j].color])
             {
                 N_vlist++;
-                vlist1 = (int *) realloc(vlist1,N_vlist*sizeof(int));
-                vlist2 = (int *) realloc(vlist2,N_vlist*sizeof(int));
+                if (N_vlist > N_vlist_allocated)
+                {
+                    //grow by doubling, not by one
+                    N_vlist_allocated = 2*N_vlist_allocated + 1024;
+                    vlist1 = (int *) realloc(vlist1,N_vlist_allocated*sizeof(int));
+                    vlist2 = (int *) realloc(vlist2,N_vlist_allocated*sizeof(int));
+                }
                 vlist1[N_vlist-1] = i;
                 vlist2[N_vlist-1] = j;
             }
@@ -192,7 +820,7 @@ void rebuild_verlet_list()
 
     //once I rebuilt the Verlet list,
     //I can start counting the distances again
-    for(i=0;i<N;i++)
+    for(i=0;i<N_mobile;i++)
     {
         particles[i].drx_so_far = 0.0;
         particles[i].dry_so_far = 0.0;
@@ -201,7 +829,33 @@ void rebuild_verlet_list()
     //printf("Verlet rebuilt at t=%d\n",t);
 }
 
-void initialize_particles(int systemSize, int nrParticles)
+//counting sort of the particles by color, fills species_start[]
+//the IDs are kept, only the storage order changes
+void sort_particles_by_species()
+{
+    int i,s;
+    int count[MAX_SPECIES+1];
+    struct particle_struct *sorted;
+
+    for(s=0;s<=MAX_SPECIES;s++) count[s] = 0;
+    for(i=0;i<N;i++) count[particles[i].color+1]++;
+
+    species_start[0] = 0;
+    for(s=0;s<MAX_SPECIES;s++)
+        species_start[s+1] = species_start[s] + count[s+1];
+
+    for(s=0;s<MAX_SPECIES;s++) count[s] = species_start[s];
+
+    sorted = (struct particle_struct *) malloc(N*sizeof(struct particle_struct));
+    for(i=0;i<N;i++)
+        sorted[count[particles[i].color]++] = particles[i];
+
+    free(particles);
+    particles = sorted;
+}
+
+//nrParticles mobile particles followed by nrObstacles static ones
+void initialize_particles(int systemSize, int nrParticles, int nrObstacles)
 {
     int i,j,ii,overlap;
     double dx,dy,dr,dr2;
@@ -215,7 +869,8 @@ void initialize_particles(int systemSize, int nrParticles)
     SX2 = SX/2.0;
     SY2 = SY/2.0;
 
-    N = nrParticles;
+    N = nrParticles + nrObstacles;
+    N_mobile = nrParticles;
 
     particles = (struct particle_struct *) malloc(N*sizeof(struct particle_struct));
 
@@ -267,6 +922,8 @@ void initialize_particles(int systemSize, int nrParticles)
 
         particles[i].x = tempx;
         particles[i].y = tempy;
+        particles[i].ux = tempx;
+        particles[i].uy = tempy;
 
 
 
@@ -284,12 +941,16 @@ void initialize_particles(int systemSize, int nrParticles)
         else                                particles[i].color = 1;
 //        */
 
+        //the obstacles are stored after the mobile particles
+        if (i >= N_mobile) particles[i].color = OBSTACLE_COLOR;
+
         //printf("%d",particles[i].color);
         //rand()%2 Never ever use this when generating random numbers
         //has very bad properties
         ii++;
     }
 
+    sort_particles_by_species();
 }
 
 void initialize_pinning_sites()
@@ -375,7 +1036,7 @@ void calculate_thermal_force()
 {
     int i;
 
-    for(i=0;i<N;i++)
+    for(i=0;i<N_mobile;i++)
     {
         //rand() gives an integer 0 ... RAND_MAX
         //rand()/(RAND_MAX+1.0) this is a double between [0,1)
@@ -385,14 +1046,94 @@ void calculate_thermal_force()
     }
 }
 
+void set_drive(int species, int type, double f0, double rate, double amplitude, int period)
+{
+    if ((type!=DRIVE_LINEAR)&&(period<=0))
+    {
+        printf("Drive of species %d needs a period\n",species);
+        exit(1);
+    }
+    drive_schedules[species].type = type;
+    drive_schedules[species].f0 = f0;
+    drive_schedules[species].rate = rate;
+    drive_schedules[species].amplitude = amplitude;
+    drive_schedules[species].period = period;
+}
+
+double evaluate_drive(struct drive_schedule_struct *d, int time)
+{
+    switch (d->type)
+    {
+        case DRIVE_STEP:
+            return d->f0 + d->amplitude * (double)(time/d->period);
+        case DRIVE_SINUSOIDAL:
+            return d->amplitude * sin(2.0*M_PI*(double)time/d->period);
+        case DRIVE_AC_DC:
+            return d->f0 + d->rate*(double)time + d->amplitude * sin(2.0*M_PI*(double)time/d->period);
+        default:
+            return d->f0 + d->rate*(double)time;
+    }
+}
+
+/*
+ Default drives: color 0 is ramped from 0 to 2.0 during the run,
+ color 1 is pushed backwards with a constant 0.5.
+ The file drives.txt, if present, overrides species, one per line:
+
+ species type f0 rate amplitude period
+
+ e.g.
+ 0 ac_dc 0.5 0.0 0.2 1000
+ */
+void setup_drives()
+{
+    int s,k,period;
+    double f0,rate,amplitude;
+    char name[64];
+    FILE *f;
+
+    for(s=0;s<MAX_SPECIES;s++)
+        set_drive(s,DRIVE_LINEAR,0.0,0.0,0.0,0);
+    set_drive(0,DRIVE_LINEAR,0.0,2.0/(double)TOTAL_TIME,0.0,0);
+    set_drive(1,DRIVE_LINEAR,-0.5,0.0,0.0,0);
+
+    f = fopen("drives.txt","rt");
+    if (f==NULL) return;
+    while (fscanf(f,"%d %63s %lf %lf %lf %d",&s,name,&f0,&rate,&amplitude,&period)==6)
+    {
+        for(k=0;k<N_DRIVE_TYPES;k++)
+            if (strcmp(drive_type_names[k],name)==0) break;
+        if ((s<0)||(s>=N_species)||(s==OBSTACLE_COLOR)||(k==N_DRIVE_TYPES))
+        {
+            printf("Bad drive for species %d: %s\n",s,name);
+            exit(1);
+        }
+        set_drive(s,k,f0,rate,amplitude,period);
+    }
+    fclose(f);
+}
+
+//evaluated once per time step, before the forces are added
+void update_drives()
+{
+    int s;
+
+    for(s=0;s<N_species;s++)
+        current_drive[s] = (s==OBSTACLE_COLOR) ? 0.0 : evaluate_drive(&drive_schedules[s],t);
+}
+
 void calculate_external_forces()
 {
-    int i;
+    int i,s;
+    double f;
 
-    for(i=0;i<N;i++)
+    //every species is a contiguous range, obstacles are not driven
+    for(s=0;s<N_species;s++)
     {
-        if (particles[i].color==0)    particles[i].fx += 2.0*(double)t/100000.0;
-        if (particles[i].color==1)    particles[i].fx -= 0.5;
+        if (s==OBSTACLE_COLOR) continue;
+        f = current_drive[s];
+        for(i=species_start[s];i<species_start[s+1];i++)
+            particles[i].fx += f;
     }
 }
 
@@ -401,7 +1142,7 @@ void calculate_pinning_force()
 int i,j;
 double dx,dy,dr2,dr,f,fx,fy;
 
- for(i=0;i<N;i++)
+ for(i=0;i<N_mobile;i++)
     for(j=0;j<N_pins;j++)
         {
             dx = particles[i].x - pinningsites[j].x;
@@ -434,14 +1175,77 @@ double dx,dy,dr2,dr,f,fx,fy;
 
 }
 
-void calculate_pairwise_forces()
+//stores what the observables variant of a force kernel summed up
+void set_observables(double e_pot, double wxx, double wxy, double wyy)
+{
+    observables.e_pot = e_pot;
+    observables.wxx = wxx;
+    observables.wxy = wxy;
+    observables.wyy = wyy;
+    gr_samples++;
+}
+
+//puts a pair of type k into the g(r) histogram
+static inline void gr_add(int k, double dr2)
+{
+    int bin;
+
+    if (dr2 < gr_r2_max[k])
+    {
+        //just below r_max the product can round up to N_GR_BINS
+        bin = (int)(sqrt(dr2)*gr_per_dr[k]);
+        gr_hist[k][(bin < N_GR_BINS) ? bin : N_GR_BINS-1]++;
+    }
+}
+
+/*
+Pair force kernels
+
+ Every kernel is written once as a static inline function with constant
+ flags and called with every combination of them, so the compiler builds
+ a separate loop for each case. with_observables adds the potential energy
+ and the virial to the loop: the sampling steps pay a few extra flops per
+ pair, every other step runs exactly the same loop as before. use_table
+ reads the force and the energy from the tables of tabulate_forces
+ instead of calculating them.
+ */
+
+//the tabulated f/r of pair type ty at distance^2 dr2; *tab_index is
+//where its energy is in tabulated_u
+static inline double table_force_per_r(int ty, double dr2, int *tab_index)
+{
+    int k,index;
+
+    //recall the tabulated value of the force
+    k = ty*(N_tabulated+1);
+    index = (int) ((dr2 - tabulalt_start) * tabulalt_per_lepes);
+    //beyond the table reads the 0.0 at the end
+    index = (index > N_tabulated) ? N_tabulated : index;
+
+    if (index >= 0)
+    {
+        *tab_index = k+index;
+        return tabulated_f_per_r[k+index];  //f/dr is what I recalled
+    }
+    //closer than the table: the first entry is F(r_min)/r_min,
+    //and like pair_force_per_r it is F(r_min)/dr here
+    *tab_index = k;
+    return tabulated_f_per_r[k]*sqrt(tabulalt_start/dr2);
+}
+
+static inline void pairwise_forces_kernel(const int use_table, const int with_observables)
 {
     int i,j;
     double dx,dy;
-    double dr2,dr;
-    double f,fx,fy;
+    double dr2;
+    double f_per_r,fx,fy;
+    double u = 0.0;
+    int tab_index;
+    struct pair_potential_struct *p;
+    double e_pot = 0.0, wxx = 0.0, wxy = 0.0, wyy = 0.0;
 
-    for(i=0;i<N-1;i++)
+    //obstacle-obstacle pairs are skipped, as in the Verlet list
+    for(i=0;i<N_mobile;i++)
         for(j=i+1;j<N;j++)
         {
             dx = particles[i].x - particles[j].x;
@@ -456,21 +1260,35 @@ void calculate_pairwise_forces()
 
             dr2 = dx*dx+dy*dy;
 
-            //we are calculating the forces directly
-            dr = sqrt(dr2);
-
-            if (dr<0.2) f = 100.0;
-            //nice way to do this: give a warning or exit if this happens
+            if (use_table)
+            {
+                f_per_r = table_force_per_r(PAIR_TYPE(particles[i].color,particles[j].color),
+                                            dr2,&tab_index);
+                if (with_observables)
+                    u = tabulated_u[tab_index];
+            }
             else
-                //check if dr>4.0 I can cut off the force
             {
-                f = 1/dr2 * exp(-0.25*dr);
+                //we are calculating the forces directly
+                //(too close pairs feel the force at r_min)
+                p = &pair_potentials[particles[i].color][particles[j].color];
+                f_per_r = pair_force_per_r(p,dr2);
+                if (with_observables)
+                    u = pair_energy(p,dr2);
             }
 
             //project it to the axes get the fx, fy components
-            fx = f*dx/dr;
-            fy = f*dy/dr;
+            fx = f_per_r*dx;
+            fy = f_per_r*dy;
 
+            if (with_observables)
+            {
+                e_pot += u;
+                wxx += fx*dx;
+                wxy += fx*dy;
+                wyy += fy*dy;
+                gr_add(PAIR_TYPE(particles[i].color,particles[j].color),dr2);
+            }
 
             particles[i].fx += fx;
             particles[i].fy += fy;
@@ -478,15 +1296,35 @@ void calculate_pairwise_forces()
             particles[j].fx -= fx;
             particles[j].fy -= fy;
         }
+
+    if (with_observables)
+        set_observables(e_pot,wxx,wxy,wyy);
 }
 
-void calculate_pairwise_forces_with_verlet(int run_type)
+void calculate_pairwise_forces(int run_type)
+{
+    int use_table = (run_type==1);
+
+    if (use_table && sample_observables)
+        pairwise_forces_kernel(1,1);
+    else if (use_table)
+        pairwise_forces_kernel(1,0);
+    else if (sample_observables)
+        pairwise_forces_kernel(0,1);
+    else
+        pairwise_forces_kernel(0,0);
+}
+
+static inline void pairwise_forces_verlet_kernel(const int use_table, const int with_observables)
 {
     int i,j,ii;
     double dx,dy;
-    double dr2,dr;
-    double f,fx,fy;
+    double dr2;
+    double f_per_r,fx,fy;
+    double u = 0.0;
     int tab_index;
+    struct pair_potential_struct *p;
+    double e_pot = 0.0, wxx = 0.0, wxy = 0.0, wyy = 0.0;
 
     for(ii=0;ii<N_vlist;ii++)
     {
@@ -504,48 +1342,62 @@ void calculate_pairwise_forces_with_verlet(int run_type)
 
         dr2 = dx*dx+dy*dy;
 
-        //recall the tabulated value of the force
-
-         if (run_type==1||run_type==3) {
-             tab_index = (int) floor((dr2 - tabulalt_start) / (tabulalt_lepes));
-             if ((tab_index >= N_tabulated)) {
-                 //printf("tab_index = %d\n",tab_index);
-                 //tab_index = N_tabulated-1;
-                 //exit(1);
-                 fx = 0.0;
-                 fy = 0.0;
-             } else {
-                 fx = tabulated_f_per_r[tab_index] * dx;  //f/dr is what I recalled
-                 fy = tabulated_f_per_r[tab_index] * dy;
-             }
-
-         }
-        else {
-             //direct calculation of the force
-
-             dr = sqrt(dr2); //this is EVIL
-
-             if (dr < 0.1) {
-                 f = 97.53;
-                 printf("Warning! Particles %d and %d too close at time %d\n", i, j, t);
-             } else
-                 //check if dr>4.0 I can cut off the force
-             {
-                 f = 1 / dr2 * exp(-0.25 * dr);
-             }
-
-             fx = f * dx / dr;
-             fy = f * dy / dr;
-             //printf("%lf %lf hasonlitva %lf %lf\n",fx,fy,f*dx/dr,f*dy/dr);
-         }
+        if (use_table)
+        {
+            f_per_r = table_force_per_r(PAIR_TYPE(particles[i].color,particles[j].color),
+                                        dr2,&tab_index);
+            if (with_observables)
+                u = tabulated_u[tab_index];
+        }
+        else
+        {
+            p = &pair_potentials[particles[i].color][particles[j].color];
+
+            //direct calculation of the force
+
+            if (dr2 < p->r_min*p->r_min)
+                printf("Warning! Particles %d and %d too close at time %d\n", i, j, t);
+
+            f_per_r = pair_force_per_r(p,dr2);
+            if (with_observables)
+                u = pair_energy(p,dr2);
+        }
+
+        fx = f_per_r * dx;
+        fy = f_per_r * dy;
+
+        if (with_observables)
+        {
+            e_pot += u;
+            wxx += fx*dx;
+            wxy += fx*dy;
+            wyy += fy*dy;
+            gr_add(PAIR_TYPE(particles[i].color,particles[j].color),dr2);
+        }
 
         particles[i].fx += fx;
         particles[i].fy += fy;
         particles[j].fx -= fx;
         particles[j].fy -= fy;
     }
+
+    if (with_observables)
+        set_observables(e_pot,wxx,wxy,wyy);
 }
 
+void calculate_pairwise_forces_with_verlet(int run_type)
+{
+    int use_table = (run_type==1||run_type==3);
+
+    if (use_table && sample_observables)
+        pairwise_forces_verlet_kernel(1,1);
+    else if (use_table)
+        pairwise_forces_verlet_kernel(1,0);
+    else if (sample_observables)
+        pairwise_forces_verlet_kernel(0,1);
+    else
+        pairwise_forces_verlet_kernel(0,0);
+}
 
 /*
  * re-run all with 0 and 2
@@ -557,7 +1409,7 @@ void move_particles()
     int i;
     double deltax,deltay;
 
-    for(i=0;i<N;i++)
+    for(i=0;i<N_mobile;i++)
     {
         //brownian dynamics
         //the particle is in a highly viscous environment
@@ -567,12 +1419,15 @@ void move_particles()
         particles[i].x += deltax;
         particles[i].y += deltay;
 
+        particles[i].ux += deltax;
+        particles[i].uy += deltay;
+
         particles[i].drx_so_far += deltax;
         particles[i].dry_so_far += deltay;
 
 
         if ((particles[i].drx_so_far*particles[i].drx_so_far +
-             particles[i].dry_so_far*particles[i].dry_so_far) >= 4.0)
+             particles[i].dry_so_far*particles[i].dry_so_far) >= verlet_skin*verlet_skin)
             flag_to_rebuild_Verlet = 1;
 
         //PBC check - check if they left the box
@@ -581,9 +1436,20 @@ void move_particles()
         if (particles[i].y > SY) particles[i].y -=SY;
         if (particles[i].x < 0) particles[i].x +=SX;
         if (particles[i].y < 0) particles[i].y +=SY;
-
-        particles[i].fx = 0.0;
-        particles[i].fy = 0.0;
+    }
+}
+
+//at the start of a step; the forces of the previous one are kept until
+//then, for the movie (velocities of the frame written after the move).
+//The obstacles do not move, but the kernels add the reaction to them too
+void clear_forces()
+{
+    int i;
+
+    for(i=0;i<N;i++)
+    {
+        particles[i].fx = 0.0;
+        particles[i].fy = 0.0;
     }
 }
 
@@ -606,54 +1472,1643 @@ void write_movie_frame()
         fprintf(moviefile,"%lf %lf %lf ",particles[i].x, particles[i].y,0.0);
         if (particles[i].color==0) fprintf(moviefile,"%lf %lf %lf\n",1.0,0.0,0.0);
         else if (particles[i].color==1) fprintf(moviefile,"%lf %lf %lf\n",0.0,0.0,1.0);
+        else fprintf(moviefile,"%lf %lf %lf\n",0.5,0.5,0.5);
+    }
+
+}
+
+double wall_seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec + 1e-9*now.tv_nsec;
+}
+
+void pwrite_all(const char *p, size_t len, off_t offset)
+{
+    ssize_t done;
+    double start;
+
+    while (len>0)
+    {
+        start = wall_seconds();
+        done = pwrite(mio.fd,p,len,offset);
+        mio.io_time += wall_seconds()-start;
+        if (done<0)
+        {
+            perror("Movie write failed");
+            exit(1);
+        }
+        p += done;
+        len -= done;
+        offset += done;
+    }
+}
+
+#ifdef HAVE_IO_URING
+//io_uring with the bare system calls (liburing is not needed)
+struct uring_struct
+{
+    int fd;
+    unsigned *sq_tail,*sq_mask,*sq_array;
+    unsigned *cq_head,*cq_tail,*cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring,*cq_ring;
+    size_t sq_size,cq_size,sqes_size;
+} uring;
+
+void uring_exit()
+{
+    if (uring.sqes!=NULL) munmap(uring.sqes,uring.sqes_size);
+    if ((uring.cq_ring!=NULL)&&(uring.cq_ring!=uring.sq_ring)) munmap(uring.cq_ring,uring.cq_size);
+    if (uring.sq_ring!=NULL) munmap(uring.sq_ring,uring.sq_size);
+    close(uring.fd);
+    uring.sqes = NULL;
+    uring.sq_ring = uring.cq_ring = NULL;
+}
+
+//a ring of MOVIE_IO_BUFFERS entries; 0 if the kernel has no io_uring
+int uring_setup()
+{
+    struct io_uring_params p;
+    char *sq,*cq;
+    void *m;
+
+    memset(&p,0,sizeof(p));
+    uring.fd = syscall(__NR_io_uring_setup,MOVIE_IO_BUFFERS,&p);
+    if (uring.fd<0) return 0;
+    uring.sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    uring.cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    uring.sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (uring.cq_size>uring.sq_size) uring.sq_size = uring.cq_size;
+        uring.cq_size = uring.sq_size;
+    }
+    uring.sq_ring = uring.cq_ring = NULL;
+    uring.sqes = NULL;
+
+    m = mmap(NULL,uring.sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+             uring.fd,IORING_OFF_SQ_RING);
+    if (m==MAP_FAILED)
+    {
+        uring_exit();
+        return 0;
+    }
+    uring.sq_ring = uring.cq_ring = m;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        m = mmap(NULL,uring.cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                 uring.fd,IORING_OFF_CQ_RING);
+        if (m==MAP_FAILED)
+        {
+            uring.cq_ring = NULL;
+            uring_exit();
+            return 0;
+        }
+        uring.cq_ring = m;
+    }
+    m = mmap(NULL,uring.sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+             uring.fd,IORING_OFF_SQES);
+    if (m==MAP_FAILED)
+    {
+        uring_exit();
+        return 0;
+    }
+    uring.sqes = (struct io_uring_sqe *)m;
+
+    sq = (char *)uring.sq_ring;
+    cq = (char *)uring.cq_ring;
+    uring.sq_tail = (unsigned *)(sq+p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq+p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq+p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq+p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq+p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq+p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq+p.cq_off.cqes);
+    return 1;
+}
+
+//submits the write of buffer b (mio.length[b] bytes at mio.at[b])
+void uring_write(int b)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail,index;
+    double start;
+    long res;
+
+    tail = *uring.sq_tail;
+    index = tail & *uring.sq_mask;
+    sqe = &uring.sqes[index];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = mio.fd;
+    sqe->addr = (unsigned long)mio.buffer[b];
+    sqe->len = mio.length[b];
+    sqe->off = mio.at[b];
+    sqe->user_data = b;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail,tail+1,__ATOMIC_RELEASE);
+    start = wall_seconds();
+    res = syscall(__NR_io_uring_enter,uring.fd,1,0,0,NULL,0);
+    mio.io_time += wall_seconds()-start;
+    if (res<0)
+    {
+        perror("Movie write failed");
+        exit(1);
+    }
+}
+
+//waits for a write to complete and frees its buffer
+void uring_complete()
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int b,res;
+    double start;
+
+    head = *uring.cq_head;
+    start = wall_seconds();
+    while (head==__atomic_load_n(uring.cq_tail,__ATOMIC_ACQUIRE))
+        syscall(__NR_io_uring_enter,uring.fd,0,1,IORING_ENTER_GETEVENTS,NULL,0);
+    mio.io_time += wall_seconds()-start;
+    cqe = &uring.cqes[head & *uring.cq_mask];
+    b = (int)cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(uring.cq_head,head+1,__ATOMIC_RELEASE);
+    if (res<0)
+    {
+        printf("Movie write failed: %s\n",strerror(-res));
+        exit(1);
+    }
+    //a short write: the rest the plain way
+    if ((size_t)res<mio.length[b])
+        pwrite_all(mio.buffer[b]+res,mio.length[b]-res,mio.at[b]+res);
+    mio.busy[b] = 0;
+}
+#else
+int uring_setup() { return 0; }
+void uring_exit() {}
+void uring_write(int b) {}
+void uring_complete() {}
+#endif
+
+void movie_io_open(const char *filename)
+{
+    int b,flags;
+
+    mio.backend = movie_io;
+    mio.bytes = 0;
+    mio.wait = 0.0;
+    mio.io_time = 0.0;
+    mio.start = wall_seconds();
+    if (mio.backend==MOVIE_IO_STDIO)
+    {
+        moviefile = fopen(filename,"wb");
+        return;
+    }
+
+    flags = O_WRONLY|O_CREAT|O_TRUNC;
+    mio.fd = -1;
+    if (movie_direct)
+    {
+        mio.fd = open(filename,flags|O_DIRECT,0644);
+        if (mio.fd<0) printf("No O_DIRECT for %s, it goes through the page cache\n",filename);
+    }
+    if (mio.fd<0) mio.fd = open(filename,flags,0644);
+    if (mio.fd<0)
+    {
+        perror(filename);
+        exit(1);
+    }
+    if ((mio.backend==MOVIE_IO_URING)&&(!uring_setup()))
+    {
+        printf("No io_uring, the movie is written with pwrite\n");
+        mio.backend = MOVIE_IO_PWRITE;
+    }
+    for(b=0;b<MOVIE_IO_BUFFERS;b++)
+    {
+        if ((mio.buffer[b]==NULL)&&
+            (posix_memalign((void **)&mio.buffer[b],MOVIE_IO_ALIGN,movie_io_size)!=0))
+        {
+            printf("Out of memory for the movie\n");
+            exit(1);
+        }
+        mio.busy[b] = 0;
+    }
+    mio.current = 0;
+    mio.fill = 0;
+    mio.offset = 0;
+}
+
+//sends the current buffer to the disk and goes on with the next one,
+//once it is free
+void movie_io_submit()
+{
+    double start;
+    int b;
+
+    start = wall_seconds();
+    b = mio.current;
+    mio.length[b] = mio.fill;
+    mio.at[b] = mio.offset;
+    if (mio.backend==MOVIE_IO_URING)
+    {
+        mio.busy[b] = 1;
+        uring_write(b);
+    }
+    else
+        pwrite_all(mio.buffer[b],mio.fill,mio.offset);
+    mio.offset += mio.fill;
+    mio.fill = 0;
+    mio.current = (b+1)%MOVIE_IO_BUFFERS;
+    while (mio.busy[mio.current])
+        uring_complete();
+    mio.wait += wall_seconds()-start;
+}
+
+//fwrite to the movie
+void movie_write(const void *p, size_t size, size_t n)
+{
+    const char *src;
+    size_t len,part;
+
+    len = size*n;
+    mio.bytes += len;
+    if (mio.backend==MOVIE_IO_STDIO)
+    {
+        fwrite(p,size,n,moviefile);
+        return;
+    }
+    src = (const char *)p;
+    while (len>0)
+    {
+        part = movie_io_size-mio.fill;
+        if (part>len) part = len;
+        memcpy(mio.buffer[mio.current]+mio.fill,src,part);
+        mio.fill += part;
+        src += part;
+        len -= part;
+        if (mio.fill==(size_t)movie_io_size) movie_io_submit();
     }
+}
 
+void movie_io_close()
+{
+    static const char *names[] = {"stdio","pwrite","io_uring"};
+    double start,elapsed;
+    int b;
+
+    start = wall_seconds();
+    if (mio.backend==MOVIE_IO_STDIO)
+        fclose(moviefile);
+    else
+    {
+        for(b=0;b<MOVIE_IO_BUFFERS;b++)
+            while (mio.busy[b]) uring_complete();
+        //the end is not a whole number of blocks: no O_DIRECT for it
+        if (mio.fill>0)
+        {
+            if (movie_direct) fcntl(mio.fd,F_SETFL,fcntl(mio.fd,F_GETFL)&~O_DIRECT);
+            pwrite_all(mio.buffer[mio.current],mio.fill,mio.offset);
+        }
+        close(mio.fd);
+        if (mio.backend==MOVIE_IO_URING) uring_exit();
+    }
+    mio.wait += wall_seconds()-start;
+    elapsed = wall_seconds()-mio.start;
+    printf("Movie: %.2f MB with %s, %.2f MB/s over the run, %.3f s waiting for the disk\n",
+           mio.bytes/1e6,names[mio.backend],(elapsed>0.0) ? mio.bytes/1e6/elapsed : 0.0,mio.wait);
+    //stdio hides its writes in fwrite and fclose, there is no disk time
+    if ((mio.backend!=MOVIE_IO_STDIO)&&(mio.io_time>0.0))
+        printf("Movie: %.2f MB/s to the disk (%.3f s in the write calls)\n",
+               mio.bytes/1e6/mio.io_time,mio.io_time);
 }
 
 //this is for plot(linux plotter)
-void write_cmovie()
+void write_cmovie(struct movie_snapshot_struct *s)
 {
     int i;
     float floatholder;
     int intholder;
 
-    intholder = N;
-    fwrite(&intholder,sizeof(int),1,moviefile);
+    intholder = s->n;
+    movie_write(&intholder,sizeof(int),1);
 
-    intholder = t;
-    fwrite(&intholder,sizeof(int),1,moviefile);
+    intholder = s->t;
+    movie_write(&intholder,sizeof(int),1);
 
-    for (i=0;i<N;i++)
+    for (i=0;i<s->n;i++)
     {
-        intholder = particles[i].color+2;
-        fwrite(&intholder,sizeof(int),1,moviefile);
-        intholder = i;//ID
-        fwrite(&intholder,sizeof(int),1,moviefile);
-        floatholder = (float)particles[i].x;
-        fwrite(&floatholder,sizeof(float),1, moviefile);
-        floatholder = (float)particles[i].y;
-        fwrite(&floatholder,sizeof(float),1,moviefile);
+        intholder = s->color[i]+2;
+        movie_write(&intholder,sizeof(int),1);
+        intholder = s->id[i];//ID
+        movie_write(&intholder,sizeof(int),1);
+        floatholder = (float)s->x[i];
+        movie_write(&floatholder,sizeof(float),1);
+        floatholder = (float)s->y[i];
+        movie_write(&floatholder,sizeof(float),1);
         floatholder = 1.0;//cum_disp, cmovie format
-        fwrite(&floatholder,sizeof(float),1,moviefile);
+        movie_write(&floatholder,sizeof(float),1);
     }
 
 }
 
-void write_statistics()
+//packed movie, the file starts with
+//  "ZMV1" bits block SX SY                 (char[4], 2 ints, 2 floats)
+//and every frame is
+//  N t size key kx ky kc payload          (3 ints, 4 bytes, size-4 bytes)
+//key frames (key=1) code the colors and positions, the others only the
+//change of the positions since the previous frame; x and y are
+//quantized to 2^bits steps of the box, the differences wrapped around
+//the box, zigzag mapped to unsigned and Rice coded with parameter kx, ky
+//(kc for the colors). When the IDs are not the index (sorted by
+//species, or filtered) the key frame has key=3, its payload starts with
+//a byte ki and the IDs follow the colors (each less the one before,
+//less one, parameter ki); the frames up to the next key frame have the
+//same particles. cum_disp is not stored.
+void open_packed_movie(const char *filename)
 {
-int i;
-double avg_vx;
+    int intholder;
+    float floatholder;
+
+    movie_io_open(filename);
+    movie_write(PACK_MAGIC,1,4);
+    intholder = movie_bits;
+    movie_write(&intholder,sizeof(int),1);
+    intholder = movie_block;
+    movie_write(&intholder,sizeof(int),1);
+    floatholder = (float)SX;
+    movie_write(&floatholder,sizeof(float),1);
+    floatholder = (float)SY;
+    movie_write(&floatholder,sizeof(float),1);
+    pack_n = 0;
+    pack_frames = 0;
+}
+
+//bit writer over pack_buffer, least significant bit first
+struct bit_writer_struct
+{
+    unsigned char *p;
+    unsigned long long acc;
+    int n_acc;
+};
+
+static inline void put_bits(struct bit_writer_struct *w, unsigned int value, int n)
+{
+    w->acc |= (unsigned long long)value << w->n_acc;
+    w->n_acc += n;
+    while (w->n_acc >= 8)
+    {
+        *w->p++ = (unsigned char)w->acc;
+        w->acc >>= 8;
+        w->n_acc -= 8;
+    }
+}
+
+//Rice code of u with parameter k: u>>k in unary, then the low k bits
+static inline void put_rice(struct bit_writer_struct *w, unsigned int u, int k)
+{
+    unsigned int q;
+
+    q = u>>k;
+    if (q>=PACK_ESCAPE)
+    {
+        put_bits(w,(1u<<PACK_ESCAPE)-1,PACK_ESCAPE);
+        put_bits(w,u&0xffff,16);
+        put_bits(w,u>>16,16);
+        return;
+    }
+    put_bits(w,(1u<<q)-1,q+1);      //q ones and a zero
+    if (k>0) put_bits(w,u&((1u<<k)-1),k);
+}
+
+//the Rice parameter for values u[0..n-1]: 2^k about their mean
+int rice_parameter(unsigned int *u, int n)
+{
+    int i,k;
+    unsigned long long sum;
+
+    sum = 0;
+    for(i=0;i<n;i++) sum += u[i];
+    k = 0;
+    while ((k<30)&&((unsigned long long)n<<(k+1) <= sum)) k++;
+    return k;
+}
+
+static inline unsigned int zigzag(int d)
+{
+    return ((unsigned int)d<<1)^(unsigned int)(d>>31);
+}
+
+//position x in [0,box) as one of 2^movie_bits steps
+static inline unsigned int quantize(double x, double box)
+{
+    double q;
+
+    q = x/box*(double)(1u<<movie_bits);
+    if (q<0.0) q = 0.0;
+    if (q>(double)((1u<<movie_bits)-1)) q = (double)((1u<<movie_bits)-1);
+    return (unsigned int)q;
+}
+
+//difference of two quantized coordinates, taken the short way around the box
+static inline int wrapped_difference(unsigned int q, unsigned int q_old)
+{
+    int d,half;
+
+    half = 1<<(movie_bits-1);
+    d = (int)q-(int)q_old;
+    if (d>=half) d -= 2*half;
+    if (d<-half) d += 2*half;
+    return d;
+}
+
+void reserve_snapshot(struct movie_snapshot_struct *s, int n)
+{
+    if (s->allocated>=n) return;
+    s->x = (double *)realloc(s->x,n*sizeof(double));
+    s->y = (double *)realloc(s->y,n*sizeof(double));
+    s->fx = (double *)realloc(s->fx,n*sizeof(double));
+    s->fy = (double *)realloc(s->fy,n*sizeof(double));
+    s->color = (int *)realloc(s->color,n*sizeof(int));
+    s->id = (int *)realloc(s->id,n*sizeof(int));
+    if ((s->x==NULL)||(s->y==NULL)||(s->fx==NULL)||(s->fy==NULL)||(s->color==NULL)||(s->id==NULL))
+    {
+        printf("Out of memory for the movie\n");
+        exit(1);
+    }
+    s->allocated = n;
+}
+
+void take_snapshot(struct movie_snapshot_struct *s)
+{
+    int i;
+
+    reserve_snapshot(s,N);
+    s->t = t;
+    s->n = N;
+    for(i=0;i<N;i++)
+    {
+        s->x[i] = particles[i].x;
+        s->y[i] = particles[i].y;
+        s->fx[i] = particles[i].fx;
+        s->fy[i] = particles[i].fy;
+        s->color[i] = particles[i].color;
+        s->id[i] = particles[i].ID;
+    }
+}
+
+int movie_filtering()
+{
+    return movie_window || (movie_species!=~0u) || (movie_every>1);
+}
+
+//with movie_adaptive: is frame s to be written?
+int movie_frame_due(struct movie_snapshot_struct *s)
+{
+    double vx,vy,dvx,dvy;
+    int i;
+
+    if (!movie_adaptive) return 1;
+    vx = vy = 0.0;
+    for(i=0;i<N_mobile;i++)
+    {
+        vx += s->fx[i];
+        vy += s->fy[i];
+    }
+    if (N_mobile>0)
+    {
+        vx /= N_mobile;
+        vy /= N_mobile;
+    }
+    dvx = vx-movie_last_vx;
+    dvy = vy-movie_last_vy;
+    if ((movie_frames_kept>0)&&(s->t-movie_last_t<movie_interval)&&
+        (dvx*dvx+dvy*dvy<=movie_velocity_change*movie_velocity_change))
+        return 0;
+    movie_last_t = s->t;
+    movie_last_vx = vx;
+    movie_last_vy = vy;
+    return 1;
+}
+
+//the particles of s that pass the window, species and every-k filters
+struct movie_snapshot_struct *movie_filter(struct movie_snapshot_struct *s)
+{
+    struct movie_snapshot_struct *f;
+    int i,c,k,n;
+
+    if (!movie_filtering()) return s;
+    f = &movie_filtered;
+    reserve_snapshot(f,s->n);
+    f->t = s->t;
+    n = 0;
+    k = 0;
+    for(i=0;i<s->n;i++)
+    {
+        c = s->color[i];
+        if ((c<0)||(c>31)||!(movie_species & (1u<<c))) continue;
+        if (movie_window && ((s->x[i]<movie_xmin)||(s->x[i]>=movie_xmax)||
+                             (s->y[i]<movie_ymin)||(s->y[i]>=movie_ymax)))
+            continue;
+        if (k++%movie_every!=0) continue;
+        f->x[n] = s->x[i];
+        f->y[n] = s->y[i];
+        f->fx[n] = s->fx[i];
+        f->fy[n] = s->fy[i];
+        f->color[n] = c;
+        f->id[n] = s->id[i];
+        n++;
+    }
+    f->n = n;
+    return f;
+}
+
+//bytes pack_frame may need for n particles (an escaped value takes 7)
+int packed_frame_bound(int n)
+{
+    return 17+4*n*7+8 + 2*n*(int)sizeof(float);
+}
+
+//codes s as a packed frame at out and returns its length
+//with_force: the frame is followed by fx,fy of every particle (floats)
+int pack_frame(struct movie_snapshot_struct *s, unsigned char *out, int with_force)
+{
+    struct bit_writer_struct w;
+    unsigned int *ux,*uy,*uc,*ui;
+    unsigned char key,kx,ky,kc,ki;
+    int i,n,size,with_id;
+    float floatholder;
+
+    n = s->n;
+    //a new particle number starts a new key frame
+    if (pack_n!=n)
+    {
+        pack_qx = (unsigned int *)realloc(pack_qx,n*sizeof(unsigned int));
+        pack_qy = (unsigned int *)realloc(pack_qy,n*sizeof(unsigned int));
+        pack_u = (unsigned int *)realloc(pack_u,4*n*sizeof(unsigned int));
+        pack_id = (int *)realloc(pack_id,n*sizeof(int));
+        if ((pack_qx==NULL)||(pack_qy==NULL)||(pack_u==NULL)||(pack_id==NULL))
+        {
+            printf("Out of memory for the packed movie\n");
+            exit(1);
+        }
+        pack_frames = 0;
+    }
+    //so do other particles than before (a window: some left, some came)
+    else if (memcmp(pack_id,s->id,n*sizeof(int))!=0)
+        pack_frames = 0;
+    memcpy(pack_id,s->id,n*sizeof(int));
+    ux = pack_u;
+    uy = ux + n;
+    uc = uy + n;
+    ui = uc + n;
+
+    key = (pack_frames%movie_block==0);
+    //the IDs, if they are not the index
+    with_id = 0;
+    if (key)
+    {
+        for(i=0;i<n;i++)
+        {
+            ui[i] = zigzag(s->id[i]-((i>0)?s->id[i-1]+1:0));
+            if (s->id[i]!=i) with_id = 1;
+        }
+    }
+    for(i=0;i<n;i++)
+    {
+        unsigned int qx,qy;
+
+        qx = quantize(s->x[i],SX);
+        qy = quantize(s->y[i],SY);
+        if (key)
+        {
+            //against the previous particle; the colors come in runs
+            ux[i] = zigzag(wrapped_difference(qx,(i>0)?pack_qx[i-1]:0));
+            uy[i] = zigzag(wrapped_difference(qy,(i>0)?pack_qy[i-1]:0));
+            uc[i] = zigzag(s->color[i]+2-((i>0)?s->color[i-1]+2:0));
+        }
+        else
+        {
+            ux[i] = zigzag(wrapped_difference(qx,pack_qx[i]));
+            uy[i] = zigzag(wrapped_difference(qy,pack_qy[i]));
+        }
+        pack_qx[i] = qx;
+        pack_qy[i] = qy;
+    }
+    kx = rice_parameter(ux,n);
+    ky = rice_parameter(uy,n);
+    kc = key ? rice_parameter(uc,n) : 0;
+
+    w.p = out+16;
+    w.acc = 0;
+    w.n_acc = 0;
+    if (with_id)
+    {
+        ki = rice_parameter(ui,n);
+        *w.p++ = ki;
+    }
+    if (key)
+        for(i=0;i<n;i++) put_rice(&w,uc[i],kc);
+    if (with_id)
+        for(i=0;i<n;i++) put_rice(&w,ui[i],ki);
+    for(i=0;i<n;i++) put_rice(&w,ux[i],kx);
+    for(i=0;i<n;i++) put_rice(&w,uy[i],ky);
+    if (w.n_acc>0) put_bits(&w,0,8-w.n_acc);
+    size = (int)(w.p-out)-12;
+
+    memcpy(out,&n,sizeof(int));
+    memcpy(out+4,&s->t,sizeof(int));
+    memcpy(out+8,&size,sizeof(int));
+    out[12] = key | (with_id<<1);
+    out[13] = kx;
+    out[14] = ky;
+    out[15] = kc;
+    if (with_force)
+        for(i=0;i<n;i++)
+        {
+            floatholder = (float)s->fx[i];
+            memcpy(w.p,&floatholder,sizeof(float));
+            w.p += sizeof(float);
+            floatholder = (float)s->fy[i];
+            memcpy(w.p,&floatholder,sizeof(float));
+            w.p += sizeof(float);
+        }
+
+    pack_n = n;
+    pack_frames++;
+    return (int)(w.p-out);
+}
+
+void write_packed_movie(struct movie_snapshot_struct *s)
+{
+    static int allocated = 0;
+    int length;
 
-avg_vx = 0.0;
-for (i=0;i<N;i++)
+    if (allocated<packed_frame_bound(s->n))
     {
-        avg_vx += particles[i].fx;
+        allocated = packed_frame_bound(s->n);
+        pack_buffer = (unsigned char *)realloc(pack_buffer,allocated);
+        if (pack_buffer==NULL)
+        {
+            printf("Out of memory for the packed movie\n");
+            exit(1);
+        }
     }
+    length = pack_frame(s,pack_buffer,0);
+    movie_write(pack_buffer,1,length);
+}
+
+//container movie, the file is
+//  "MDT1" header_size header                   (char[4], int, text)
+//  chunk chunk ...
+//the header has one "name value" line per run parameter (box_x, box_y,
+//dt, run_type, seed, ..., fields); a reader skips names it does not
+//know. A chunk holds up to movie_block frames, the first a key frame:
+//  "CHNK" chunk_size n offset[n] time[n] frames
+//chunk_size counts the whole chunk, offset[k] is where frame k starts,
+//from the start of the chunk. The frames are packed frames, followed
+//by fx,fy of every particle (floats) if the fields include them.
+void write_chunk()
+{
+    int i,intholder;
+
+    if (chunk_frames==0) return;
+    for(i=0;i<chunk_frames;i++)
+        chunk_offset[i] += 12+8*chunk_frames;
+    movie_write(CHUNK_MAGIC,1,4);
+    intholder = 12+8*chunk_frames+chunk_bytes;
+    movie_write(&intholder,sizeof(int),1);
+    movie_write(&chunk_frames,sizeof(int),1);
+    movie_write(chunk_offset,sizeof(int),chunk_frames);
+    movie_write(chunk_time,sizeof(int),chunk_frames);
+    movie_write(chunk_data,1,chunk_bytes);
+    chunk_bytes = 0;
+    chunk_frames = 0;
+}
+
+//adds s to the chunk, and writes the chunk when it has movie_block frames
+void write_container_frame(struct movie_snapshot_struct *s)
+{
+    int bound;
+
+    //a chunk starts with a key frame
+    if (chunk_frames==0) pack_frames = 0;
+    bound = packed_frame_bound(s->n);
+    if (chunk_bytes+bound>chunk_allocated)
+    {
+        chunk_allocated = 2*(chunk_bytes+bound);
+        chunk_data = (unsigned char *)realloc(chunk_data,chunk_allocated);
+        if (chunk_data==NULL)
+        {
+            printf("Out of memory for the movie\n");
+            exit(1);
+        }
+    }
+    chunk_offset[chunk_frames] = chunk_bytes;
+    chunk_time[chunk_frames] = s->t;
+    chunk_bytes += pack_frame(s,chunk_data+chunk_bytes,movie_force);
+    chunk_frames++;
+    if (chunk_frames==movie_block) write_chunk();
+}
+
+void open_container_movie(const char *filename, int run_type)
+{
+    char header[1024];
+    int s,len;
+
+    movie_io_open(filename);
+    len = sprintf(header,"box_x %lf\nbox_y %lf\ndt %lf\nrun_type %d\nseed %u\n"
+                  "particles %d\nmobile %d\nspecies %d\nspecies_counts",
+                  SX,SY,dt,run_type,random_seed,N,N_mobile,N_species);
+    for(s=0;s<N_species;s++)
+        len += sprintf(header+len," %d",species_start[s+1]-species_start[s]);
+    len += sprintf(header+len,"\nmovie_interval %d\nbits %d\nblock %d\n"
+                   "fields x y color%s\n",movie_interval,movie_bits,movie_block,
+                   movie_force ? " fx fy" : "");
+    if (movie_window)
+        len += sprintf(header+len,"window %lf %lf %lf %lf\n",
+                       movie_xmin,movie_xmax,movie_ymin,movie_ymax);
+    if (movie_species!=~0u)
+        len += sprintf(header+len,"species_mask %u\n",movie_species);
+    if (movie_every>1)
+        len += sprintf(header+len,"every %d\n",movie_every);
+    if (movie_adaptive)
+        len += sprintf(header+len,"adaptive %d %lf\n",movie_fine_interval,movie_velocity_change);
+    movie_write(CONTAINER_MAGIC,1,4);
+    movie_write(&len,sizeof(int),1);
+    movie_write(header,1,len);
+
+    chunk_offset = (int *)realloc(chunk_offset,movie_block*sizeof(int));
+    chunk_time = (int *)realloc(chunk_time,movie_block*sizeof(int));
+    chunk_bytes = 0;
+    chunk_frames = 0;
+    pack_n = 0;
+}
 
-avg_vx = avg_vx/(double)N;
+void open_movie(const char *filename, int run_type)
+{
+    movie_frames_offered = movie_frames_kept = 0;
+    movie_particles_offered = movie_particles_kept = 0;
+
+    if (movie_format==MOVIE_CONTAINER)
+        open_container_movie(filename,run_type);
+    else if (movie_format==MOVIE_PACKED)
+        open_packed_movie(filename);
+    else
+        movie_io_open(filename);
+}
 
-fprintf(statistics_file,"%d %lf\n",t,avg_vx);
+//called by the output thread
+void write_movie(struct movie_snapshot_struct *s)
+{
+    movie_frames_offered++;
+    movie_particles_offered += s->n;
+    if (!movie_frame_due(s)) return;
+    s = movie_filter(s);
+    movie_frames_kept++;
+    movie_particles_kept += s->n;
+
+    if (movie_format==MOVIE_CONTAINER)
+        write_container_frame(s);
+    else if (movie_format==MOVIE_PACKED)
+        write_packed_movie(s);
+    else
+        write_cmovie(s);
+}
 
+void close_movie()
+{
+    if (movie_format==MOVIE_CONTAINER)
+        write_chunk();
+    movie_io_close();
+    if (movie_adaptive||movie_filtering())
+        printf("Movie filters kept %ld of %ld frames, %lld of %lld particles\n",
+               movie_frames_kept,movie_frames_offered,
+               movie_particles_kept,movie_particles_offered);
+}
+
+//two passes over every species range: the mean, then the squared
+//deviations from it (the sum of squares minus the square of the mean
+//cancels when the drive is strong); both are plain reductions
+//(overdamped motion: the velocity is the force)
+void accumulate_species_statistics()
+{
+    int i,s,n,n_mobile;
+    double vx,vy,sum_vx,sum_vy,mean_vx,mean_vy,m2_vx,m2_vy;
+    double delta_x,delta_y;
+    double v2_mobile;
+
+    v2_mobile = mobile_velocity*mobile_velocity;
+    for(s=0;s<N_species;s++)
+    {
+        n = species_start[s+1]-species_start[s];
+        species_stats[s].n = n;
+        if ((s==OBSTACLE_COLOR)||(n==0)) continue;
+
+        sum_vx = sum_vy = 0.0;
+        n_mobile = 0;
+        for(i=species_start[s];i<species_start[s+1];i++)
+        {
+            vx = particles[i].fx;
+            vy = particles[i].fy;
+            sum_vx += vx;
+            sum_vy += vy;
+            n_mobile += (vx*vx+vy*vy > v2_mobile);
+        }
+        mean_vx = sum_vx/n;
+        mean_vy = sum_vy/n;
+
+        m2_vx = m2_vy = 0.0;
+        for(i=species_start[s];i<species_start[s+1];i++)
+        {
+            delta_x = particles[i].fx - mean_vx;
+            delta_y = particles[i].fy - mean_vy;
+            m2_vx += delta_x*delta_x;
+            m2_vy += delta_y*delta_y;
+        }
+
+        species_stats[s].mean_vx = mean_vx;
+        species_stats[s].mean_vy = mean_vy;
+        species_stats[s].var_vx = m2_vx/n;
+        species_stats[s].var_vy = m2_vy/n;
+        species_stats[s].mobile_fraction = (double)n_mobile/n;
+    }
+}
+
+void write_statistics_header()
+{
+    fprintf(statistics_file,"t,species,drive,n,mean_vx,mean_vy,var_vx,var_vy,mobile_fraction\n");
+}
+
+//one line per mobile species, called by the output thread
+void write_statistics(struct output_job_struct *job)
+{
+    struct species_stats_struct *st;
+    int s;
+
+    for(s=0;s<N_species;s++)
+    {
+        st = &job->stats[s];
+        if ((s==OBSTACLE_COLOR)||(st->n==0)) continue;
+        fprintf(statistics_file,"%d,%d,%lf,%d,%lf,%lf,%lf,%lf,%lf\n",job->t,s,job->drive[s],
+                st->n,st->mean_vx,st->mean_vy,st->var_vx,st->var_vy,st->mobile_fraction);
+    }
+}
+
+void write_observables_header()
+{
+    fprintf(observables_file,"t,e_pot,e_pot_per_particle,wxx,wxy,wyy,pressure\n");
+}
+
+//the pressure is the virial part only, P = (Wxx+Wyy)/(2*area);
+//the dynamics is overdamped, there is no kinetic term
+//(called by the output thread)
+void write_observables(struct output_job_struct *job)
+{
+    struct observables_struct *o;
+    double pressure;
+
+    o = &job->observables;
+    pressure = (o->wxx + o->wyy)/(2.0*SX*SY);
+    fprintf(observables_file,"%d,%lf,%lf,%lf,%lf,%lf,%lf\n",job->t,
+            o->e_pot,o->e_pot/N_mobile,o->wxx,o->wxy,o->wyy,pressure);
+}
+
+//one line of defects.txt, called by the output thread
+void write_defects(struct output_job_struct *job)
+{
+    struct defects_struct *d;
+
+    d = &job->defects;
+    fprintf(defects_file,"%d %lf %lf %d %d %d %d\n",job->t,d->psi6_local,
+            d->psi6_global,d->n5,d->n6,d->n7,d->n_other);
+}
+
+//what the waiting side needs: a free slot for the step loop, a job or
+//the end of the run for the output thread
+int output_ready(int step_loop)
+{
+    if (step_loop)
+        return atomic_load(&output_head)-atomic_load(&output_tail)<OUTPUT_SLOTS;
+    return (atomic_load(&output_head)!=atomic_load(&output_tail))||
+           atomic_load(&output_quit);
+}
+
+//sleeps until output_ready(step_loop); output_sleepers is raised before
+//the check, so an index moved in between is seen by the check or wakes us
+void output_sleep(int step_loop)
+{
+    pthread_mutex_lock(&output_lock);
+    atomic_fetch_add(&output_sleepers,1);
+    while (!output_ready(step_loop))
+        pthread_cond_wait(&output_wake,&output_lock);
+    atomic_fetch_sub(&output_sleepers,1);
+    pthread_mutex_unlock(&output_lock);
+}
+
+//after moving output_head, output_tail or output_quit
+void output_wake_up()
+{
+    if (atomic_load(&output_sleepers)==0) return;
+    pthread_mutex_lock(&output_lock);
+    pthread_cond_broadcast(&output_wake);
+    pthread_mutex_unlock(&output_lock);
+}
+
+//the free slot of the ring for the step loop, once the output thread has
+//written what was in it; output_job_done() hands it over
+struct output_job_struct *output_job(int kind)
+{
+    struct output_job_struct *job;
+    unsigned int head;
+
+    head = atomic_load_explicit(&output_head,memory_order_relaxed);
+    if (head-atomic_load_explicit(&output_tail,memory_order_acquire)==OUTPUT_SLOTS)
+    {
+        output_stalls++;
+        output_sleep(1);
+    }
+    job = &output_ring[head%OUTPUT_SLOTS];
+    job->kind = kind;
+    job->t = t;
+    return job;
+}
+
+void output_job_done()
+{
+    unsigned int head;
+
+    head = atomic_load_explicit(&output_head,memory_order_relaxed);
+    atomic_store(&output_head,head+1);
+    output_wake_up();
+    output_jobs++;
+}
+
+void *output_writer(void *arg)
+{
+    struct output_job_struct *job;
+    unsigned int tail;
+
+    tail = atomic_load_explicit(&output_tail,memory_order_relaxed);
+    while (1)
+    {
+        if (tail==atomic_load_explicit(&output_head,memory_order_acquire))
+        {
+            //output_quit is set after the last job was handed over
+            if (atomic_load_explicit(&output_quit,memory_order_acquire)&&
+                (tail==atomic_load_explicit(&output_head,memory_order_acquire)))
+                break;
+            output_sleep(0);
+            continue;
+        }
+        job = &output_ring[tail%OUTPUT_SLOTS];
+        switch (job->kind)
+        {
+            case OUTPUT_MOVIE:
+                write_movie(&job->movie);
+                break;
+            case OUTPUT_STATISTICS:
+                write_statistics(job);
+                break;
+            case OUTPUT_OBSERVABLES:
+                write_observables(job);
+                break;
+            case OUTPUT_PROGRESS:
+                printf("time = %d\n", job->t);
+                fflush(stdout);
+                break;
+            case OUTPUT_DEFECTS:
+                write_defects(job);
+                break;
+        }
+        tail++;
+        atomic_store(&output_tail,tail);
+        output_wake_up();
+    }
+    return NULL;
+}
+
+//after the files are open
+void start_output()
+{
+    atomic_store(&output_head,0);
+    atomic_store(&output_tail,0);
+    atomic_store(&output_quit,0);
+    atomic_store(&output_sleepers,0);
+    output_jobs = 0;
+    output_stalls = 0;
+    pthread_create(&output_thread,NULL,output_writer,NULL);
+}
+
+//the output thread writes what is left, then the files can be closed
+void stop_output()
+{
+    atomic_store(&output_quit,1);
+    output_wake_up();
+    pthread_join(output_thread,NULL);
+    printf("Output: %ld writes, the step loop waited %ld times\n",output_jobs,output_stalls);
+}
+
+//the step loop side of the outputs: copies, the output thread writes
+void output_movie()
+{
+    struct output_job_struct *job;
+
+    job = output_job(OUTPUT_MOVIE);
+    take_snapshot(&job->movie);
+    output_job_done();
+}
+
+void output_statistics()
+{
+    struct output_job_struct *job;
+
+    job = output_job(OUTPUT_STATISTICS);
+    memcpy(job->stats,species_stats,sizeof(species_stats));
+    memcpy(job->drive,current_drive,sizeof(current_drive));
+    output_job_done();
+}
+
+void output_observables()
+{
+    struct output_job_struct *job;
+
+    job = output_job(OUTPUT_OBSERVABLES);
+    job->observables = observables;
+    output_job_done();
+}
+
+void output_progress()
+{
+    output_job(OUTPUT_PROGRESS);
+    output_job_done();
+}
+
+void output_defects()
+{
+    struct output_job_struct *job;
+
+    job = output_job(OUTPUT_DEFECTS);
+    job->defects = defects;
+    output_job_done();
+}
+
+//finds the drive range of every mobile species, and clears the bins
+void setup_velocity_force_analysis()
+{
+    int s,time,k;
+    double f;
+    struct vf_analyzer_struct *a;
+
+    for(s=0;s<N_species;s++)
+    {
+        a = &vf_analyzers[s];
+        a->f_min = a->f_max = evaluate_drive(&drive_schedules[s],0);
+        for(time=1;time<TOTAL_TIME;time++)
+        {
+            f = evaluate_drive(&drive_schedules[s],time);
+            if (f < a->f_min) a->f_min = f;
+            if (f > a->f_max) a->f_max = f;
+        }
+        //a constant drive puts everything into bin 0
+        if (a->f_max > a->f_min) a->bins_per_force = N_VF_BINS/(a->f_max - a->f_min);
+        else                     a->bins_per_force = 0.0;
+
+        for(k=0;k<N_VF_BINS;k++)
+        {
+            a->bins[k].count = 0;
+            a->bins[k].mean = 0.0;
+            a->bins[k].m2 = 0.0;
+        }
+    }
+}
+
+//one Welford update per species per time step
+void analyze_velocity_force()
+{
+    int s,k;
+    double avg_vx,delta;
+    struct vf_bin_struct *b;
+
+    for(s=0;s<N_species;s++)
+    {
+        if ((s==OBSTACLE_COLOR)||(species_stats[s].n==0)) continue;
+
+        avg_vx = species_stats[s].mean_vx;
+
+        k = (int)((current_drive[s] - vf_analyzers[s].f_min) * vf_analyzers[s].bins_per_force);
+        k = (k < 0) ? 0 : k;
+        k = (k >= N_VF_BINS) ? N_VF_BINS-1 : k;
+
+        b = &vf_analyzers[s].bins[k];
+        b->count++;
+        delta = avg_vx - b->mean;
+        b->mean += delta/(double)b->count;
+        b->m2 += delta*(avg_vx - b->mean);
+    }
+}
+
+//center of drive bin k of species s
+double vf_bin_force(int s, int k)
+{
+    if (vf_analyzers[s].bins_per_force == 0.0) return vf_analyzers[s].f_min;
+    return vf_analyzers[s].f_min + (k+0.5)/vf_analyzers[s].bins_per_force;
+}
+
+/*
+ The depinning force is where the mean velocity along the drive first
+ reaches depinning_velocity going out from zero drive, interpolated
+ between that bin and the one before it (nearer to zero). Both drive
+ signs are searched, the one that depins at the smaller |f| is returned
+ (with its sign). Returns 0 if the species never depinned (or the drive
+ never changed).
+ */
+
+//one sign of the drive: bins k_zero, k_zero+step, ... (|f| growing)
+int find_depinning_on_side(int s, int k_zero, int step, double *f_c)
+{
+    int k,prev;
+    double v,v_prev,f,f_prev;
+    struct vf_bin_struct *bins;
+
+    bins = vf_analyzers[s].bins;
+    prev = -1;
+    for(k=k_zero;(k>=0)&&(k<N_VF_BINS);k+=step)
+    {
+        if (bins[k].count==0) continue;
+        f = vf_bin_force(s,k);
+        v = (f<0.0) ? -bins[k].mean : bins[k].mean;
+        if (v >= depinning_velocity)
+        {
+            if (prev<0)
+            {
+                *f_c = f;
+                return 1;
+            }
+            f_prev = vf_bin_force(s,prev);
+            v_prev = (f_prev<0.0) ? -bins[prev].mean : bins[prev].mean;
+            *f_c = f_prev + (depinning_velocity-v_prev)*(f-f_prev)/(v-v_prev);
+            return 1;
+        }
+        prev = k;
+    }
+    return 0;
+}
+
+int find_depinning_force(int s, double *f_c)
+{
+    int k_zero,found_plus,found_minus;
+    double f_plus,f_minus;
+
+    if (vf_analyzers[s].bins_per_force == 0.0) return 0;
+
+    //the first bin with f >= 0
+    for(k_zero=0;k_zero<N_VF_BINS;k_zero++)
+        if (vf_bin_force(s,k_zero) >= 0.0) break;
+
+    found_plus = find_depinning_on_side(s,k_zero,1,&f_plus);
+    found_minus = find_depinning_on_side(s,k_zero-1,-1,&f_minus);
+    if (found_plus && (!found_minus || (f_plus <= -f_minus)))
+        *f_c = f_plus;
+    else if (found_minus)
+        *f_c = f_minus;
+    return found_plus||found_minus;
+}
+
+//allocates the position store of every level and clears the sums
+void setup_msd()
+{
+    msd_x = (double *) realloc(msd_x,MSD_LEVELS*MSD_BUFFER*N_mobile*sizeof(double));
+    msd_y = (double *) realloc(msd_y,MSD_LEVELS*MSD_BUFFER*N_mobile*sizeof(double));
+
+    memset(msd_head,0,sizeof(msd_head));
+    memset(msd_stored,0,sizeof(msd_stored));
+    memset(msd_sum,0,sizeof(msd_sum));
+    memset(msd_drift,0,sizeof(msd_drift));
+    memset(msd_count,0,sizeof(msd_count));
+    msd_samples = 0;
+}
+
+//stores the current positions on level l and correlates them
+//with the older samples kept on that level
+void msd_push_level(int l)
+{
+    int i,j,s,slot,first;
+    double *x,*y,*x0,*y0;
+    double dx,dy,sum,cx,cy;
+    int n;
+
+    msd_head[l] = (msd_head[l]+1) % MSD_BUFFER;
+    if (msd_stored[l] < MSD_BUFFER) msd_stored[l]++;
+
+    x = msd_x + (l*MSD_BUFFER+msd_head[l])*N_mobile;
+    y = msd_y + (l*MSD_BUFFER+msd_head[l])*N_mobile;
+    for(s=0;s<N_species;s++)
+    {
+        if (s==OBSTACLE_COLOR) continue;
+        cx = 0.0;
+        cy = 0.0;
+        for(i=species_start[s];i<species_start[s+1];i++)
+        {
+            x[i] = particles[i].ux;
+            y[i] = particles[i].uy;
+            cx += x[i];
+            cy += y[i];
+        }
+        n = species_start[s+1]-species_start[s];
+        msd_cx[s][l][msd_head[l]] = (n>0) ? cx/n : 0.0;
+        msd_cy[s][l][msd_head[l]] = (n>0) ? cy/n : 0.0;
+    }
+
+    //the short lags of the higher levels are already covered below them
+    first = (l==0) ? 1 : MSD_BUFFER/2;
+    for(j=first;j<msd_stored[l];j++)
+    {
+        slot = (msd_head[l] - j + MSD_BUFFER) % MSD_BUFFER;
+        x0 = msd_x + (l*MSD_BUFFER+slot)*N_mobile;
+        y0 = msd_y + (l*MSD_BUFFER+slot)*N_mobile;
+        for(s=0;s<N_species;s++)
+        {
+            n = species_start[s+1]-species_start[s];
+            if ((s==OBSTACLE_COLOR)||(n==0)) continue;
+            sum = 0.0;
+            for(i=species_start[s];i<species_start[s+1];i++)
+            {
+                dx = x[i] - x0[i];
+                dy = y[i] - y0[i];
+                sum += dx*dx + dy*dy;
+            }
+            dx = msd_cx[s][l][msd_head[l]] - msd_cx[s][l][slot];
+            dy = msd_cy[s][l][msd_head[l]] - msd_cy[s][l][slot];
+            msd_sum[s][l][j] += sum/n;
+            msd_drift[s][l][j] += dx*dx + dy*dy;
+        }
+        msd_count[l][j]++;
+    }
+}
+
+void msd_sample()
+{
+    int l;
+
+    msd_samples++;
+    msd_push_level(0);
+    for(l=1;l<MSD_LEVELS;l++)
+    {
+        if (msd_samples % (1L<<l) != 0) break;
+        msd_push_level(l);
+    }
+}
+
+//MSD and D = MSD/(4 tau) for every lag tau, raw and drift corrected
+void write_msd(const char *filename)
+{
+    int s,l,j,first;
+    double tau,msd,msd_corrected;
+    FILE *f;
+
+    f = fopen(filename,"wt");
+    for(s=0;s<N_species;s++)
+    {
+        if ((s==OBSTACLE_COLOR)||(species_start[s+1]==species_start[s])) continue;
+
+        fprintf(f,"# species %d N = %d\n",s,species_start[s+1]-species_start[s]);
+        fprintf(f,"# species lag_steps tau msd msd_drift_corrected D D_drift_corrected\n");
+        for(l=0;l<MSD_LEVELS;l++)
+        {
+            first = (l==0) ? 1 : MSD_BUFFER/2;
+            for(j=first;j<MSD_BUFFER;j++)
+            {
+                if (msd_count[l][j]==0) continue;
+                tau = (double)j * (1L<<l) * msd_interval * dt;
+                msd = msd_sum[s][l][j]/msd_count[l][j];
+                msd_corrected = msd - msd_drift[s][l][j]/msd_count[l][j];
+                fprintf(f,"%d %ld %lf %lf %lf %lf %lf\n",s,(long)j*(1L<<l)*msd_interval,tau,
+                        msd,msd_corrected,msd/(4.0*tau),msd_corrected/(4.0*tau));
+            }
+        }
+        fprintf(f,"\n");
+    }
+    fclose(f);
+}
+
+//the g(r) range of a pair type is its cutoff
+void setup_structure_analysis()
+{
+    int a,b,k;
+
+    for(a=0;a<N_species;a++)
+        for(b=0;b<N_species;b++)
+        {
+            k = PAIR_TYPE(a,b);
+            gr_r2_max[k] = pair_potentials[a][b].r_cut*pair_potentials[a][b].r_cut;
+            gr_per_dr[k] = N_GR_BINS/pair_potentials[a][b].r_cut;
+        }
+    memset(gr_hist,0,sizeof(gr_hist));
+    gr_samples = 0;
+
+    if (sk_n_max > SK_N_MAX) sk_n_max = SK_N_MAX;
+    memset(sk_sum,0,sizeof(sk_sum));
+    sk_samples = 0;
+}
+
+//rho(k) = sum_j exp(i k r_j), S(k) = |rho(k)|^2/N
+//the exponentials of every particle are built by recurrence:
+//exp(i nx 2pi x/SX) = exp(i (nx-1) 2pi x/SX) * exp(i 2pi x/SX)
+void sample_structure_factor()
+{
+    int i,nx,ny,m;
+    double ex_re[SK_N_MAX+1],ex_im[SK_N_MAX+1];
+    double ey_re[2*SK_N_MAX+1],ey_im[2*SK_N_MAX+1];
+    static double rho_re[SK_N_MAX+1][2*SK_N_MAX+1];
+    static double rho_im[SK_N_MAX+1][2*SK_N_MAX+1];
+    double c,s,re,im;
+
+    m = sk_n_max;
+    memset(rho_re,0,sizeof(rho_re));
+    memset(rho_im,0,sizeof(rho_im));
+
+    for(i=0;i<N_mobile;i++)
+    {
+        c = cos(2.0*M_PI*particles[i].x/SX);
+        s = sin(2.0*M_PI*particles[i].x/SX);
+        ex_re[0] = 1.0;
+        ex_im[0] = 0.0;
+        for(nx=1;nx<=m;nx++)
+        {
+            ex_re[nx] = ex_re[nx-1]*c - ex_im[nx-1]*s;
+            ex_im[nx] = ex_re[nx-1]*s + ex_im[nx-1]*c;
+        }
+
+        //ey[m+ny] holds exp(i ny 2pi y/SY), the negative ny are the conjugates
+        c = cos(2.0*M_PI*particles[i].y/SY);
+        s = sin(2.0*M_PI*particles[i].y/SY);
+        ey_re[m] = 1.0;
+        ey_im[m] = 0.0;
+        for(ny=1;ny<=m;ny++)
+        {
+            ey_re[m+ny] = ey_re[m+ny-1]*c - ey_im[m+ny-1]*s;
+            ey_im[m+ny] = ey_re[m+ny-1]*s + ey_im[m+ny-1]*c;
+            ey_re[m-ny] = ey_re[m+ny];
+            ey_im[m-ny] = -ey_im[m+ny];
+        }
+
+        for(nx=0;nx<=m;nx++)
+            for(ny=0;ny<=2*m;ny++)
+            {
+                rho_re[nx][ny] += ex_re[nx]*ey_re[ny] - ex_im[nx]*ey_im[ny];
+                rho_im[nx][ny] += ex_re[nx]*ey_im[ny] + ex_im[nx]*ey_re[ny];
+            }
+    }
+
+    for(nx=0;nx<=m;nx++)
+        for(ny=0;ny<=2*m;ny++)
+        {
+            re = rho_re[nx][ny];
+            im = rho_im[nx][ny];
+            sk_sum[nx][ny] += (re*re + im*im)/N_mobile;
+        }
+    sk_samples++;
+}
+
+//g_ab(r) = pairs in the shell / pairs expected in an ideal gas
+//the histograms of (a,b) and (b,a) are added
+void write_gr(const char *filename)
+{
+    int a,b,k,n_a,n_b;
+    double r,dr,n_pairs,shell;
+    FILE *f;
+
+    f = fopen(filename,"wt");
+    if (gr_samples==0)
+    {
+        fclose(f);
+        return;
+    }
+    for(a=0;a<N_species;a++)
+        for(b=a;b<N_species;b++)
+        {
+            if ((a==OBSTACLE_COLOR)&&(b==OBSTACLE_COLOR)) continue;
+            n_a = species_start[a+1]-species_start[a];
+            n_b = species_start[b+1]-species_start[b];
+            if (a==b) n_pairs = 0.5*n_a*(n_a-1.0);
+            else      n_pairs = (double)n_a*n_b;
+            if (n_pairs==0) continue;
+
+            dr = 1.0/gr_per_dr[PAIR_TYPE(a,b)];
+            fprintf(f,"# pair %d-%d\n",a,b);
+            fprintf(f,"# a b r g(r)\n");
+            for(k=0;k<N_GR_BINS;k++)
+            {
+                r = (k+0.5)*dr;
+                shell = 2.0*M_PI*r*dr/(SX*SY);
+                fprintf(f,"%d %d %lf %lf\n",a,b,r,
+                        (gr_hist[PAIR_TYPE(a,b)][k] + ((a!=b) ? gr_hist[PAIR_TYPE(b,a)][k] : 0))
+                        /(gr_samples*n_pairs*shell));
+            }
+            fprintf(f,"\n");
+        }
+    fclose(f);
+}
+
+void write_sk(const char *filename)
+{
+    int nx,ny;
+    double kx,ky;
+    FILE *f;
+
+    f = fopen(filename,"wt");
+    fprintf(f,"# samples %ld\n",sk_samples);
+    fprintf(f,"# nx ny kx ky |k| S(k)\n");
+    if (sk_samples==0)
+    {
+        fclose(f);
+        return;
+    }
+    for(nx=0;nx<=sk_n_max;nx++)
+        for(ny=-sk_n_max;ny<=sk_n_max;ny++)
+        {
+            if ((nx==0)&&(ny<=0)) continue;     //k=0 and the mirror of the nx=0 line
+            kx = 2.0*M_PI*nx/SX;
+            ky = 2.0*M_PI*ny/SY;
+            fprintf(f,"%d %d %lf %lf %lf %lf\n",nx,ny,kx,ky,sqrt(kx*kx+ky*ky),
+                    sk_sum[nx][sk_n_max+ny]/sk_samples);
+        }
+    fclose(f);
+}
+
+void setup_defect_analysis()
+{
+    double density,a;
+
+    //lattice constant of a triangular lattice: density = 2/(sqrt(3) a^2)
+    density = N_mobile/(SX*SY);
+    a = sqrt(2.0/(sqrt(3.0)*density));
+    r_nn = 1.3*a;
+
+    //with less than 3 cells a row the neighbor cells would repeat
+    N_cells_x = (int)(SX/r_nn);
+    N_cells_y = (int)(SY/r_nn);
+    if (N_cells_x < 3) N_cells_x = 1;
+    if (N_cells_y < 3) N_cells_y = 1;
+
+    cell_head = (int *) realloc(cell_head,N_cells_x*N_cells_y*sizeof(int));
+    cell_next = (int *) realloc(cell_next,N_mobile*sizeof(int));
+
+    memset(coordination_hist,0,sizeof(coordination_hist));
+    coordination_samples = 0;
+}
+
+void build_cell_list()
+{
+    int i,cx,cy,c;
+
+    for(c=0;c<N_cells_x*N_cells_y;c++) cell_head[c] = -1;
+
+    for(i=0;i<N_mobile;i++)
+    {
+        cx = (int)(particles[i].x/SX*N_cells_x);
+        cy = (int)(particles[i].y/SY*N_cells_y);
+        //x == SX can happen right after the PBC check
+        if (cx >= N_cells_x) cx = N_cells_x-1;
+        if (cy >= N_cells_y) cy = N_cells_y-1;
+        c = cy*N_cells_x + cx;
+        cell_next[i] = cell_head[c];
+        cell_head[c] = i;
+    }
+}
+
+void write_defects_header()
+{
+    fprintf(defects_file,"#t psi6_local psi6_global n5 n6 n7 other\n");
+}
+
+//mean |psi6_i|, |mean psi6_i| and the number of 5, 6, 7 and
+//otherwise coordinated mobile particles, into defects
+void analyze_defects()
+{
+    int i,j,z,cx,cy,dcx,dcy,ncx,ncy,c;
+    int dcx_max,dcy_max;
+    int n5,n6,n7,n_other;
+    double dx,dy,dr2,theta,psi_re,psi_im;
+    double sum_local,sum_re,sum_im;
+
+    build_cell_list();
+
+    dcx_max = (N_cells_x==1) ? 0 : 1;
+    dcy_max = (N_cells_y==1) ? 0 : 1;
+    n5 = n6 = n7 = n_other = 0;
+    sum_local = sum_re = sum_im = 0.0;
+
+    for(i=0;i<N_mobile;i++)
+    {
+        cx = (int)(particles[i].x/SX*N_cells_x);
+        cy = (int)(particles[i].y/SY*N_cells_y);
+        if (cx >= N_cells_x) cx = N_cells_x-1;
+        if (cy >= N_cells_y) cy = N_cells_y-1;
+
+        z = 0;
+        psi_re = psi_im = 0.0;
+        for(dcx=-dcx_max;dcx<=dcx_max;dcx++)
+            for(dcy=-dcy_max;dcy<=dcy_max;dcy++)
+            {
+                ncx = (cx+dcx+N_cells_x) % N_cells_x;
+                ncy = (cy+dcy+N_cells_y) % N_cells_y;
+                c = ncy*N_cells_x + ncx;
+                for(j=cell_head[c];j!=-1;j=cell_next[j])
+                {
+                    if (j==i) continue;
+                    dx = particles[j].x - particles[i].x;
+                    dy = particles[j].y - particles[i].y;
+                    if (dx>SX2) dx -=SX;
+                    if (dx<-SX2) dx +=SX;
+                    if (dy>SY2) dy -=SY;
+                    if (dy<-SY2) dy +=SY;
+                    dr2 = dx*dx+dy*dy;
+                    if (dr2 >= r_nn*r_nn) continue;
+
+                    theta = atan2(dy,dx);
+                    psi_re += cos(6.0*theta);
+                    psi_im += sin(6.0*theta);
+                    z++;
+                }
+            }
+
+        if (z>0)
+        {
+            psi_re /= z;
+            psi_im /= z;
+        }
+        sum_local += sqrt(psi_re*psi_re + psi_im*psi_im);
+        sum_re += psi_re;
+        sum_im += psi_im;
+
+        if (z==5) n5++;
+        else if (z==6) n6++;
+        else if (z==7) n7++;
+        else n_other++;
+
+        coordination_hist[(z>MAX_COORDINATION) ? MAX_COORDINATION : z]++;
+    }
+    coordination_samples++;
+
+    defects.psi6_local = sum_local/N_mobile;
+    defects.psi6_global = sqrt(sum_re*sum_re + sum_im*sum_im)/N_mobile;
+    defects.n5 = n5;
+    defects.n6 = n6;
+    defects.n7 = n7;
+    defects.n_other = n_other;
+}
+
+//fraction of the mobile particles with z neighbors, averaged over the run
+void write_coordination_histogram(const char *filename)
+{
+    int z;
+    FILE *f;
+
+    f = fopen(filename,"wt");
+    fprintf(f,"# r_nn = %lf samples %ld\n",r_nn,coordination_samples);
+    fprintf(f,"# z fraction\n");
+    for(z=0;z<=MAX_COORDINATION;z++)
+        fprintf(f,"%d %lf\n",z,(coordination_samples>0) ?
+                (double)coordination_hist[z]/(coordination_samples*N_mobile) : 0.0);
+    fclose(f);
+}
+
+//compact summary of the velocity-force curves at the end of the run
+void write_velocity_force_summary(const char *filename)
+{
+    int s,k;
+    double f_c;
+    FILE *f;
+    struct vf_bin_struct *b;
+
+    f = fopen(filename,"wt");
+    for(s=0;s<N_species;s++)
+    {
+        if ((s==OBSTACLE_COLOR)||(species_start[s+1]==species_start[s])) continue;
+
+        fprintf(f,"# species %d N = %d drive %s\n",s,species_start[s+1]-species_start[s],
+                drive_type_names[drive_schedules[s].type]);
+        if (find_depinning_force(s,&f_c))
+            fprintf(f,"# depinning force %lf (v > %lf)\n",f_c,depinning_velocity);
+        else
+            fprintf(f,"# depinning force not found\n");
+        fprintf(f,"# drive samples mean_vx var_vx\n");
+        for(k=0;k<N_VF_BINS;k++)
+        {
+            b = &vf_analyzers[s].bins[k];
+            if (b->count==0) continue;
+            fprintf(f,"%d %lf %ld %lf %lf\n",s,vf_bin_force(s,k),b->count,b->mean,
+                    (b->count>1) ? b->m2/(double)(b->count-1) : 0.0);
+        }
+        fprintf(f,"\n");
+    }
+    fclose(f);
 }
 
 /*
@@ -686,6 +3141,8 @@ int main(int argc, char *argv[])
 
     int symNr = 0;
 
+    srand(random_seed);
+
 //    int setup_index = atoi(argv[1]);
 //    int run_type = atoi(argv[2]);
 
@@ -712,57 +3169,92 @@ int main(int argc, char *argv[])
              * 3 - tab forces, verlet
              */
 
+            setup_pair_potentials();
+            setup_drives();
             if (run_type == 1 || run_type == 3) {
                 tabulate_forces();
             }
 
-            initialize_particles(sys_size, nr_part);
+            initialize_particles(sys_size, nr_part, NR_OBSTACLES);
 //            initialize_pinning_sites();
 //            write_contour_file();
             if (run_type == 2 || run_type == 3) {
                 rebuild_verlet_list();
             }
 
-            moviefile = fopen("results.mvi", "w");
+            open_movie("results.mvi", run_type);
             //write_movie_header();
-            statistics_file = fopen("stat.txt", "wt");
-            for (t = 0; t < 100000; t++) {
+            setup_velocity_force_analysis();
+            setup_msd();
+            setup_structure_analysis();
+            setup_defect_analysis();
+            defects_file = fopen("defects.txt", "wt");
+            write_defects_header();
+            statistics_file = fopen("stat.csv", "wt");
+            write_statistics_header();
+            observables_file = fopen("observables.csv", "wt");
+            write_observables_header();
+            start_output();
+            for (t = 0; t < TOTAL_TIME; t++) {
+                sample_observables = (t % stat_interval == 0);
+                clear_forces();
+
                 if (run_type == 2 || run_type == 3) {
                     calculate_pairwise_forces_with_verlet(run_type);
                 }
 
                 //calculate_thermal_force();
                 if (run_type == 0 || run_type == 1) {
-                    calculate_pairwise_forces();
+                    calculate_pairwise_forces(run_type);
                 }
 
 
+                update_drives();
                 calculate_external_forces();
 //                calculate_pinning_force();
 
                 //right now I have all the information
                 //time to calculate some statistics
-                write_statistics();
+                accumulate_species_statistics();
+                analyze_velocity_force();
+                if (sample_observables) {
+                    output_statistics();
+                    output_observables();
+                }
 
                 move_particles();
 
+                if (t % msd_interval == 0)
+                    msd_sample();
+                if (t % sk_interval == 0)
+                    sample_structure_factor();
+                if (t % defect_interval == 0) {
+                    analyze_defects();
+                    output_defects();
+                }
 
                 if (flag_to_rebuild_Verlet)
                     rebuild_verlet_list();
 
 
-                if (t % 100 == 0)
-                    write_cmovie();
+                if (t % (movie_adaptive ? movie_fine_interval : movie_interval) == 0)
+                    output_movie();
                 //write_movie_frame();
 
-                if (t % 1000 == 0) {
-                    printf("time = %d\n", t);
-                    fflush(stdout);
-                }
+                if (t % 1000 == 0)
+                    output_progress();
             }
 
-            fclose(moviefile);
+            stop_output();
+            close_movie();
             fclose(statistics_file);
+            fclose(observables_file);
+            write_velocity_force_summary("depinning.txt");
+            write_msd("msd.txt");
+            write_gr("gr.txt");
+            write_sk("sk.txt");
+            fclose(defects_file);
+            write_coordination_histogram("coordination.txt");
             program_timing_end(nr_part, run_type);
 
 
@@ -826,7 +3318,7 @@ int main(int argc, char *argv[])
 
 
 
-// to run main: gcc main.c -o main -lm
+// to run main: gcc main.c -o main -lm -lpthread
 // to run plot: gcc plot.c -o plot -lm -L/usr/X11R6/lib -lX11 -I/usr/X11R6/include/
 // then ./plot gfile
 // then set delay 10
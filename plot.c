@@ -1,5 +1,83 @@
 /*Special version for showing tmovies.  3D movies*/
 /*Revisions log:
+ *10.19.26 Container movies: a movie that starts with "MDT1" (main.c's
+          MOVIE_CONTAINER output) has a header with the run
+	  parameters and its packed frames in chunks that list where
+	  each frame starts.  The index is read from the chunks
+	  (index_chunks) instead of from every frame.  Movies that
+	  know their box (containers and packed movies) set the x/y
+	  range and the system size used for wrapping, unless they
+	  were given with set xrange/yrange or periodic/xshift/yshift.
+ *10.19.26 Packed cmovies: a movie that starts with "ZMV1" (main.c's
+          MOVIE_PACKED output) has quantized positions, coded as the
+	  change since the previous frame, with a key frame every few
+	  frames.  movie_open recognizes it and unpack_frame decodes
+	  a frame from its key frame on; it is then an ordinary cmovie
+	  frame.  Use the "cmovie" command as for raw movies.
+	  Key frames carry the particle IDs when they are not the
+	  index (key byte 3); the frames after them keep those IDs.
+ *10.19.26 Multi-node movies: the nodes are indexed in parallel and
+          merged on MD time (merge_frame_index), so frame f is the
+	  frame with the same time in every node even when one node
+	  skipped or repeated frames; times missing from any node are
+	  left out.  The 16 node limit is gone (movie[] and findex[]
+	  grow with nodenum).  The particles of smovies, kmovies and
+	  cmovies from several nodes are shown together as one frame,
+	  each node with its own particle count.
+ *10.19.26 Offscreen rendering: with "render <prefix> [<w> <h>]", plot
+          in batch mode draws every frame into a picture in memory
+	  (particles, pinning contour, trajectories, Voronoi/Delaunay)
+	  and writes <prefix>00001.ppm, ... (batch_render), the frames
+	  spread over the threads.  "render off" goes back to analysis.
+	  With trajectories, one pass of lines only first draws the
+	  picture each thread starts from (render_traj_starts).
+	  loadcolormap keeps the RGB values (c_rgb) for the renderer.
+ *10.19.26 Batch mode: "plot -batch gfile" runs gfile without an X
+          display.  Its plot command does not draw the movie but
+	  writes, per frame, the particle count, the number of defects,
+	  the histogram of Voronoi sides and the particles per species
+	  (batch_analyze), with the frames spread over all processors.
+	  New commands "analysis <file>" and "set threads <n>".
+ *10.19.26 Periodic Voronoi/Delaunay: new command "periodic" asks for
+          the system size and builds the construction with images of
+	  the particles near the edges (calculate_periodic_voronoi), so
+	  the cells at the edges get the right number of sides and are
+	  no longer shown as defects.
+ *10.19.26 Voronoi routines without globals: everything the Fortune
+          sweep used to keep in file scope is in a struct tessellation,
+	  whose arrays grow with the number of particles and are reused
+	  from frame to frame (the vertices, edges and halfedges come
+	  from arenas that are reset, not freed).  The polygons are
+	  listed per particle by make_polygons, so plot_Voronoi no
+	  longer clears a 20000x20 polylist every frame, and there is
+	  no more limit on the number of particles or polygon sides.
+ *10.19.26 Batched drawing.  plot_object no longer talks to the X
+          server; it puts each particle in the XArc list of its color
+	  and the trajectory, stripe and dimer lines in XSegment lists.
+	  flush_objects draws a whole frame with one XFillArcs per
+	  color.  The background under the old position is no longer
+	  restored per particle: every frame starts from a copy of
+	  traj_pixmap anyway.
+ *10.19.26 Prefetch thread: while a frame is drawn, a second thread
+          pages in the next PREFETCH_FRAMES frames (in the direction
+	  of play, also for fast forward and rewind), so playback of
+	  movies on slow disks no longer stutters.  Frames of packed
+	  movies it also decodes, into a ring of PREFETCH_FRAMES
+	  slots that plot_frame takes them from (prefetch_frame).
+ *10.19.26 The per particle arrays (transform buffers, old_pos, sidenum)
+          are allocated with grow_buffer to the size of the largest
+	  frame seen, instead of MAX_OBJECT static arrays.  old_pos is
+	  no longer a 3 MB array on the stack of main.
+ *10.19.26 Frame index (build_frame_index): the offset and MD time of
+          every frame are found from the headers when a movie is
+	  opened.  Rewind and fast forward are one seek each and are
+	  no longer limited; rewind_dat and the breakable rewind are
+	  gone.  New command goto <frame> / goto time <t>.
+ *10.19.26 Movie files are now memory mapped (movie_open) instead of
+          read with fread.  Frames are looked at in place in the
+	  mapped file; smframes etc. are pointers into it.  They are
+	  copied into the old static arrays (now smbuffer etc.) only
+	  when xshift/yshift/magnify have to change the positions.
  *4.1.05 For network project, adding a new type of network contour.
  *4.1.05 del-plot9.  Adding some new commands: xmagnify and ymagnify, which
          scale the input values, as well as xshift and yshift, for moving
@@ -155,8 +233,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <math.h>
+#include <pthread.h>
 #include "X11/Xlib.h"
 #include "X11/Xutil.h"
 #include "X11/Xos.h"
@@ -167,10 +249,6 @@
 #define ABS(x)   (x<0) ? -x: x
 #define PI 3.14159265
 
-#define MAX_OBJECT 50000
-/* For Voronoi */
-#define MAXNUM 20000
-
 #define SMOVIE 0
 #define KMOVIE 1
 #define TMOVIE 2
@@ -217,6 +295,8 @@ int screen_num;
 Screen *screen_ptr;
 Pixmap pixmaps[256];
 unsigned long c_map[256];
+unsigned char c_rgb[256][3];   /* the colors of c_map, for batch_render */
+int c_rgb_loaded = 0;          /* number of colors in c_rgb */
 /* pixel values */
 unsigned long foreground_pixel, background_pixel, border_pixel;
 Pixmap pixmap,back_pixmap,traj_pixmap;
@@ -267,13 +347,21 @@ struct tmdata {
   float y;
 } tmdata;
 
-struct smdata smframes[MAX_OBJECT];
-struct kmdata kmframes[MAX_OBJECT];
-struct cmdata cmframes[MAX_OBJECT];
-struct tmdata tmframes[LNUM][MAX_OBJECT];
+/* The current frame.  These point into the mapped movie file, or */
+/* into the buffers below if the positions had to be transformed. */
+struct smdata *smframes;
+struct kmdata *kmframes;
+struct cmdata *cmframes;
+struct tmdata *tmframes[LNUM];
+
+/* Grown with grow_buffer; *_size is the capacity in particles. */
+struct smdata *smbuffer = NULL;
+struct kmdata *kmbuffer = NULL;
+struct cmdata *cmbuffer = NULL;
+struct tmdata *tmbuffer[LNUM];
+int smbuffer_size = 0, kmbuffer_size = 0, cmbuffer_size = 0;
+int tmbuffer_size[LNUM];
 
-int *rewind_dat[16];  /* Used for unbreakable rewind */
-int disable_rewind;
 
 struct pinning_site {
   float x;
@@ -290,7 +378,157 @@ struct pinning_site {
 
 struct pinning_site *pin_sites = NULL;
 
-FILE *picfile[16];
+/* Drawing requests of the current frame, collected by plot_object */
+/* and sent by flush_objects: one list of circles per color, and   */
+/* the line segments by where they are drawn. */
+#define N_ARC_COLORS 126
+
+XArc *color_arcs[N_ARC_COLORS];
+int n_color_arcs[N_ARC_COLORS];
+int color_arcs_size[N_ARC_COLORS];
+
+struct segment_list {
+  XSegment *seg;
+  int n;
+  int size;
+};
+
+struct segment_list traj_segs;   /* trajectories, pixmap and traj_pixmap */
+struct segment_list stripe_segs; /* do_stripe lines, pixmap and traj_pixmap */
+struct segment_list dimer_segs;  /* grain chains, pixmap only */
+
+/* Decoder of packed movies: the last frame decoded of one node,  */
+/* kept so that the next frame only adds its differences.  Each    */
+/* thread that reads frames has its own.                          */
+struct unpacker {
+  int serial;        /* movie_open that this belongs to */
+  int frame;         /* frame of the node decoded last, -1 none */
+  int n;             /* particles in it */
+  unsigned int *qx,*qy;
+  int *color;
+  int *id;           /* particle IDs, from the last key frame */
+  struct cmdata *cm; /* the frame as a cmovie frame */
+  int size;          /* capacity of the arrays */
+};
+
+#define PACK_MAGIC "ZMV1"
+#define PACK_HEADER 20   /* magic, bits, block, box x and y */
+#define PACK_ESCAPE 24   /* unary quotient of an escaped raw value */
+#define CONTAINER_MAGIC "MDT1"  /* then header length and header text */
+#define CHUNK_MAGIC "CHNK"
+
+/* Memory mapped movie files, one for each node. */
+struct movie_file {
+  char   *base;  /* start of the mapping, NULL if nothing is open */
+  size_t size;   /* length of the file */
+  size_t pos;    /* read position (what the FILE used to keep) */
+  int    serial; /* different for every movie_open */
+  int    packed; /* the file is a packed cmovie */
+  int    container;  /* packed frames in chunks, after a header */
+  int    bits;   /* packed: positions in 2^bits steps of the box */
+  float  sx,sy;  /* packed: the box */
+  struct unpacker unpack;  /* decoder used by plot_frame */
+};
+
+int movie_serial = 0;
+
+/* The user gave the ranges or the system size; a box read from */
+/* the movie does not replace them.                              */
+int user_range = 0;
+int user_size = 0;
+
+struct movie_file *movie = NULL;  /* movie_nodes of them */
+int movie_nodes = 0;
+
+/* Byte offset and MD time of every frame of each node's movie. */
+struct frame_index {
+  size_t *offset;
+  int    *md_time;
+  int    n_frames;
+  int    allocated;
+};
+
+struct frame_index *findex = NULL;  /* one per node, like movie[] */
+
+/* The frames of all nodes merged on MD time: frame f (from 0) is  */
+/* frame node_frame[f*num_nodes+j] of node j, at time md_time[f].  */
+struct merged_index {
+  int n_frames;
+  int num_nodes;
+  int *md_time;
+  int *node_frame;
+  int md_time_size,node_frame_size;
+} merged;
+
+/* Read ahead done by prefetch_thread; shared fields under lock. */
+#define PREFETCH_FRAMES 16
+
+/* A frame of the packed nodes decoded by prefetch_thread.  Slot  */
+/* frame%PREFETCH_FRAMES holds the frame; frame is -1 while the   */
+/* thread writes it.                                              */
+struct prefetch_slot {
+  int frame;         /* merged frame, from 1 */
+  int generation;    /* prefetch.generation it was decoded in */
+  struct cmdata **cm;  /* one frame per node, NULL if not packed */
+  int *cm_size;
+};
+
+struct prefetch_state {
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+  pthread_t thread;
+  int running;     /* thread started */
+  int quit;
+  int next;        /* frame the render loop reads next */
+  int stride;      /* 1, 5 (fast forward) or -5 (rewind) */
+  int ready;       /* frames from next on that are resident */
+  int generation;  /* changed whenever the render loop jumps */
+  int num_nodes;
+  struct unpacker *unpack;  /* the thread's decoders, one per node */
+  struct prefetch_slot slot[PREFETCH_FRAMES];
+} prefetch = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Nodes handed out to the index_worker threads */
+struct index_job {
+  pthread_mutex_t lock;
+  int next;          /* next node to be indexed, under lock */
+  int num_nodes;
+  int movie_type;
+};
+
+/* Batch (headless) mode, set up by the -batch argument */
+#define BATCH_SIDES 10        /* histogram bins 0..9 Voronoi sides */
+#define BATCH_SPECIES LNUM    /* colors or layers counted per frame */
+
+struct batch_settings {
+  int on;            /* no X display; plot runs batch_analyze */
+  int threads;       /* 0: one per processor */
+  char output[200];  /* default <movie>.analysis */
+  char render[200];  /* if set, plot runs batch_render to <render>NNNNN.ppm */
+  int width,height;  /* size of the rendered pictures */
+} batch = {0,0,"","",600,600};
+
+/* Results of one frame */
+struct batch_frame {
+  int md_time;
+  int num_pars;
+  int defects;
+  int sides[BATCH_SIDES];
+  int species[BATCH_SPECIES];
+};
+
+/* Work shared by the batch_worker threads */
+struct batch_job {
+  pthread_mutex_t lock;
+  int next;          /* next frame to be taken, under lock */
+  int n_frames;
+  int num_nodes;
+  int movie_type;
+  int layer;
+  int periodic;
+  float syssizex,syssizey;
+  struct batch_frame *result;
+};
 
 /*============================== main =============================*/
 main(int argc,char *argv[])
@@ -313,7 +551,7 @@ main(int argc,char *argv[])
 		       int *do_clear,int *traj_on,float *orig_xmin,
 		       float *orig_xmax,float *orig_ymin,float *orig_ymax,
 		       int *num_nodes,int *do_voronoi,int *voronoi_layer,
-		       int *movie_type,int *ntypes,int *do_stripe,
+		       int *periodic_voronoi,int *movie_type,int *ntypes,int *do_stripe,
 		       float *xmagnify,float *ymagnify,int *do_xshift,
 		       int *do_yshift,float *syssizex,float *syssizey,
 		       float *xshift,float *yshift,
@@ -322,12 +560,25 @@ main(int argc,char *argv[])
 		 int layer_num,int one_vortex,int vortex_num,int do_color,
 		 unsigned int delay_counter,int *frame_num,int do_S_contour,
 		 int do_T_contour,
-		 int *do_clear,int old_pos[][MAX_OBJECT][2],int traj_on,
+		 int *do_clear,int (*old_pos[])[2],int traj_on,
 		 int num_nodes,int movie_type,int do_voronoi,int voronoi_layer,
-		 int ntypes,int do_stripe,int,float xmagnify,float ymagnify,
+		 int periodic_voronoi,int ntypes,int do_stripe,int,float xmagnify,float ymagnify,
 		 int do_xshift,int do_yshift,float syssizex,float syssizey,
 		 float xshift,float yshift,int do_net_contour);
   int get_arg(char *line,int *ipos,char *arg);
+  int movie_open(int j,char *filename);
+  void movie_nodes_reserve(int n);
+  int index_movies(int num_nodes,int movie_type);
+  void prefetch_start(int num_nodes);
+  void batch_analyze(char filename[],int num_nodes,int movie_type,
+		     int voronoi_layer,int periodic_voronoi,float syssizex,
+		     float syssizey);
+  void batch_render(int num_nodes,int movie_type,int voronoi_layer,
+		    int periodic_voronoi,float syssizex,float syssizey,
+		    float xmin,float ymin,float xmax,float ymax,
+		    int do_voronoi,int traj_on,int do_S_contour,int num_pins,
+		    int ntypes,int max_color);
+  void prefetch_stop();
   void setwindow(float xmin,float ymin,float xmax,float ymax,int num_pins,
 		 int argc,char **argv,int max_color,int *do_color,
 		 int monochrome,int do_S_contour,int do_T_contour,
@@ -390,6 +641,7 @@ main(int argc,char *argv[])
   /* 2 indicates Delaunay triangulation. */
   int do_voronoi = 0;  /* Toggle Voronoi triangulation mode on or off. */
   int voronoi_layer = 0; /* Which layer to use when computing voronoi const. */
+  int periodic_voronoi = 0; /* Voronoi construction with periodic images */
   int movie_type = SMOVIE;  /* What type of movie to plot (3 supported) */
 
   char *display_name = NULL;
@@ -403,7 +655,7 @@ main(int argc,char *argv[])
   int   *p_pts = NULL; /* pointer to which point drawing */
   int do_color = 0;  /* Indicates if color available. If so, contains depth */
   int monochrome = 0;
-  int old_pos[LNUM][MAX_OBJECT][2];
+  int (*old_pos[LNUM])[2] = {NULL}; /* grown by plot_frame */
   int do_stripe = 0; /* toggles drawing direction of angle theta for stripes */
   float xmagnify=1.0; /* Factors by which x,y coordinates will be multiplied */
   float ymagnify=1.0;
@@ -489,6 +741,8 @@ main(int argc,char *argv[])
 	fclose(execfile);
 	file_not_open = 1;
 	do_file = 0;
+	/* In batch mode there is no command line */
+	if(batch.on) break;
       }
     }
 
@@ -670,7 +924,8 @@ main(int argc,char *argv[])
 		&do_color,&monochrome,execname,&uxmin,&uxmax,&uymin,&uymax,
 		&delay_counter,&frame_num,&do_S_contour,&do_T_contour,&PinSize,
 		&do_file,&do_clear,&traj_on,&orig_xmin,&orig_xmax,&orig_ymin,
-		&orig_ymax,&num_nodes,&do_voronoi,&voronoi_layer,&movie_type,
+		&orig_ymax,&num_nodes,&do_voronoi,&voronoi_layer,
+		&periodic_voronoi,&movie_type,
 		    &ntypes,&do_stripe,&xmagnify,&ymagnify,&do_xshift,
 		    &do_yshift,&syssizex,&syssizey,&xshift,&yshift,
 		    &do_net_contour,&centerx,&centery);
@@ -699,11 +954,15 @@ main(int argc,char *argv[])
 	}
 	else strcpy(last_file_name,filename);
   
+	/* The reader thread must let go of the old files first */
+	prefetch_stop();
+	movie_nodes_reserve(num_nodes);
+
 	/* Open either one file or a series of files, depending on */
 	/* how many nodes we are working with. */
 	if(num_nodes == 1){
 	  /* Single node or normal useage mode */
-	  if ( (picfile[0] = fopen(filename,"r")) == NULL) {
+	  if (!movie_open(0,filename)) {
 	    printf("Unknown file\n");
 	    continue;
 	  }
@@ -718,12 +977,46 @@ main(int argc,char *argv[])
 	    strcat(filename,"n");
 	    strcat(filename,temp);
 
-	    if((picfile[j] = fopen(filename,"r"))==NULL){
+	    if(!movie_open(j,filename)){
 	      printf("File %s not found\n",filename);
 	      continue;
 	    }
 	  }
 	}
+
+	/* Find where the frames start, and line up the nodes */
+	index_movies(num_nodes,movie_type);
+	if(merged.n_frames)
+	  printf("%d frames, time %d to %d\n",merged.n_frames,
+		 merged.md_time[0],merged.md_time[merged.n_frames-1]);
+	frame_num = 1;
+
+	/* A movie that knows its box sets the ranges and system size */
+	if((movie[0].sx > 0.0)&&(movie[0].sy > 0.0)){
+	  if(!user_range){
+	    uxmin = uymin = 0.0;
+	    uxmax = movie[0].sx;
+	    uymax = movie[0].sy;
+	  }
+	  if(!user_size){
+	    syssizex = movie[0].sx;
+	    syssizey = movie[0].sy;
+	  }
+	}
+
+	/* Without a display the movie is analyzed, or drawn to files */
+	if(batch.on){
+	  if(batch.render[0] != '\0')
+	    batch_render(num_nodes,movie_type,voronoi_layer,periodic_voronoi,
+			 syssizex,syssizey,uxmin,uymin,uxmax,uymax,do_voronoi,
+			 traj_on,do_S_contour&&!do_T_contour&&!do_net_contour,
+			 num_pins,ntypes,max_color);
+	  else
+	    batch_analyze(filename,num_nodes,movie_type,voronoi_layer,
+			  periodic_voronoi,syssizex,syssizey);
+	  continue;
+	}
+	prefetch_start(num_nodes);
 	
 	setwindow(uxmin,uymin,uxmax,uymax,num_pins,argc,argv,
 		  max_color,&do_color,monochrome,do_S_contour,
@@ -741,7 +1034,8 @@ main(int argc,char *argv[])
                          do_color,delay_counter,&frame_num,
 			 do_S_contour,do_T_contour,
 			 &do_clear,old_pos,traj_on,num_nodes,
-			 movie_type,do_voronoi,voronoi_layer,ntypes,
+			 movie_type,do_voronoi,voronoi_layer,
+			 periodic_voronoi,ntypes,
 			 do_stripe,max_color,xmagnify,ymagnify,
 			 do_xshift,do_yshift,syssizex,syssizey,
 			 xshift,yshift,do_net_contour) ) {
@@ -773,13 +1067,13 @@ main(int argc,char *argv[])
   }while(!stop_now);
 
   /*Program exits*/
+  prefetch_stop();
   free((char *)x_pts);
   free((char *)y_pts);
   if (c_pts != NULL) free((char *)c_pts);
 }
 /*==================== initialize ========================*/
 /* Set up memory to run program, connect to X server, etc. */
-/* Also initializes unbreakable rewind pointer */
 
 initialize(int samples,float *x_pts,float *y_pts,int *c_pts,int *p_pts,
 	   char *display_name,int *do_color,int monochrome,int argc,
@@ -797,16 +1091,6 @@ initialize(int samples,float *x_pts,float *y_pts,int *c_pts,int *p_pts,
   *uxmax = 36.0;
   *uymax = 36.0;
 
-  /* Unbreakable rewind pointer */
-  for(j=0;j<16;j++){
-    rewind_dat[j] = (int *) malloc((unsigned)(4000*sizeof(int)));
-    if(rewind_dat[j] == NULL){
-      printf("Out of memory for rewind_dat\n");
-      exit(-1);
-    }
-  }
-  disable_rewind = 0;
-
   /*Pointers to x,y,color, and current point.*/
   
   /* Assign the pointers.*/
@@ -840,6 +1124,15 @@ initialize(int samples,float *x_pts,float *y_pts,int *c_pts,int *p_pts,
     return(1);
   }
 
+  /* plot -batch <gfile>: run gfile without a display */
+  if((argc == 3)&&(strcmp(argv[1],"-batch") == 0)) {
+    strcpy(execname,argv[2]);
+    *do_file = 1;
+    batch.on = 1;
+    *do_color = 0;
+    return(0);
+  }
+
   /* Connect to X server */
   if ( (display=XOpenDisplay(display_name)) == NULL ) {
     fprintf(stderr, "basicwin: cannot connect to X server %s\\n",
@@ -876,7 +1169,7 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
 		     int *do_clear,int *traj_on,float *orig_xmin,
 		     float *orig_xmax,float *orig_ymin,float *orig_ymax,
 		     int *num_nodes,int *do_voronoi,int *voronoi_layer,
-		     int *movie_type,int *ntypes,int *do_stripe,
+		     int *periodic_voronoi,int *movie_type,int *ntypes,int *do_stripe,
 		     float *xmagnify,float *ymagnify,int *do_xshift,
 		     int *do_yshift,float *syssizex,float *syssizey,
 		     float *xshift,float *yshift,int *do_net_contour,
@@ -912,6 +1205,8 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
 		       int *do_T_contour,
 		       float *PinSize);
   void print_help_screen();
+  void goto_frame(char *line,int *ipos,int *frame_num,int num_nodes,
+		  int *do_clear);
 
   char comm[100],comm2[100];
   int command_called; /* this variable is set to true if
@@ -1022,12 +1317,17 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
       printf("Voronoi/Delaunay mode OFF\n");
   }
 
-  /* Shut off unbreakable rewind -- THIS IS NOT A TOGGLE */
-  /* Once shut off, this can never be turned back on.  Period.  */
+  /* Rewind now goes through the frame index, which costs almost */
+  /* nothing even for huge files.  Kept so old command files work. */
   if (strcmp(comm,"disable_rewind") == 0){
-    disable_rewind = 1;
     command_called = 1;
-    printf("Rewind disabled; cannot be reenabled\n");
+    printf("Rewind uses the frame index; nothing to disable\n");
+  }
+
+  /* Jump to a frame number or an MD time */
+  if (strcmp(comm,"goto") == 0){
+    command_called = 1;
+    goto_frame(comm_line,ipos,frame_num,*num_nodes,do_clear);
   }
 
   /* Set number of nodes */
@@ -1041,8 +1341,8 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
       scanf("%d",num_nodes);
       command_called = 1;
     }
-    if(*num_nodes>16){
-      printf("Maximum number of nodes is 16\n");
+    if(*num_nodes<1){
+      printf("Need at least one node\n");
       *num_nodes = 1;
     }
   }
@@ -1108,6 +1408,27 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
 	      *syssizex,*syssizey,1);
   }
 
+  /* Toggle periodic Voronoi/Delaunay construction */
+  if(strcmp(comm,"periodic")==0){
+    command_called=1;
+    *periodic_voronoi = !*periodic_voronoi;
+    if(*periodic_voronoi){
+      /* The sizes can follow the command (as in a batch gfile) */
+      if(get_arg(comm_line,ipos,comm2)&&(sscanf(comm2,"%f",syssizex)==1)&&
+	 get_arg(comm_line,ipos,comm2)&&(sscanf(comm2,"%f",syssizey)==1));
+      else{
+	printf("Enter actual system size in x direction: ");
+	scanf("%f",syssizex);
+	printf("Enter actual system size in y direction: ");
+	scanf("%f",syssizey);
+      }
+      user_size = 1;
+      printf("Periodic Voronoi/Delaunay construction ON\n");
+    }
+    else
+      printf("Periodic Voronoi/Delaunay construction OFF\n");
+  }
+
   /* Periodic boundary shift commands, new in version 9 */
   if(strcmp(comm,"xshift")==0){
     command_called=1;
@@ -1116,6 +1437,7 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
     printf("Enter distance to shift: ");
     scanf("%f",xshift);
     *do_xshift=1;
+    user_size = 1;
     /* This will only work with contours if we reset the window. */
     setwindow(*uxmin,*uymin,*uxmax,*uymax,*num_pins,argc,argv,
 	      *max_color,do_color,*monochrome,*do_S_contour,*do_T_contour,
@@ -1131,6 +1453,7 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
     printf("Enter distance to shift: ");
     scanf("%f",yshift);
     *do_yshift=1;
+    user_size = 1;
     /* This will only work with contours if we reset the window. */
     setwindow(*uxmin,*uymin,*uxmax,*uymax,*num_pins,argc,argv,
 	      *max_color,do_color,*monochrome,*do_S_contour,*do_T_contour,
@@ -1179,11 +1502,47 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
 	set_yrange(comm_line,*ipos,uymin,uymax);
       if (strcmp(comm2,"delay") == 0) 
 	set_delay(comm_line,*ipos,delay_counter);
+      if (strcmp(comm2,"threads") == 0) {
+	if (get_arg(comm_line,ipos,comm2)) batch.threads = atoi(comm2);
+	printf("Batch analysis threads: %d (0 = all processors)\n",
+	       batch.threads);
+      }
       command_called = 1;
     }
     else printf("need to know what to set!\n");
   }
 
+  /* Output file of batch mode */
+  if (strcmp(comm,"analysis") == 0){
+    command_called = 1;
+    if (get_arg(comm_line,ipos,batch.output))
+      printf("Batch analysis goes to %s\n",batch.output);
+    else
+      printf("Need a file name!\n");
+  }
+
+  /* Pictures of batch mode: render <prefix> [<w> <h>], or render off */
+  if (strcmp(comm,"render") == 0){
+    command_called = 1;
+    if (get_arg(comm_line,ipos,comm2)) {
+      if (strcmp(comm2,"off") == 0) {
+	batch.render[0] = '\0';
+	printf("Batch mode analyzes the movie\n");
+      }
+      else {
+	strcpy(batch.render,comm2);
+	if (get_arg(comm_line,ipos,comm2)) batch.width = atoi(comm2);
+	if (get_arg(comm_line,ipos,comm2)) batch.height = atoi(comm2);
+	if (batch.width < 2*BORDER+1) batch.width = 2*BORDER+1;
+	if (batch.height < 2*BORDERY+1) batch.height = 2*BORDERY+1;
+	printf("Batch mode renders %dx%d pictures to %s*.ppm\n",
+	       batch.width,batch.height,batch.render);
+      }
+    }
+    else
+      printf("Need a file name prefix!\n");
+  }
+
   /* Show help screen */
   if (strcmp(comm,"help")==0){
     print_help_screen();
@@ -1285,6 +1644,45 @@ void process_command(char comm_line[],char pl_file[],int *do_plot,
   
   if (command_called == 0) printf("Unknown command\n");
 }
+/*============================ grow_buffer ========================*/
+/* Returns p (reallocated if needed) with room for at least n items */
+/* of item_size bytes.  *allocated holds the capacity in items; it  */
+/* is doubled, so a growing movie causes only a few reallocations.  */
+void *grow_buffer(void *p,int *allocated,int n,size_t item_size)
+{
+  int size;
+
+  if(n <= *allocated) return p;
+  size = (*allocated) ? *allocated : 1024;
+  while(size < n) size *= 2;
+  if((p = realloc(p,(size_t)size*item_size)) == NULL){
+    printf("Out of memory for a frame of %d particles\n",n);
+    exit(-1);
+  }
+  *allocated = size;
+  return p;
+}
+
+/*============================= layer_box =========================*/
+/* Pixel radius (Box) of the particles of layer (or type) ll of a  */
+/* tmovie.  Lower layers are drawn larger so they can be seen from */
+/* above.  Called by: plot_frame$, render_particles$.              */
+int layer_box(int ll,int ntypes)
+{
+  int box;
+
+  if((LNUM==2)||(ntypes==2))
+    box = 3 + ll*3;
+  else if((LNUM<10)||(ntypes<10))
+    box = 2 + ll;
+  else if((LNUM<25)||(ntypes<25))
+    box = 2 + ll/2;
+  else
+    box = 2 + ll/4;
+  if(box>13) box=13;
+  return box;
+}
+
 /*============================= plot_frame ========================*/
 /* This function reads in data a frame at a time. When the frame is */
 /* done, it outputs it to the screen, setups up for the next frame, */
@@ -1298,30 +1696,47 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
 	       int layer_num,int one_vortex,int vortex_num,int do_color,
 	       unsigned int delay_counter,int *frame_num,int do_S_contour,
 	       int do_T_contour,
-	       int *do_clear,int old_pos[][MAX_OBJECT][2],int traj_on,
+	       int *do_clear,int (*old_pos[])[2],int traj_on,
 	       int num_nodes,int movie_type,int do_voronoi,int voronoi_layer,
-	       int ntypes,int do_stripe,int max_color,float xmagnify,
+	       int periodic_voronoi,int ntypes,int do_stripe,int max_color,float xmagnify,
 	       float ymagnify,int do_xshift,int do_yshift,float syssizex,
 	       float syssizey,float xshift,float yshift,int do_net_contour)
 {
   void plot_object(float x,float y,int color,int p_num,int Box,int Box2,
-		   int do_color,int do_clear,int old_pos[][MAX_OBJECT][2],
+		   int do_color,int do_clear,int (*old_pos[])[2],
 		   int traj_on,int layr,float theta,int do_stripe,
 		   int one_vortex,int vortex_num);
-  void rewind_movie(int *frame_num,int *do_rewind,int disable_rewind,
-		    int num_nodes,int movie_type,int ntypes);
+  void rewind_movie(int *frame_num,int *do_rewind,int num_nodes);
+  int seek_frame(int frame,int num_nodes);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  void prefetch_position(int frame,int stride);
+  void add_segment(struct segment_list *l,int x1,int y1,int x2,int y2);
+  void flush_objects(int do_color);
   void plot_Voronoi(int movie_type,int num_pars,int sidenum[],
-		    int voronoi_layer,int,int);
-
-  int sidenum[MAX_OBJECT];
+		    int voronoi_layer,int,int,int periodic_voronoi,
+		    float syssizex,float syssizey);
+  char *movie_view(int j,size_t n);
+  int movie_read(int j,void *dst,size_t n);
+  int layer_box(int ll,int ntypes);
+  int node_frame(int j,int f);
+  struct cmdata *unpack_frame(struct unpacker *u,int j,int k);
+  struct cmdata *prefetch_frame(int j,int frame);
+
+  static int *sidenum = NULL;
+  static int sidenum_size = 0;
+  static int old_pos_size[LNUM];
+  int old_size;
   int i,j;
   static int num_pars = 0;
-  long int steps;
   int md_time;
-  int check_number;
+  int transform;
   int color;
   int num_layers=1;
   int tot_num_layers;
+  int num_planes;         /* layers drawn: 1, or all layers of a tmovie */
+  static int *node_pars = NULL;
+  static int node_pars_size = 0;
+  int first;
   int ll,layr;
   int Box,Box2;
   int Boxindex[LNUM],Box2index[LNUM];
@@ -1346,36 +1761,68 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
   /* CIJOL Further adjustments.  Putting maximum size limit. */
   if(movie_type == TMOVIE){
     for(ll=0;ll<LNUM;ll++){
-      if((LNUM==2)||(ntypes==2)){
-	Boxindex[ll] = 3 + ll*3;
-      }
-      else if((LNUM<10)||(ntypes<10))
-	Boxindex[ll] = 2 + ll;
-      else if((LNUM<25)||(ntypes<25))
-	Boxindex[ll] = 2 + ll/2;
-      else
-	Boxindex[ll] = 2 + ll/4;
-      if(Boxindex[ll]>13) Boxindex[ll]=13;
+      Boxindex[ll] = layer_box(ll,ntypes);
       Box2index[ll] = Boxindex[ll]*2;
     }
   }
 
   if (*do_rewind){
-    rewind_movie(frame_num,do_rewind,disable_rewind,num_nodes,movie_type,
-		 ntypes);
+    rewind_movie(frame_num,do_rewind,num_nodes);
   }
+
+  /* Fast forward: skip 5 frames */
+  if (*do_fast_forward) {
+    if(seek_frame(*frame_num+5,num_nodes))
+      *frame_num += 5;
+  }
+
+  /* Tell the reader thread where we are and which way we go */
+  prefetch_position(*frame_num,(*do_rewind) ? -5 : ((*do_fast_forward) ? 5 : 1));
     
+  /* Every node at its frame with the MD time of this one; past */
+  /* the last frame, the movie is over. */
+  if(!seek_frame(*frame_num,num_nodes)) return 0;
+
   tot_num_layers = 0;
   num_layers = 1;
+  num_pars = 0;
+  node_pars = (int *) grow_buffer(node_pars,&node_pars_size,num_nodes,
+				  sizeof(int));
   for(j=0;j<num_nodes;j++){
-    fread(&num_pars,sizeof(int),1,picfile[j]);
-    fread(&md_time,sizeof(int),1,picfile[j]);
+    if(!movie_read(j,&node_pars[j],sizeof(int))) return 0;
+    if(!movie_read(j,&md_time,sizeof(int))) return 0;
     if(movie_type==TMOVIE){
-      fread(&num_layers,sizeof(int),1,picfile[j]);
+      if(!movie_read(j,&num_layers,sizeof(int))) return 0;
       tot_num_layers += num_layers;
     }
     else
       tot_num_layers = 1;
+    num_pars += node_pars[j];
+  }
+  /* The nodes of a tmovie are layers with the same particle count; */
+  /* other movies show the particles of all nodes together. */
+  if(movie_type==TMOVIE){
+    num_pars = node_pars[num_nodes-1];
+    num_planes = num_layers*num_nodes;
+  }
+  else
+    num_planes = 1;
+  if(num_planes>LNUM) {
+    printf("Max number of layers exceeded. Alter code.\n");
+    exit(-1);
+  }
+
+  /* Make room for this frame in the per particle arrays.  New */
+  /* old_pos entries are off screen, so no trajectory is drawn. */
+  sidenum = (int *) grow_buffer(sidenum,&sidenum_size,num_pars,sizeof(int));
+  for(index=0;index<num_planes;index++){
+    old_size = old_pos_size[index];
+    old_pos[index] = grow_buffer(old_pos[index],&old_pos_size[index],num_pars,
+				 sizeof(*old_pos[index]));
+    for(i=old_size;i<old_pos_size[index];i++){
+      old_pos[index][i][0] = 2*win_width;
+      old_pos[index][i][1] = 2*win_height;
+    }
   }
   
   if((*one_layer)&&(tot_num_layers<=layer_num)){
@@ -1384,31 +1831,11 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
     *one_layer = 0;
   }
 
-  for(j=0;j<num_nodes;j++){
-    if((!disable_rewind)&&(!(*do_rewind))){
-      rewind_dat[j][*frame_num] = num_pars;
-      if((*frame_num)&&(!(*frame_num % 4000))){
-	/* Allocate more memory to rewind_dat */
-	rewind_dat[j] = 
-	  (int *) realloc(rewind_dat[j],
-			  (unsigned)((*frame_num+4000)*sizeof(int)));
-	/* Check allocation */
-	if(&(rewind_dat[j][*frame_num+1]) == NULL){
-	  printf("Unable to allocate more memory for rewind\n");
-	  disable_rewind = 1;
-	}
-      }
-    }
-  }
-
   if (*do_clear || (*frame_num == 1 )) {
-    for(i=0; i<MAX_OBJECT; i++) {
-      for(j=0;j<num_nodes;j++){
-	for(ll=0;ll<num_layers;ll++){
-	  index = ll + num_layers*j;
-	  old_pos[index][i][0] = 2*win_width;
-	  old_pos[index][i][1] = 2*win_height;
-	}
+    for(index=0;index<num_planes;index++){
+      for(i=0; i<old_pos_size[index]; i++) {
+	old_pos[index][i][0] = 2*win_width;
+	old_pos[index][i][1] = 2*win_height;
       }
     }
 
@@ -1418,61 +1845,26 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
     }
   }
   
-  /* This little bit of code fast forwards 5 times faster. */
-  if (*do_fast_forward) {
-    for (i=0; i<5; i++) {
-      /*Do this for each file */
-      (*frame_num)++;
-      for(j=0;j<num_nodes;j++){
-	/* Go forward by layers; check the number of particles at each frame*/
-	switch(movie_type){
-	case SMOVIE:
-	  steps = (long) num_pars*sizeof(smdata);
-	  break;
-	case KMOVIE:
-	  steps = (long) num_pars*sizeof(kmdata);
-	  break;
-	case CMOVIE:
-	  steps = (long) num_pars*sizeof(cmdata);
-	  break;
-	case TMOVIE:
-	  steps = (long) num_layers*num_pars*sizeof(tmdata);
-	  break;
-	}
-	fseek(picfile[j],steps,1);
-	fread(&num_pars,sizeof(int),1,picfile[j]);
-	fread(&md_time,sizeof(int),1,picfile[j]);
-	if(movie_type==TMOVIE){
-	  fread(&num_layers,sizeof(int),1,picfile[j]);
-	  if(num_layers>LNUM) {
-	    printf("Max number of layers exceeded. Alter code.\n");
-	    exit(-1);
-	  }
-	}
-
-	if(!disable_rewind){
-	  rewind_dat[j][*frame_num] = num_pars;
-	  if((*frame_num)&&(!(*frame_num % 4000))){
-	    /* Allocate more memory to rewind_dat */
-	    rewind_dat[j] = (int *) realloc(rewind_dat[j],
-				 (unsigned)((*frame_num+4000)*sizeof(int)));
-	    /* Check allocation */
-	    if(&(rewind_dat[j][*frame_num+1]) == NULL){
-	      printf("Unable to allocate more memory for rewind\n");
-	      disable_rewind = 1;
-	    }
-	  }
-	}
-      }
-    }
-  }
-
   /* Read in the actual data on the vortices to be plotted: */
-  for(j=0;j<num_nodes;j++){
+  /* The frame is used where it is in the mapped file.  Only when */
+  /* the positions have to be shifted or magnified is it copied to */
+  /* a buffer first (the mapping is read only). */
+  /* With several nodes the particles are gathered in the buffer, */
+  /* node j from first on. */
+  transform = do_xshift || do_yshift || (xmagnify != 1.0) || (ymagnify != 1.0);
+  first = 0;
+  for(j=0;j<num_nodes;first+=node_pars[j],j++){
     switch(movie_type){
     case SMOVIE:
-      check_number = fread(smframes,sizeof(smdata),num_pars,
-			   picfile[j]);
+      smframes = (struct smdata *) movie_view(j,node_pars[j]*sizeof(smdata));
+      if(smframes == NULL) return 0;
+      if((num_nodes == 1)&&(!transform)) break;
+      smbuffer = (struct smdata *) grow_buffer(smbuffer,&smbuffer_size,num_pars,
+					       sizeof(smdata));
+      memcpy(smbuffer+first,smframes,node_pars[j]*sizeof(smdata));
+      if(j < num_nodes-1) break;
+      smframes = smbuffer;
+      if(!transform) break;
       /* Adding periodic boundary shifts here, BEFORE magnification */
       /* Adding the multiplication factor here*/
       for(ii=0;ii<num_pars;ii++){
@@ -1491,8 +1883,15 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
       }
       break;
     case KMOVIE:
-      check_number = fread(kmframes,sizeof(kmdata),num_pars,
-			   picfile[j]);
+      kmframes = (struct kmdata *) movie_view(j,node_pars[j]*sizeof(kmdata));
+      if(kmframes == NULL) return 0;
+      if((num_nodes == 1)&&(!transform)) break;
+      kmbuffer = (struct kmdata *) grow_buffer(kmbuffer,&kmbuffer_size,num_pars,
+					       sizeof(kmdata));
+      memcpy(kmbuffer+first,kmframes,node_pars[j]*sizeof(kmdata));
+      if(j < num_nodes-1) break;
+      kmframes = kmbuffer;
+      if(!transform) break;
       /* Adding periodic boundary shifts here, BEFORE magnification */
       /* Adding the multiplication factor here*/
       for(ii=0;ii<num_pars;ii++){
@@ -1511,8 +1910,22 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
       }
       break;
     case CMOVIE:
-      check_number = fread(cmframes,sizeof(cmdata),num_pars,
-			   picfile[j]);
+      if(movie[j].packed){
+	/* Decoded ahead by the reader thread, or here */
+	cmframes = prefetch_frame(j,*frame_num);
+	if(cmframes == NULL)
+	  cmframes = unpack_frame(&movie[j].unpack,j,node_frame(j,*frame_num-1));
+      }
+      else
+	cmframes = (struct cmdata *) movie_view(j,node_pars[j]*sizeof(cmdata));
+      if(cmframes == NULL) return 0;
+      if((num_nodes == 1)&&(!transform)) break;
+      cmbuffer = (struct cmdata *) grow_buffer(cmbuffer,&cmbuffer_size,num_pars,
+					       sizeof(cmdata));
+      memcpy(cmbuffer+first,cmframes,node_pars[j]*sizeof(cmdata));
+      if(j < num_nodes-1) break;
+      cmframes = cmbuffer;
+      if(!transform) break;
       /* Adding periodic boundary shifts here, BEFORE magnification */
       /* Adding the multiplication factor here*/
       for(ii=0;ii<num_pars;ii++){
@@ -1533,8 +1946,13 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
     case TMOVIE:
       for(ll=0;ll<num_layers;ll++){
 	index = ll + num_layers*j;
-	check_number = fread(tmframes[index],sizeof(tmdata),num_pars,
-			     picfile[j]);
+	tmframes[index] = (struct tmdata *) movie_view(j,num_pars*sizeof(tmdata));
+	if(tmframes[index] == NULL) return 0;
+	if(!transform) continue;
+	tmbuffer[index] = (struct tmdata *) grow_buffer(tmbuffer[index],
+				&tmbuffer_size[index],num_pars,sizeof(tmdata));
+	memcpy(tmbuffer[index],tmframes[index],num_pars*sizeof(tmdata));
+	tmframes[index] = tmbuffer[index];
 	/* Adding periodic boundary shifts here, BEFORE magnification */
 	/* Adding the multiplication factor here*/
 	for(ii=0;ii<num_pars;ii++){
@@ -1554,9 +1972,6 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
       }
       break;
     }
-    if (check_number != num_pars) {
-      return 0;
-    }
   }
 
   /* Pause for a specified amount of time */
@@ -1573,7 +1988,7 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
   /* Plot Voronoi construction if this mode is set. */
   if(do_voronoi){
     plot_Voronoi(movie_type,num_pars,sidenum,voronoi_layer,do_voronoi,
-		 max_color);
+		 max_color,periodic_voronoi,syssizex,syssizey);
   }
 
   /* CIJOL: Adding logic here to color the particles according to */
@@ -1584,7 +1999,7 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
   /* Finally, drawing lower layers with larger vortices (i.e., greater */
   /* pixel radius) so they can be seen from above.*/
   /* Plot ALL layers that have been read in */
-  for(layr=(num_layers*num_nodes-1);layr>=0;layr--){
+  for(layr=(num_planes-1);layr>=0;layr--){
     if(movie_type==TMOVIE){
       /* CIJOL For multiple particle types, this is overridden below.*/
       Box = Boxindex[layr];
@@ -1700,10 +2115,7 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
     
 	    if (((width<(win_width/3)) && (height<(win_height/3))) 
 		&& ((width>0) || (height>0))) {
-	      XSetForeground(display,pixmap_gc,
-			     (BlackPixel(display,screen_num)));
-	      XDrawLine(display,pixmap,pixmap_gc,
-			(dimer_x),(dimer_y),(par_x),(par_y));
+	      add_segment(&dimer_segs,dimer_x,dimer_y,par_x,par_y);
 	    }
 	    /* CIJOL Altering to draw line along length of chain: */
 	    /* the following two lines accomplish this. */
@@ -1720,6 +2132,8 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
     }
   }
 
+  flush_objects(do_color);
+
   if (num_pars) {
     XCopyArea(display,pixmap,win,gc,0,0,win_width,win_height,0,0);
     XFlush(display);
@@ -1751,26 +2165,27 @@ int plot_frame(int *do_rewind,int *do_fast_forward,int *one_layer,
   return num_pars;
 }
 /*========================= plot_object ==================*/
-/* This function actually draws the objects on the screen. */
-/* It is also responsible for drawing the trajectories.    */
+/* This function puts the objects on the draw lists that  */
+/* flush_objects sends to the server once per frame.      */
+/* It is also responsible for the trajectories.           */
 /* Called by: plot_frame$.*/
 void plot_object(float x,float y,int color,int p_num,int Box,int Box2,
-		 int do_color,int do_clear,int old_pos[][MAX_OBJECT][2],
+		 int do_color,int do_clear,int (*old_pos[])[2],
 		 int traj_on,int layr,float theta,int do_stripe,
 		 int one_vortex,int vortex_num)
 {
   int par_x,par_y,old_x,old_y;
   int par_x2,par_y2;
   int width,height;
-  unsigned int win_Box2;
   float x2,y2;
   float linelength;
+  XArc *arc;
+  void add_segment(struct segment_list *l,int x1,int y1,int x2,int y2);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
 
   /* CIJOL Hardwiring linelength */
   linelength = 2.0;
 
-  win_Box2 = Box2;
-
   /* If frame_num = 0, or we are clearing the screen, the previous */
   /* trajectory info is invalid. So we set the old position data   */
   /* beyond the screen boundaries. Thus no path is drawn.          */
@@ -1786,17 +2201,9 @@ void plot_object(float x,float y,int color,int p_num,int Box,int Box2,
   if (par_x >= ((int) win_width) - (BORDER - 10))    return;
   if (par_y >= ((int) win_height) - (BORDERY - 10))  return;
 
-  /* Now we restore the background under the objects */
-  /* If the window has been cleared, no need to do a */
-  /* restore.                                        */
+  /* The background under the old position needs no restoring: */
+  /* plot_frame starts every frame from a copy of traj_pixmap.   */
 
-  if ( (traj_on) && (!do_clear) ) {
-    old_x = old_pos[layr][p_num][0];
-    old_y = old_pos[layr][p_num][1];
-    XCopyArea(display,traj_pixmap,pixmap,gc,old_x-Box,old_y-Box,win_Box2,
-	      win_Box2,old_x-Box,old_y-Box); 
-  }
-  
   /* Now draw the trajectory info. We do this before drawing the */
   /* particle because the trajectory is UNDER the particle.      */
   
@@ -1818,38 +2225,27 @@ void plot_object(float x,float y,int color,int p_num,int Box,int Box2,
       
       if (((width<(win_width/3)) && (height<(win_height/3))) 
 	  && ((width>0) || (height>0))) {
-	XSetForeground(display,traj_gc,(BlackPixel(display,screen_num)));
-	XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
-	XDrawLine(display,pixmap,pixmap_gc,(old_x),(old_y),(par_x),(par_y));
-	XDrawLine(display,traj_pixmap,traj_gc,(old_x),(old_y),(par_x),(par_y));
+	add_segment(&traj_segs,old_x,old_y,par_x,par_y);
       }
     }
   }
   
   /* Now draw the particles. For now, they're just spheres. */
+  /* They go on the list of their color; see flush_objects. */
   
   if (color > 125) color = 125;
-  
-  // CIJOL Messing with this 3.10.05
-  //  if (do_color) {
-  //    /*XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));*/
-  //XSetForeground(display,pixmap_gc,c_map[1]);
-  //XDrawArc(display,pixmap,pixmap_gc,par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-  //XFillArc(display,pixmap,pix_gc[color],par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-  //}
-  if (do_color) {
-    /*XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));*/
-    //3.11.05
-    XSetForeground(display,pix_gc[color],c_map[color]);
-    XDrawArc(display,pixmap,pix_gc[color],par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-    XFillArc(display,pixmap,pix_gc[color],par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-  }
-  else {
-    XSetForeground(display,pixmap_gc,(WhitePixel(display,screen_num)));
-    XDrawArc(display,pixmap,pixmap_gc,par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-    XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
-    XFillArc(display,pixmap,pixmap_gc,par_x-Box,par_y-Box,Box2,Box2,0,360*64); 
-  }
+  if (color < 0) color = 0;
+
+  color_arcs[color] = (XArc *) grow_buffer(color_arcs[color],
+					   &color_arcs_size[color],
+					   n_color_arcs[color]+1,sizeof(XArc));
+  arc = &color_arcs[color][n_color_arcs[color]++];
+  arc->x = par_x-Box;
+  arc->y = par_y-Box;
+  arc->width = Box2;
+  arc->height = Box2;
+  arc->angle1 = 0;
+  arc->angle2 = 360*64;
   
   /* Store the position of the particle, so we can draw trajectories. */
   
@@ -1864,11 +2260,71 @@ void plot_object(float x,float y,int color,int p_num,int Box,int Box2,
     par_x2 = (int) ((x2+x_offset) * x_scale + BORDER);
     par_y2 = (int) (((float)win_height) - (y2 + y_offset) * y_scale - BORDERY);
 
-    XSetForeground(display,traj_gc,(BlackPixel(display,screen_num)));
-    XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
-    XDrawLine(display,pixmap,pixmap_gc,(par_x2),(par_y2),(par_x),(par_y));
-    XDrawLine(display,traj_pixmap,traj_gc,(par_x2),(par_y2),(par_x),(par_y));
+    add_segment(&stripe_segs,par_x2,par_y2,par_x,par_y);
+  }
+}
+
+/*============================ add_segment ========================*/
+void add_segment(struct segment_list *l,int x1,int y1,int x2,int y2)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+
+  l->seg = (XSegment *) grow_buffer(l->seg,&l->size,l->n+1,sizeof(XSegment));
+  l->seg[l->n].x1 = x1;
+  l->seg[l->n].y1 = y1;
+  l->seg[l->n].x2 = x2;
+  l->seg[l->n].y2 = y2;
+  l->n++;
+}
+
+/*=========================== flush_objects =======================*/
+/* Sends everything plot_object collected for this frame: the      */
+/* trajectories first (they are UNDER the particles), then one     */
+/* XFillArcs/XDrawArcs pair per color, then the stripe and dimer   */
+/* lines.  Xlib splits the lists into requests of the size the     */
+/* server accepts.  Called by: plot_frame$.                        */
+void flush_objects(int do_color)
+{
+  int color;
+
+  XSetForeground(display,traj_gc,(BlackPixel(display,screen_num)));
+  XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
+  if(traj_segs.n){
+    XDrawSegments(display,pixmap,pixmap_gc,traj_segs.seg,traj_segs.n);
+    XDrawSegments(display,traj_pixmap,traj_gc,traj_segs.seg,traj_segs.n);
+  }
+
+  for(color=0;color<N_ARC_COLORS;color++){
+    if(!n_color_arcs[color]) continue;
+    if(do_color){
+      XSetForeground(display,pix_gc[color],c_map[color]);
+      XDrawArcs(display,pixmap,pix_gc[color],color_arcs[color],
+		n_color_arcs[color]);
+      XFillArcs(display,pixmap,pix_gc[color],color_arcs[color],
+		n_color_arcs[color]);
+    }
+    else{
+      XSetForeground(display,pixmap_gc,(WhitePixel(display,screen_num)));
+      XDrawArcs(display,pixmap,pixmap_gc,color_arcs[color],
+		n_color_arcs[color]);
+      XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
+      XFillArcs(display,pixmap,pixmap_gc,color_arcs[color],
+		n_color_arcs[color]);
+    }
+    n_color_arcs[color] = 0;
+  }
+
+  XSetForeground(display,pixmap_gc,(BlackPixel(display,screen_num)));
+  if(stripe_segs.n){
+    XDrawSegments(display,pixmap,pixmap_gc,stripe_segs.seg,stripe_segs.n);
+    XDrawSegments(display,traj_pixmap,traj_gc,stripe_segs.seg,stripe_segs.n);
   }
+  if(dimer_segs.n)
+    XDrawSegments(display,pixmap,pixmap_gc,dimer_segs.seg,dimer_segs.n);
+
+  traj_segs.n = 0;
+  stripe_segs.n = 0;
+  dimer_segs.n = 0;
 }
 
 /*================================= get_arg =====================*/
@@ -2049,6 +2505,9 @@ void setwindow(float xmin,float ymin,float xmax,float ymax,int num_pins,
   static float old_xmin,old_xmax,old_ymin,old_ymax;
   XWindowAttributes *win_atb;
 
+  /* There is no window in batch mode */
+  if(batch.on) return;
+
   if (old_width == 0) {
     old_xmin = xmin;
     old_xmax = xmax;
@@ -3090,6 +3549,7 @@ void set_xrange(char *line,int pos,float *uxmin,float *uxmax)
   if (a<b) {
     *uxmin = a;
     *uxmax = b;
+    user_range = 1;
   }
   else printf("ERROR: xmin is BIGGER then xmax!\n");
 }
@@ -3115,6 +3575,7 @@ void set_yrange(char *line,int pos,float *uymin,float *uymax)
   if (a<b) {
     *uymin = a;
     *uymax = b;
+    user_range = 1;
   }
   else printf("ERROR: xmin is BIGGER then xmax!\n");
 }
@@ -3142,7 +3603,8 @@ void load_color_map(char *line,int pos,int *max_color,int do_color)
   int i,error;
   XColor in_out;
   
-  if (!(do_color)) return;
+  /* Batch mode has no display, but the renderer uses the colors */
+  if (!(do_color) && !(batch.on)) return;
   i = 0;
 
   if (get_arg(line,&pos,filename)) {
@@ -3155,11 +3617,19 @@ void load_color_map(char *line,int pos,int *max_color,int do_color)
       in_out.green = green * 65535;
       in_out.red   = red * 65535;
       in_out.blue  = blue * 65535;
-      error = XAllocColor(display,DefaultColormap(display,screen_num),&in_out);
-      if (!(error)) break;
-      c_map[i] = in_out.pixel;
+      if (i == 256) break;
+      if (!(batch.on)) {
+	error = XAllocColor(display,DefaultColormap(display,screen_num),&in_out);
+	if (!(error)) break;
+	c_map[i] = in_out.pixel;
+      }
+      c_rgb[i][0] = (unsigned char)(red * 255 + 0.5);
+      c_rgb[i][1] = (unsigned char)(green * 255 + 0.5);
+      c_rgb[i][2] = (unsigned char)(blue * 255 + 0.5);
       i++;
     }
+    fclose(mapfile);
+    c_rgb_loaded = i;
   }
   else
     printf("Need a file name!\n");
@@ -3424,6 +3894,10 @@ void print_help_screen()
   printf(" set yrange <min> <max>\tSets y values for plotting region\n");
   printf(" set sample <#>\tSets max. number of particles. Default 5000.\n");
   printf(" set delay <#>\tDelay between drawing screens.  Default 0.\n");
+  printf(" set threads <#>\tThreads of batch analysis.  Default 0 (all).\n");
+  printf(" analysis <file>\tOutput of batch analysis (plot -batch gfile)\n");
+  printf(" render <prefix> [<w> <h>]\tBatch mode writes frames as <prefix>#.ppm\n");
+  printf(" render off\tBatch mode analyzes frames again (default)\n");
   printf(" set colormode <128 | 256>\tLeave set at default value 128\n");
   printf(" loadcolormap <colormap>\tReads in colormap file\n");
   printf(" monochrome\tDisables use of color; for monochrome monitors\n");
@@ -3439,6 +3913,7 @@ void print_help_screen()
   printf(" toggle_traj\tToggles drawing of trajectories\n");
   printf(" toggle_voronoi\tToggles Voronoi polygon mode\n");
   printf(" delaunay\tToggles Delaunay triangulation mode\n");
+  printf(" periodic [<sx> <sy>]\tToggles periodic boundaries for Voronoi/Delaunay\n");
   printf(" onelayer <#>\tPlot only specified layer number\n");
   printf(" alllayer\tPlot all layers (default)\n");
   printf(" onevortex <#>\tPlot only specified vortex\n");
@@ -3452,7 +3927,8 @@ void print_help_screen()
   printf(" replot\tPlot same file again\n");
   printf(" quit\tEnd program\n");
   printf(" clear\tClear screen; moving window with mouse has same effect\n");
-  printf(" disable_rewind\tDisables unbreakable rewind (for large files)\n");
+  printf(" goto <#>\tNext frame plotted (with cont) is frame #\n");
+  printf(" goto time <t>\tSame, first frame at MD time t or later\n");
   printf(" cont\tContinue plotting movie from this point\n");
   printf(" help\tShow this screen\n");
   printf("KEYBOARD: Press key in movie window to get command prompt\n");
@@ -3466,327 +3942,1054 @@ void print_help_screen()
   printf(" Right mouse button: Auto-size (un-zoom) (NOT SUPPORTED)\n");
 }
 
-/*====================== rewind_movie ===========================*/
-/* There are two rewind methods.  The first is "unbreakable," */
-/* and uses the data structure rewind_dat.  It is, however, */
-/* limited to files that are not tremendously long.  The second */
-/* can be used on files of any length, but will not work correctly */
-/* in a sample from which vortices are removed.  The first method */
-/* is the default; it can be disabled by hand or by lack of memory, */
-/* in which case the second method is used. */
-void rewind_movie(int *frame_num,int *do_rewind,int disable_rewind,
-		  int num_nodes,int movie_type,int ntypes)
+/*===================== movie_nodes_reserve =======================*/
+/* Makes room in movie[] and findex[] for n nodes.  New entries    */
+/* are empty (nothing mapped, no frames).                          */
+void movie_nodes_reserve(int n)
 {
-  int i,j;
-  long int steps;
-  struct smdata smtempdat;
-  struct kmdata kmtempdat;
-  struct cmdata cmtempdat;
-  struct tmdata tmtempdat;
-  int num_layers;
-  int num_pars;
-
-  if (*frame_num < 15) {
-    /* We aren't far enough into the file to rewind.*/
-    *do_rewind = 0;
-    return;
+  if(n <= movie_nodes) return;
+  movie = (struct movie_file *) realloc(movie,n*sizeof(struct movie_file));
+  findex = (struct frame_index *) realloc(findex,n*sizeof(struct frame_index));
+  if((movie == NULL)||(findex == NULL)){
+    printf("Out of memory for %d nodes\n",n);
+    exit(-1);
   }
-  /* The first rewind method (unbreakable) */
-  if(!disable_rewind){
-    /* Back up one position and find the number of layers. */
-    /* Rewind all files this way */
-    for(j=0;j<num_nodes;j++){
-      switch(movie_type){
-      case SMOVIE:
-	steps = sizeof(smdata);
-	fseek(picfile[j],-steps,1);
-	fread(&smtempdat,sizeof(smdata),1,picfile[j]);
-	num_layers = 1;
-	/* Go backwards five frames.*/
-	for(i=0;i<5;i++){
-	  steps = 
-	    (long)((rewind_dat[j][(*frame_num-1-i)])*sizeof(smdata) 
-		   + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	}
-	break;
-      case KMOVIE:
-	steps = sizeof(kmdata);
-	fseek(picfile[j],-steps,1);
-	fread(&kmtempdat,sizeof(kmdata),1,picfile[j]);
-	num_layers = 1;
-	/* Go backwards five frames.*/
-	for(i=0;i<5;i++){
-	  steps = 
-	    (long)((rewind_dat[j][(*frame_num-1-i)])*sizeof(kmdata) 
-		   + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	}
-	break;
-      case CMOVIE:
-	steps = sizeof(cmdata);
-	fseek(picfile[j],-steps,1);
-	fread(&cmtempdat,sizeof(cmdata),1,picfile[j]);
-	num_layers = 1;
-	/* Go backwards five frames.*/
-	for(i=0;i<5;i++){
-	  steps = 
-	    (long)((rewind_dat[j][(*frame_num-1-i)])*sizeof(cmdata) 
-		   + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	}
-	break;
-      case TMOVIE:
-	steps = sizeof(tmdata);
-	fseek(picfile[j],-steps,1);
-	fread(&tmtempdat,sizeof(tmdata),1,picfile[j]);
-	num_layers = tmtempdat.layr + 1;
-	/* Go backwards five frames.*/
-	for(i=0;i<5;i++){
-	  steps = 
-            (long)(num_layers*(rewind_dat[j][(*frame_num-1-i)])*sizeof(tmdata) 
-		   + 3*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	}
-	break;
-      }
+  memset(movie+movie_nodes,0,(n-movie_nodes)*sizeof(struct movie_file));
+  memset(findex+movie_nodes,0,(n-movie_nodes)*sizeof(struct frame_index));
+  movie_nodes = n;
+}
+
+/*======================== movie_open ============================*/
+/* Maps movie file j into memory.  The frames are then read in    */
+/* place (movie_view) instead of being copied with fread, and     */
+/* seeking is only a change of movie[j].pos.  Returns 0 if the    */
+/* file cannot be opened.                                         */
+int movie_open(int j,char *filename)
+{
+  void movie_close(int j);
+  int read_movie_header(int j);
+  int fd;
+  struct stat st;
+
+  movie_close(j);
+  if((fd = open(filename,O_RDONLY)) < 0) return 0;
+  if(fstat(fd,&st) < 0){
+    close(fd);
+    return 0;
+  }
+  movie[j].size = (size_t)st.st_size;
+  movie[j].pos = 0;
+  movie[j].base = NULL;
+  /* An empty file cannot be mapped; it just has no frames. */
+  if(movie[j].size > 0){
+    movie[j].base = (char *) mmap(NULL,movie[j].size,PROT_READ,MAP_PRIVATE,
+				  fd,0);
+    if(movie[j].base == MAP_FAILED){
+      movie[j].base = NULL;
+      close(fd);
+      return 0;
+    }
+    madvise(movie[j].base,movie[j].size,MADV_SEQUENTIAL);
+  }
+  /* The mapping stays valid after the descriptor is closed. */
+  close(fd);
+
+  movie[j].serial = ++movie_serial;
+  movie[j].packed = 0;
+  movie[j].container = 0;
+  movie[j].sx = movie[j].sy = 0.0;
+  if((movie[j].size >= PACK_HEADER)&&
+     (memcmp(movie[j].base,PACK_MAGIC,4) == 0)){
+    movie[j].packed = 1;
+    memcpy(&movie[j].bits,movie[j].base+4,sizeof(int));
+    memcpy(&movie[j].sx,movie[j].base+12,sizeof(float));
+    memcpy(&movie[j].sy,movie[j].base+16,sizeof(float));
+  }
+  if((movie[j].size >= 2*sizeof(int))&&
+     (memcmp(movie[j].base,CONTAINER_MAGIC,4) == 0)){
+    movie[j].packed = 1;
+    movie[j].container = 1;
+    if(!read_movie_header(j)){
+      printf("Damaged movie header\n");
+      movie_close(j);
+      return 0;
     }
-    *frame_num -= 5;
   }
-  
-  /* The second rewind method (breakable) */
-  else{
-    /* Go backwards five frames.*/
-    /* Rewind all files this way */
-    for(j=0;j<num_nodes;j++){
-      for (i=0; i<5; i++) {
-	
-	/* Back up one position and find out how many particles there are, */
-	/* based on the ID number.  (Far from foolproof method) */
-	/* This will also give us the number of layers there are. */
-	switch(movie_type){
-	case SMOVIE:
-	  steps = sizeof(smdata);
-	  fseek(picfile[j],-steps,1);
-	  fread(&smtempdat,sizeof(smdata),1,picfile[j]);
-	  if(smtempdat.p_num<0)
-	    num_pars = -smtempdat.p_num + 1;
-	  else
-	    num_pars = smtempdat.p_num + 1;
-	  num_layers = 1;
-	  steps = (long)((num_pars)*sizeof(smdata) + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	  break;
-	case KMOVIE:
-	  steps = sizeof(kmdata);
-	  fseek(picfile[j],-steps,1);
-	  fread(&kmtempdat,sizeof(kmdata),1,picfile[j]);
-	  if(kmtempdat.p_num<0)
-	    num_pars = -kmtempdat.p_num + 1;
-	  else
-	    num_pars = kmtempdat.p_num + 1;
-	  num_layers = 1;
-	  steps = (long)((num_pars)*sizeof(kmdata) + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	  break;
-	case CMOVIE:
-	  steps = sizeof(cmdata);
-	  fseek(picfile[j],-steps,1);
-	  fread(&cmtempdat,sizeof(cmdata),1,picfile[j]);
-	  if(cmtempdat.p_num<0)
-	    num_pars = -cmtempdat.p_num + 1;
-	  else
-	    num_pars = cmtempdat.p_num + 1;
-	  num_layers = 1;
-	  steps = (long)((num_pars)*sizeof(cmdata) + 2*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	  break;
-	case TMOVIE:
-	  steps = sizeof(tmdata);
-	  fseek(picfile[j],-steps,1);
-	  fread(&tmtempdat,sizeof(tmdata),1,picfile[j]);
-	  if(tmtempdat.p_num<0)
-	    num_pars = -tmtempdat.p_num + 1;
-	  else
-	    num_pars = tmtempdat.p_num + 1;
-	  num_layers = tmtempdat.layr + 1;
-	  /* Back over the layers of data and the three integers.*/
-	  steps = (long)(num_layers*(num_pars)*sizeof(tmdata)+3*sizeof(int));
-	  fseek(picfile[j],-steps,1);
-	  break;
-	}
-      }
+  if(movie[j].packed){
+    if((movie[j].bits < 1)||(movie[j].bits > 30)){
+      printf("Packed movie with %d bit positions not supported\n",
+	     movie[j].bits);
+      movie_close(j);
+      return 0;
     }
-    (*frame_num) -= 5;
   }
+  return 1;
 }
 
-/*===================== Voronoi routines ========================*/
-/* Includes memory leak fix 8.12.03 */
-/*
- * The author of this software is Steven Fortune.  Copyright (c) 1994 by AT&T
- * Bell Laboratories.
- * Permission to use, copy, modify, and distribute this software for any
- * purpose without fee is hereby granted, provided that this entire notice
- * is included in all copies of any software which is or includes a copy
- * or modification of this software and in all copies of the supporting
- * documentation for such software.
- * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
- * WARRANTY.  IN PARTICULAR, NEITHER THE AUTHORS NOR AT&T MAKE ANY
- * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
- * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
- */
-/*--==--==--==--==--==--==--==--==--==--==--==--==--==--==--==--==*/
-/*  Defined constants and global variables for Voronoi routines */
-#ifndef NULL
-#define NULL 0
-#endif
-#define DELETED -2
+/*====================== read_movie_header =======================*/
+/* Reads the "name value" lines of a container header: the box and */
+/* the position bits.  Other names (dt, seed, species, ...) are    */
+/* for the record and skipped.  Returns 0 if the header is cut.    */
+int read_movie_header(int j)
+{
+  char line[256],name[64];
+  char *p,*end;
+  int len,n;
+  float value;
+
+  memcpy(&len,movie[j].base+4,sizeof(int));
+  if((len < 0)||((size_t)len > movie[j].size - 2*sizeof(int))) return 0;
+  movie[j].bits = 16;
+  p = movie[j].base + 2*sizeof(int);
+  end = p + len;
+  while(p < end){
+    for(n=0;(p+n < end)&&(p[n] != '\n')&&(n < 255);n++) line[n] = p[n];
+    line[n] = '\0';
+    p += n;
+    while((p < end)&&(*p++ != '\n'));
+    if(sscanf(line,"%63s %f",name,&value) != 2) continue;
+    if(strcmp(name,"box_x") == 0) movie[j].sx = value;
+    if(strcmp(name,"box_y") == 0) movie[j].sy = value;
+    if(strcmp(name,"bits") == 0) movie[j].bits = (int)value;
+  }
+  return 1;
+}
 
-struct  Freenode        {
-struct  Freenode        *nextfree;
-};
-struct  Freelist        {
-struct  Freenode        *head;
-int                     nodesize;
-};
+/*======================== movie_close ===========================*/
+void movie_close(int j)
+{
+  if(movie[j].base != NULL) munmap(movie[j].base,movie[j].size);
+  movie[j].base = NULL;
+  movie[j].size = 0;
+  movie[j].pos = 0;
+  movie[j].packed = 0;
+  movie[j].container = 0;
+}
 
-float xmin, xmax, ymin, ymax, deltax, deltay;
-float pxmin, pxmax, pymin, pymax;
+/*======================== movie_view ============================*/
+/* Returns a pointer to the next n bytes of movie j, in the mapped */
+/* file itself, and moves past them.  NULL at the end of the file. */
+/* The data must not be written through this pointer.             */
+char *movie_view(int j,size_t n)
+{
+  char *p;
 
-struct Point    {
-float x,y;
-};
- 
-/* structure used both for sites and for vertices */
-struct Site     {
-struct  Point   coord;
-int             sitenbr;
-int             refcnt;
-};
- 
-/* CIJOL new: making into an array 8.12.03 */
-struct  Site    sites[MAX_OBJECT];
-int             nsites;
-int             siteidx;
-int             sqrt_nsites;
-int             nvertices;
-
-/* CIJOL new: prepare an array of free Sites 8.12.03 */
-struct Site sfl_avail[MAXNUM];
-int next_free_sfl;
-
-struct  Freelist sfl;
-struct  Site    *bottomsite;
- 
-struct Edge     {
-float           a,b,c;
-struct  Site    *ep[2];
-struct  Site    *reg[2];
-int             edgenbr;
-};
-#define le 0
-#define re 1
-int nedges;
-struct  Freelist efl;
-/* CIJOL new: prepare an array of free Edges 8.12.03 */
-struct Edge efl_avail[MAXNUM];
-int next_free_efl;
- 
-int has_endpoint(),right_of();
-struct Site *intersect();
-float dist();
-struct Point PQ_min();
-struct Halfedge *PQextractmin();
-struct Edge *bisect();
- 
-struct Halfedge {
-struct Halfedge *ELleft, *ELright;
-struct Edge     *ELedge;
-int             ELrefcnt;
-char            ELpm;
-struct  Site    *vertex;
-float           ystar;
-struct  Halfedge *PQnext;
-};
+  if((movie[j].base == NULL)||(n > movie[j].size - movie[j].pos))
+    return NULL;
+  p = movie[j].base + movie[j].pos;
+  movie[j].pos += n;
+  return p;
+}
 
-/* CIJOL new: prepare an array of free Halfedges 8.12.03 */
-struct Halfedge hfl_avail[MAXNUM];
-int next_free_hfl;
+/*======================== movie_read ============================*/
+/* Same as fread of one item of n bytes: copies them to dst. */
+int movie_read(int j,void *dst,size_t n)
+{
+  char *p;
+
+  if((p = movie_view(j,n)) == NULL) return 0;
+  memcpy(dst,p,n);
+  return 1;
+}
+
+/*===================== build_frame_index =========================*/
+/* Walks through movie j reading only the frame headers and stores */
+/* the byte offset and MD time of every frame in findex[j].  With  */
+/* this index rewind, fast forward and goto are a single seek.     */
+/* Returns the number of complete frames.                          */
+int build_frame_index(int j,int movie_type)
+{
+  int movie_read(int j,void *dst,size_t n);
+  int index_chunks(int j);
+  void frame_index_add(struct frame_index *fi,size_t start,int md_time);
+  int num_pars,md_time,num_layers,packed_size;
+  size_t start,frame_size;
+  struct frame_index *fi;
+
+  fi = &findex[j];
+  fi->n_frames = 0;
+  movie[j].pos = 0;
+  if(movie[j].packed){
+    if(movie_type != CMOVIE){
+      printf("Node %d is a packed cmovie; use the cmovie command\n",j);
+      return 0;
+    }
+    if(movie[j].container) return index_chunks(j);
+    movie[j].pos = PACK_HEADER;
+  }
+
+  while(1){
+    start = movie[j].pos;
+    if(!movie_read(j,&num_pars,sizeof(int))) break;
+    if(!movie_read(j,&md_time,sizeof(int))) break;
+    num_layers = 1;
+    if((movie_type==TMOVIE)&&(!movie_read(j,&num_layers,sizeof(int)))) break;
+    if((num_pars<0)||(num_layers<0)) break;
+
+    frame_size = 0;
+    /* Packed frames give their length */
+    if(movie[j].packed){
+      if(!movie_read(j,&packed_size,sizeof(int))) break;
+      if(packed_size < 4) break;
+      frame_size = (size_t)packed_size;
+    }
+    else switch(movie_type){
+    case SMOVIE:
+      frame_size = (size_t)num_pars*sizeof(smdata);
+      break;
+    case KMOVIE:
+      frame_size = (size_t)num_pars*sizeof(kmdata);
+      break;
+    case CMOVIE:
+      frame_size = (size_t)num_pars*sizeof(cmdata);
+      break;
+    case TMOVIE:
+      frame_size = (size_t)num_layers*num_pars*sizeof(tmdata);
+      break;
+    }
+    /* Incomplete last frame (the movie may still be written) */
+    if(frame_size > movie[j].size - movie[j].pos) break;
+    movie[j].pos += frame_size;
+    frame_index_add(fi,start,md_time);
+  }
+
+  movie[j].pos = 0;
+  return fi->n_frames;
+}
+
+/*======================= frame_index_add =========================*/
+void frame_index_add(struct frame_index *fi,size_t start,int md_time)
+{
+  if(fi->n_frames == fi->allocated){
+    fi->allocated = (fi->allocated) ? 2*fi->allocated : 4096;
+    fi->offset = (size_t *) realloc(fi->offset,fi->allocated*sizeof(size_t));
+    fi->md_time = (int *) realloc(fi->md_time,fi->allocated*sizeof(int));
+    if((fi->offset == NULL)||(fi->md_time == NULL)){
+      printf("Out of memory for the frame index\n");
+      exit(-1);
+    }
+  }
+  fi->offset[fi->n_frames] = start;
+  fi->md_time[fi->n_frames] = md_time;
+  fi->n_frames++;
+}
+
+/*========================= index_chunks ==========================*/
+/* build_frame_index of a container movie: every chunk lists the   */
+/* offsets and MD times of its frames, so only the chunk headers   */
+/* are read.  A chunk not yet complete ends the movie.             */
+int index_chunks(int j)
+{
+  int n,k,chunk_size,offset,md_time;
+  size_t start;
+  char *p;
+  struct frame_index *fi;
+
+  fi = &findex[j];
+  /* The first chunk follows the header */
+  memcpy(&n,movie[j].base+4,sizeof(int));
+  movie[j].pos = 2*sizeof(int) + n;
+  while(movie[j].size - movie[j].pos >= 3*sizeof(int)){
+    start = movie[j].pos;
+    p = movie[j].base + start;
+    if(memcmp(p,CHUNK_MAGIC,4) != 0) break;
+    memcpy(&chunk_size,p+4,sizeof(int));
+    memcpy(&n,p+8,sizeof(int));
+    if((chunk_size < 3*(int)sizeof(int)+8*n)||(n < 0)||
+       ((size_t)chunk_size > movie[j].size - start)) break;
+    for(k=0;k<n;k++){
+      memcpy(&offset,p+12+4*k,sizeof(int));
+      memcpy(&md_time,p+12+4*(n+k),sizeof(int));
+      if((offset < 12+8*n)||(offset+16 > chunk_size)) break;
+      frame_index_add(fi,start+offset,md_time);
+    }
+    movie[j].pos = start + chunk_size;
+  }
+
+  movie[j].pos = 0;
+  return fi->n_frames;
+}
+
+/*======================= merge_frame_index =======================*/
+/* Lines up the frames of the nodes on MD time: a frame of the     */
+/* merged movie is a time found in every node.  Frames of a node   */
+/* whose time is missing from another node are left out, so a     */
+/* node that was restarted or wrote a frame twice does not shift   */
+/* the others.  Times are taken to increase through each file.    */
+/* Returns the number of merged frames.                            */
+int merge_frame_index(int num_nodes)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  int *pos;
+  int j,t,done,aligned,skipped;
+
+  merged.n_frames = 0;
+  merged.num_nodes = num_nodes;
+  pos = (int *) calloc(num_nodes,sizeof(int));
+  if(pos == NULL){
+    printf("Out of memory for the frame index\n");
+    exit(-1);
+  }
+
+  done = 0;
+  while(!done){
+    /* The latest time among the current frames of the nodes */
+    t = 0;
+    for(j=0;j<num_nodes;j++){
+      if(pos[j] >= findex[j].n_frames){
+	done = 1;
+	break;
+      }
+      if((j == 0)||(findex[j].md_time[pos[j]] > t))
+	t = findex[j].md_time[pos[j]];
+    }
+    if(done) break;
+
+    /* Bring every node up to it */
+    aligned = 1;
+    for(j=0;j<num_nodes;j++){
+      while((pos[j] < findex[j].n_frames)&&(findex[j].md_time[pos[j]] < t))
+	pos[j]++;
+      if((pos[j] >= findex[j].n_frames)||(findex[j].md_time[pos[j]] != t))
+	aligned = 0;
+    }
+    if(!aligned) continue;
+
+    merged.md_time = (int *) grow_buffer(merged.md_time,&merged.md_time_size,
+					 merged.n_frames+1,sizeof(int));
+    merged.node_frame = (int *) grow_buffer(merged.node_frame,
+			&merged.node_frame_size,
+			(merged.n_frames+1)*num_nodes,sizeof(int));
+    merged.md_time[merged.n_frames] = t;
+    for(j=0;j<num_nodes;j++)
+      merged.node_frame[merged.n_frames*num_nodes+j] = pos[j]++;
+    merged.n_frames++;
+  }
+  free(pos);
+
+  skipped = 0;
+  for(j=0;j<num_nodes;j++) skipped += findex[j].n_frames - merged.n_frames;
+  if(skipped > 0)
+    printf("%d frames have no match in all nodes and are left out\n",skipped);
+  return merged.n_frames;
+}
+
+/*========================= index_worker ==========================*/
+/* Thread of index_movies: indexes nodes until none are left. */
+void *index_worker(void *arg)
+{
+  int build_frame_index(int j,int movie_type);
+  struct index_job *job = (struct index_job *) arg;
+  int j;
+
+  while(1){
+    pthread_mutex_lock(&job->lock);
+    j = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(j >= job->num_nodes) break;
+    build_frame_index(j,job->movie_type);
+  }
+  return NULL;
+}
+
+/*========================= index_movies ==========================*/
+/* Indexes the files of all nodes, several at a time (each thread  */
+/* walks its own file), then merges them on MD time.  The header   */
+/* walk is what reads the shards from disk, so this is where the   */
+/* parallel reads pay.  Returns the number of merged frames.       */
+/* Called by: main$.*/
+int index_movies(int num_nodes,int movie_type)
+{
+  void *index_worker(void *arg);
+  int build_frame_index(int j,int movie_type);
+  int merge_frame_index(int num_nodes);
+  struct index_job job;
+  pthread_t *threads;
+  int i,n_threads;
+
+  n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads > num_nodes) n_threads = num_nodes;
+  if(n_threads <= 1){
+    for(i=0;i<num_nodes;i++) build_frame_index(i,movie_type);
+    return merge_frame_index(num_nodes);
+  }
+
+  pthread_mutex_init(&job.lock,NULL);
+  job.next = 0;
+  job.num_nodes = num_nodes;
+  job.movie_type = movie_type;
+  threads = (pthread_t *) malloc(n_threads*sizeof(pthread_t));
+  for(i=0;i<n_threads;i++)
+    pthread_create(&threads[i],NULL,index_worker,&job);
+  for(i=0;i<n_threads;i++)
+    pthread_join(threads[i],NULL);
+  free(threads);
+  pthread_mutex_destroy(&job.lock);
+  return merge_frame_index(num_nodes);
+}
+
+/*========================= node_frame ============================*/
+/* Frame of node j (from 0) that is merged frame f (from 0). */
+int node_frame(int j,int f)
+{
+  return merged.node_frame[f*merged.num_nodes+j];
+}
+
+/*===================== Packed movie reader ======================*/
+/* Frame of a packed movie (see main.c, write_packed_movie):        */
+/*   num_pars md_time size key kx ky kc bits...                     */
+/* The bits, least significant first, are Rice codes: the quotient */
+/* u>>k in unary (ones ended by a zero), then the low k bits.  A   */
+/* quotient of PACK_ESCAPE ones is followed by u in 32 bits.  Key  */
+/* frames have num_pars colors, each less the one before, then the */
+/* x and y steps the same way; other frames only the change of x   */
+/* and y since the frame before.  The values are zigzag coded.    */
+/* A key byte of 3 (IDs not the index) puts a byte ki before the   */
+/* bits and the IDs after the colors, each less the one before     */
+/* plus one; otherwise the ID is the index.                        */
+
+struct bit_reader {
+  unsigned char *p,*end;
+  unsigned long long acc;
+  int n_acc;
+};
+
+/*========================== get_bits ============================*/
+unsigned int get_bits(struct bit_reader *b,int n)
+{
+  unsigned int v;
+
+  while(b->n_acc < n){
+    if(b->p < b->end) b->acc |= (unsigned long long)(*b->p++) << b->n_acc;
+    b->n_acc += 8;
+  }
+  v = (unsigned int)(b->acc & ((1ull << n) - 1));
+  b->acc >>= n;
+  b->n_acc -= n;
+  return v;
+}
+
+/*========================== get_rice ============================*/
+/* A Rice coded value with parameter k, as a signed difference. */
+int get_rice(struct bit_reader *b,int k)
+{
+  unsigned int q,u;
+
+  q = 0;
+  while((q < PACK_ESCAPE)&&get_bits(b,1)) q++;
+  if(q == PACK_ESCAPE){
+    u = get_bits(b,16);
+    u |= get_bits(b,16) << 16;
+  }
+  else{
+    u = q << k;
+    if(k > 0) u |= get_bits(b,k);
+  }
+  return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+/*======================== unpack_record =========================*/
+/* Decodes frame k of node j into u, from the frame before it in u */
+/* unless k is a key frame.  Returns 0 for a damaged frame.        */
+int unpack_record(struct unpacker *u,int j,int k)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  struct bit_reader b;
+  unsigned char *p;
+  unsigned int mask;
+  int num_pars,size,key,kx,ky,kc,ki,i,c,n;
+
+  p = (unsigned char *) movie[j].base + findex[j].offset[k];
+  memcpy(&num_pars,p,sizeof(int));
+  memcpy(&size,p+2*sizeof(int),sizeof(int));
+  p += 3*sizeof(int);
+  key = p[0];
+  kx = p[1];
+  ky = p[2];
+  kc = p[3];
+  if(!key && (num_pars != u->n)) return 0;
+
+  if(num_pars > u->size){
+    n = u->size;
+    u->qx = (unsigned int *) grow_buffer(u->qx,&n,num_pars,sizeof(int));
+    n = u->size;
+    u->qy = (unsigned int *) grow_buffer(u->qy,&n,num_pars,sizeof(int));
+    n = u->size;
+    u->color = (int *) grow_buffer(u->color,&n,num_pars,sizeof(int));
+    n = u->size;
+    u->id = (int *) grow_buffer(u->id,&n,num_pars,sizeof(int));
+    n = u->size;
+    u->cm = (struct cmdata *) grow_buffer(u->cm,&n,num_pars,sizeof(cmdata));
+    u->size = n;
+  }
+
+  b.p = p+4;
+  b.end = p+size;
+  ki = 0;
+  if(key & 2) ki = *b.p++;
+  b.acc = 0;
+  b.n_acc = 0;
+  mask = (1u << movie[j].bits) - 1;
+  if(key){
+    c = 0;
+    for(i=0;i<num_pars;i++) u->color[i] = c = c + get_rice(&b,kc);
+    if(key & 2){
+      c = -1;
+      for(i=0;i<num_pars;i++) u->id[i] = c = c + 1 + get_rice(&b,ki);
+    }
+    else
+      for(i=0;i<num_pars;i++) u->id[i] = i;
+    for(i=0;i<num_pars;i++)
+      u->qx[i] = ((i > 0 ? u->qx[i-1] : 0) + get_rice(&b,kx)) & mask;
+    for(i=0;i<num_pars;i++)
+      u->qy[i] = ((i > 0 ? u->qy[i-1] : 0) + get_rice(&b,ky)) & mask;
+  }
+  else{
+    for(i=0;i<num_pars;i++) u->qx[i] = (u->qx[i] + get_rice(&b,kx)) & mask;
+    for(i=0;i<num_pars;i++) u->qy[i] = (u->qy[i] + get_rice(&b,ky)) & mask;
+  }
+  u->n = num_pars;
+  u->frame = k;
+  return 1;
+}
+
+/*======================== unpack_frame ==========================*/
+/* Frame k (from 0) of the packed movie of node j as cmovie data. */
+/* Going forward one frame decodes only that frame; otherwise the  */
+/* decoding starts at the key frame before k.  NULL if damaged.   */
+struct cmdata *unpack_frame(struct unpacker *u,int j,int k)
+{
+  int start,m,i;
+  float scale_x,scale_y;
+
+  if(u->serial != movie[j].serial){
+    u->serial = movie[j].serial;
+    u->frame = -1;
+  }
+  if(u->frame == k) return u->cm;
+
+  /* From the frame decoded last if k follows it, else from the */
+  /* key frame before k (the key byte follows the three ints). */
+  start = k;
+  if((u->frame < 0)||(u->frame != k-1))
+    while((start > 0)&&
+	  !movie[j].base[findex[j].offset[start]+3*sizeof(int)]) start--;
+  for(m=start;m<=k;m++)
+    if(!unpack_record(u,j,m)){
+      u->frame = -1;
+      return NULL;
+    }
+
+  scale_x = movie[j].sx / (float)(1u << movie[j].bits);
+  scale_y = movie[j].sy / (float)(1u << movie[j].bits);
+  for(i=0;i<u->n;i++){
+    u->cm[i].color = u->color[i];
+    u->cm[i].p_num = u->id[i];
+    u->cm[i].x = (u->qx[i] + 0.5f)*scale_x;
+    u->cm[i].y = (u->qy[i] + 0.5f)*scale_y;
+    u->cm[i].cum_disp = 1.0;
+  }
+  return u->cm;
+}
+
+/*======================== unpackers_free ========================*/
+void unpackers_free(struct unpacker *u,int n)
+{
+  int j;
+
+  for(j=0;j<n;j++){
+    free(u[j].qx);
+    free(u[j].qy);
+    free(u[j].color);
+    free(u[j].id);
+    free(u[j].cm);
+  }
+  free(u);
+}
+
+/*========================= frame_data ============================*/
+/* Reads the header of merged frame f (from 0) of node j where it  */
+/* is in the mapped file and returns a pointer to the particles.   */
+/* Packed frames are decoded with u[j].  Any thread may call this  */
+/* with its own u (one per node).                                  */
+char *frame_data(int j,int f,int movie_type,int *num_pars,int *num_layers,
+		 struct unpacker *u)
+{
+  char *p;
+
+  p = movie[j].base + findex[j].offset[node_frame(j,f)];
+  memcpy(num_pars,p,sizeof(int));
+  p += 2*sizeof(int);
+  *num_layers = 1;
+  if(movie_type == TMOVIE){
+    memcpy(num_layers,p,sizeof(int));
+    p += sizeof(int);
+  }
+  if(movie[j].packed){
+    p = (char *) unpack_frame(&u[j],j,node_frame(j,f));
+    if(p == NULL) *num_pars = 0;
+  }
+  return p;
+}
+
+/*========================= seek_frame ============================*/
+/* Positions all nodes at the start of frame number frame (the     */
+/* first frame is 1).  Returns 0 if there is no such frame.        */
+int seek_frame(int frame,int num_nodes)
+{
+  int j;
+
+  if((frame < 1)||(frame > merged.n_frames)) return 0;
+  for(j=0;j<num_nodes;j++)
+    movie[j].pos = findex[j].offset[node_frame(j,frame-1)];
+  return 1;
+}
+
+/*======================= find_time_frame =========================*/
+/* First frame (counting from 1) with MD time >= md_time, by       */
+/* bisection of the merged index.  0 if every frame is earlier.    */
+int find_time_frame(int md_time)
+{
+  int lo,hi,mid;
+
+  lo = 0;
+  hi = merged.n_frames;
+  while(lo < hi){
+    mid = (lo+hi)/2;
+    if(merged.md_time[mid] < md_time) lo = mid+1;
+    else hi = mid;
+  }
+  return (lo < merged.n_frames) ? lo+1 : 0;
+}
+
+/*========================= goto_frame ============================*/
+/* goto <frame> or goto time <md_time>: sets up the movie so that  */
+/* the next frame plotted (with cont) is the requested one.        */
+void goto_frame(char *line,int *ipos,int *frame_num,int num_nodes,
+		int *do_clear)
+{
+  int get_arg(char *line,int *ipos,char *arg);
+  char arg[100];
+  int frame;
+
+  if(merged.n_frames == 0){
+    printf("Need to plot a file first!\n");
+    return;
+  }
+  if(!get_arg(line,ipos,arg)){
+    printf("goto <frame> or goto time <t>\n");
+    return;
+  }
+  if(strcmp(arg,"time") == 0){
+    if(!get_arg(line,ipos,arg)){
+      printf("goto time <t>\n");
+      return;
+    }
+    frame = find_time_frame(atoi(arg));
+    if(frame == 0){
+      printf("Movie ends at time %d\n",
+	     merged.md_time[merged.n_frames-1]);
+      return;
+    }
+  }
+  else
+    frame = atoi(arg);
+
+  if(!seek_frame(frame,num_nodes)){
+    printf("Frame %d out of range 1 - %d\n",frame,merged.n_frames);
+    return;
+  }
+  *frame_num = frame;
+  /* The trajectories would jump; start them again */
+  *do_clear = 1;
+  printf("At frame %d, time %d\n",frame,merged.md_time[frame-1]);
+}
+
+/*======================== prefetch_thread ========================*/
+/* Reader thread.  It keeps the next PREFETCH_FRAMES frames in the */
+/* direction of play resident, by touching every page of them in  */
+/* the mapped files, so the render loop finds them in memory and  */
+/* never waits for the disk (or the network filesystem).  The     */
+/* frames next, next+stride, ... next+(ready-1)*stride are done.  */
+/* Packed nodes are also decoded, with the thread's own unpackers, */
+/* into the slot of the frame (prefetch_frame hands it out).  The */
+/* slots of the done frames differ (stride 1 or 5 and 16 slots),  */
+/* and the thread never writes the one of next.                   */
+static volatile char prefetch_sink; /* the page touches are not optimized away */
+
+void *prefetch_thread(void *arg)
+{
+  int node_frame(int j,int f);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  struct cmdata *unpack_frame(struct unpacker *u,int j,int k);
+  struct prefetch_slot *s;
+  struct cmdata *cm;
+  int frame,generation,j,k0,n;
+  size_t start,end,k;
+
+  pthread_mutex_lock(&prefetch.lock);
+  while(!prefetch.quit){
+    if(prefetch.ready >= PREFETCH_FRAMES){
+      pthread_cond_wait(&prefetch.wake,&prefetch.lock);
+      continue;
+    }
+    frame = prefetch.next + prefetch.ready*prefetch.stride;
+    generation = prefetch.generation;
+    s = &prefetch.slot[((frame % PREFETCH_FRAMES) + PREFETCH_FRAMES) % PREFETCH_FRAMES];
+    s->frame = -1;
+    pthread_mutex_unlock(&prefetch.lock);
+
+    for(j=0;j<prefetch.num_nodes;j++){
+      if((frame < 1)||(frame > merged.n_frames)) continue;
+      k0 = node_frame(j,frame-1);
+      if(movie[j].packed){
+	/* Decoding reads the frame, no need to touch it first */
+	cm = unpack_frame(&prefetch.unpack[j],j,k0);
+	if(cm == NULL){
+	  free(s->cm[j]);
+	  s->cm[j] = NULL;
+	  s->cm_size[j] = 0;
+	  continue;
+	}
+	n = prefetch.unpack[j].n;
+	s->cm[j] = (struct cmdata *) grow_buffer(s->cm[j],&s->cm_size[j],n,
+						 sizeof(cmdata));
+	memcpy(s->cm[j],cm,n*sizeof(cmdata));
+	continue;
+      }
+      start = findex[j].offset[k0];
+      end = (k0+1 < findex[j].n_frames) ? findex[j].offset[k0+1] : movie[j].size;
+      for(k=start;k<end;k+=4096)
+	prefetch_sink = movie[j].base[k];
+    }
+
+    pthread_mutex_lock(&prefetch.lock);
+    /* Nothing to do past the ends of the movie */
+    if((frame < 1)||(frame > merged.n_frames)){
+      if(generation == prefetch.generation)
+	prefetch.ready = PREFETCH_FRAMES;
+      continue;
+    }
+    /* The render loop may have jumped meanwhile */
+    if(generation == prefetch.generation){
+      s->frame = frame;
+      s->generation = generation;
+      prefetch.ready++;
+    }
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+  return NULL;
+}
+
+/*======================== prefetch_start =========================*/
+/* Starts the reader thread on the movies just indexed. */
+void prefetch_start(int num_nodes)
+{
+  int i;
+
+  prefetch.unpack = (struct unpacker *) calloc(num_nodes,sizeof(struct unpacker));
+  for(i=0;i<PREFETCH_FRAMES;i++){
+    prefetch.slot[i].frame = -1;
+    prefetch.slot[i].cm = (struct cmdata **) calloc(num_nodes,sizeof(struct cmdata *));
+    prefetch.slot[i].cm_size = (int *) calloc(num_nodes,sizeof(int));
+  }
+  prefetch.quit = 0;
+  prefetch.next = 1;
+  prefetch.stride = 1;
+  prefetch.ready = 0;
+  prefetch.generation = 0;
+  prefetch.num_nodes = num_nodes;
+  if(pthread_create(&prefetch.thread,NULL,prefetch_thread,NULL) == 0)
+    prefetch.running = 1;
+  else
+    printf("Could not start the prefetch thread; reading on demand\n");
+}
+
+/*======================== prefetch_stop ==========================*/
+/* Must be called before the movies are unmapped. */
+void prefetch_stop()
+{
+  void unpackers_free(struct unpacker *u,int n);
+  int i,j;
+
+  if(prefetch.unpack == NULL) return;
+  if(prefetch.running){
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.quit = 1;
+    pthread_cond_signal(&prefetch.wake);
+    pthread_mutex_unlock(&prefetch.lock);
+    pthread_join(prefetch.thread,NULL);
+    prefetch.running = 0;
+  }
+  for(i=0;i<PREFETCH_FRAMES;i++){
+    for(j=0;j<prefetch.num_nodes;j++) free(prefetch.slot[i].cm[j]);
+    free(prefetch.slot[i].cm);
+    free(prefetch.slot[i].cm_size);
+    prefetch.slot[i].cm = NULL;
+    prefetch.slot[i].cm_size = NULL;
+  }
+  unpackers_free(prefetch.unpack,prefetch.num_nodes);
+  prefetch.unpack = NULL;
+}
+
+/*======================== prefetch_frame =========================*/
+/* Frame (merged, from 1) of packed node j as decoded by the reader */
+/* thread, or NULL if it has not got there: then the render loop   */
+/* decodes it itself.  Valid until the next prefetch_position.     */
+struct cmdata *prefetch_frame(int j,int frame)
+{
+  struct prefetch_slot *s;
+  struct cmdata *cm = NULL;
+
+  if(!prefetch.running) return NULL;
+  pthread_mutex_lock(&prefetch.lock);
+  s = &prefetch.slot[((frame % PREFETCH_FRAMES) + PREFETCH_FRAMES) % PREFETCH_FRAMES];
+  if((s->frame == frame)&&(s->generation == prefetch.generation))
+    cm = s->cm[j];
+  pthread_mutex_unlock(&prefetch.lock);
+  return cm;
+}
+
+/*======================= prefetch_position =======================*/
+/* Called by plot_frame before reading frame: the render loop moves */
+/* to frame, and will go on in steps of stride (1 playing, 5 fast   */
+/* forward, -5 rewind).  A step along the prefetched frames uses    */
+/* up one of them; any other move restarts the read ahead there.    */
+void prefetch_position(int frame,int stride)
+{
+  if(!prefetch.running) return;
+  pthread_mutex_lock(&prefetch.lock);
+  if((stride == prefetch.stride)&&(frame == prefetch.next+stride)
+     &&(prefetch.ready > 0)){
+    prefetch.ready--;
+  }
+  else if((stride != prefetch.stride)||(frame != prefetch.next)){
+    prefetch.ready = 0;
+    prefetch.stride = stride;
+    prefetch.generation++;
+  }
+  prefetch.next = frame;
+  pthread_cond_signal(&prefetch.wake);
+  pthread_mutex_unlock(&prefetch.lock);
+}
+
+/*====================== rewind_movie ===========================*/
+/* Goes back 5 frames using the frame index.  Stops rewinding at */
+/* the first frame. */
+void rewind_movie(int *frame_num,int *do_rewind,int num_nodes)
+{
+  int frame;
+
+  /* frame_num is the frame about to be read; the one on the screen */
+  /* is frame_num-1. */
+  frame = *frame_num - 5;
+  if(frame <= 1){
+    frame = 1;
+    *do_rewind = 0;
+  }
+  if(seek_frame(frame,num_nodes))
+    *frame_num = frame;
+  else
+    *do_rewind = 0;
+}
+
+/*===================== Voronoi routines ========================*/
+/* Includes memory leak fix 8.12.03 */
+/*
+ * The author of this software is Steven Fortune.  Copyright (c) 1994 by AT&T
+ * Bell Laboratories.
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY.  IN PARTICULAR, NEITHER THE AUTHORS NOR AT&T MAKE ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ */
+/*--==--==--==--==--==--==--==--==--==--==--==--==--==--==--==--==*/
+/*  Data structures for the Voronoi routines.  The globals of the  */
+/*  original program are now fields of struct tessellation, so     */
+/*  several constructions can be done at the same time.            */
+#ifndef NULL
+#define NULL 0
+#endif
+#define DELETED -2
+
+struct Point    {
+double x,y;
+};
  
-struct   Freelist       hfl;
-struct  Halfedge *ELleftend, *ELrightend;
-int     ELhashsize;
-/* This structure needs to be freed when done: ELhash */
-/* CIJOL turning into array 8.12.03 */
-/*struct  Halfedge **ELhash;*/
-struct Halfedge *ELhash[MAXNUM];
-struct  Halfedge *HEcreate(), *ELleft(), *ELright(), *ELleftbnd();
-struct  Site *leftreg(), *rightreg();
+/* structure used both for sites and for vertices */
+struct Site     {
+struct  Point   coord;
+int             sitenbr;
+};
  
-int PQhashsize;
-/* This structure needs to be freed when done: PQhash */
-/* CIJOL turning into array 8.12.03 */
-/*struct  Halfedge *PQhash;*/
-struct Halfedge PQhash[MAXNUM];
-struct  Halfedge *PQfind();
-int PQcount;
-int PQmin;
-int PQempty();
+struct Edge     {
+double          a,b,c;
+struct  Site    *ep[2];
+struct  Site    *reg[2];
+int             edgenbr;
+};
+#define le 0
+#define re 1
+ 
+struct Halfedge {
+struct Halfedge *ELleft, *ELright;
+struct Edge     *ELedge;
+char            ELpm;
+struct  Site    *vertex;
+double          ystar;
+struct  Halfedge *PQnext;
+};
+
+/* Upper bounds for a construction of n sites.  Every site event */
+/* makes one edge, two halfedges and at most two intersections,   */
+/* every vertex (at most 2n) one edge, one halfedge and at most   */
+/* two intersections. */
+#define VERT_ARENA(n) (2*(n)+4)
+#define EDGE_ARENA(n) (3*(n)+4)
+#define HALF_ARENA(n) (4*(n)+4)
+#define SITE_ARENA(n) (6*(n)+8)
+
+/* Width, in mean particle spacings, of the strip along the edges */
+/* that calculate_periodic_voronoi images to the other side. */
+#define PERIODIC_MARGIN 3.0
+
+/* One Voronoi construction.  The vertices, edges */
+/* and halfedges of the sweep come from arenas sized for capacity */
+/* sites; they are reset, not freed, between frames, so after the */
+/* largest frame no more memory is allocated. */
+struct tessellation {
+  int capacity;               /* number of sites the arrays can hold */
+  struct Site *sites;         /* input sites, sorted on y, then x */
+  int nsites;
+  int nreal;                  /* sites from nreal up are periodic images */
+  int siteidx;
+  int sqrt_nsites;
+  float xmin,xmax,ymin,ymax,deltax,deltay;
+  struct Site *bottomsite;
+
+  struct Site *sfl_avail;     /* arena of intersections (vertices) */
+  int next_free_sfl;
+  struct Edge *efl_avail;     /* arena of edges */
+  int next_free_efl;
+  struct Halfedge *hfl_avail; /* arena of halfedges */
+  int next_free_hfl;
+  int nvertices;
+  int nedges;
+
+  struct Halfedge *ELleftend, *ELrightend;
+  int ELhashsize;
+  struct Halfedge **ELhash;
+  int PQhashsize;
+  struct Halfedge *PQhash;
+  int PQcount;
+  int PQmin;
+
+  /* Results.  Sites keep the index they had in the input. */
+  float *rx,*ry;              /* site positions */
+  int site_counter;
+  float *vertx,*verty;        /* Voronoi vertices */
+  int num_vert;
+  float *linea,*lineb,*linec; /* bisectors, a*x + b*y = c */
+  int numlines;
+  int *cjoleft,*cjoright;     /* vertices at the two ends of each edge */
+  int num_ep;
+  int *tripA,*tripB,*tripC;   /* Delaunay triangle around each vertex */
+  int num_trip;
+  int *sidenum;               /* number of sides of each site's polygon */
+  int *polystart;             /* the vertices of site i are polylist[j] */
+  int *polylist;              /* for polystart[i] <= j < polystart[i+1] */
+};
+
+void calculate_voronoi(struct tessellation *t,int nVin,float xdatin[],
+		       float ydatin[]);
+void calculate_periodic_voronoi(struct tessellation *t,int nVin,
+				float xdatin[],float ydatin[],float sx,
+				float sy,float margin);
+void tessellation_reserve(struct tessellation *t,int n);
+void tessellation_free(struct tessellation *t);
+void read_program_sites(struct tessellation *t,int nvin,float xdatin[],
+			float ydatin[]);
+void sort_sites(struct tessellation *t);
+struct Site *nextone(struct tessellation *t);
+void voronoi(struct tessellation *t);
+void geominit(struct tessellation *t);
+void make_polygons(struct tessellation *t);
+void out_bisector(struct tessellation *t,struct Edge *e);
+void out_ep(struct tessellation *t,struct Edge *e);
+void out_vertex(struct tessellation *t,struct Site *v);
+void out_site(struct tessellation *t,struct Site *s);
+void out_triple(struct tessellation *t,struct Site *s1,struct Site *s2,
+		struct Site *s3);
+void ELinitialize(struct tessellation *t);
+struct Halfedge *HEcreate(struct tessellation *t,struct Edge *e,int pm);
+void ELinsert(struct Halfedge *lb,struct Halfedge *new);
+struct Halfedge *ELgethash(struct tessellation *t,int b);
+struct Halfedge *ELleftbnd(struct tessellation *t,struct Point *p);
+void ELdelete(struct Halfedge *he);
+struct Halfedge *ELright(struct Halfedge *he);
+struct Halfedge *ELleft(struct Halfedge *he);
+struct Site *leftreg(struct tessellation *t,struct Halfedge *he);
+struct Site *rightreg(struct tessellation *t,struct Halfedge *he);
+struct Edge *bisect(struct tessellation *t,struct Site *s1,struct Site *s2);
+struct Site *intersect(struct tessellation *t,struct Halfedge *el1,
+		       struct Halfedge *el2);
+int right_of(struct Halfedge *el,struct Point *p);
+void endpoint(struct tessellation *t,struct Edge *e,int lr,struct Site *s);
+double dist(struct Site *s,struct Site *t);
+void makevertex(struct tessellation *t,struct Site *v);
+void PQinsert(struct tessellation *t,struct Halfedge *he,struct Site *v,
+	      double offset);
+void PQdelete(struct tessellation *t,struct Halfedge *he);
+int PQbucket(struct tessellation *t,struct Halfedge *he);
+int PQempty(struct tessellation *t);
+struct Point PQ_min(struct tessellation *t);
+struct Halfedge *PQextractmin(struct tessellation *t);
+void PQinitialize(struct tessellation *t);
+void arena_overflow(char *what);
 
 /*============================= plot_Voronoi ======================*/
 /* Plots Voronoi construction data (animation) */
+/* With periodic_voronoi, particles near the edges are imaged      */
+/* through the syssizex by syssizey periodic boundaries first.     */
 void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
-		  int flag,int max_color)
-{
-  void calculate_voronoi(int nVin,float xdatin[],float ydatin[],float linea[],
-			 float lineb[],float linec[],int *numlines,float rx[],
-			 float ry[],int *site_counter,float vertx[],
-			 float verty[],int *num_vert,int cjoleft[],
-			 int cjoright[],int *num_ep,int tripA[],int tripB[],
-			 int tripC[],int *num_trip);
+		  int flag,int max_color,int periodic_voronoi,
+		  float syssizex,float syssizey)
+{
   void plot_poly_line(float x1,float y1,float x2,float y2);
-  void plot_polygon(int index,int sidenum,int polylist[][20],float vertx[],
+  void plot_polygon(int sidenum,int polylist[],float vertx[],
 		    float verty[],float xcenter,float ycenter);
   void plot_triangle(float x1,float y1,float x2,float y2,float x3,float y3,
 		     int sideA,int sideB,int sideC,float dmin,float dmax,
 		     float dstore[][3],int,int);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
   /*void plot_vertex();*/
 
-  float xdat[MAX_OBJECT],ydat[MAX_OBJECT];
-  float rx[MAX_OBJECT],ry[MAX_OBJECT];
-  float vertx[MAXNUM],verty[MAXNUM];
-  int cjoleft[MAXNUM],cjoright[MAXNUM];
-  int tripA[MAXNUM],tripB[MAXNUM],tripC[MAXNUM];
-  float linea[MAXNUM],lineb[MAXNUM],linec[MAXNUM];
-  int numlines;
-  int site_counter;
-  int num_vert;
-  int num_ep;
-  int num_trip;
+  /* The construction and the buffers are kept from frame to frame. */
+  static struct tessellation tess;
+  static float *xdat = NULL,*ydat = NULL;
+  static int xdat_size = 0,ydat_size = 0;
+  /* Can't bear to calculate the distances twice...*/
+  static float (*dstore)[3] = NULL;
+  static int dstore_size = 0;
+  struct tessellation *t = &tess;
+  float *rx,*ry,*vertx,*verty;
+  int *tripA,*tripB,*tripC;
   int i,j;
   float x[3],y[3];
   float xwidth,ywidth;
-  int polynum[20000],polylist[20000][20]; /* Used to reconstruct polygons.*/
-  int index;
   float dx,dy,dist;
-  /* Can't bear to calculate the distances twice...*/
-  float dstore[MAXNUM][3];
   float dmin,dmax;
   float avgdist;
   int count;
 
-  /* Zero vertex structures */
-  for(i=0;i<20000;i++){
-    vertx[i] = 0;
-    verty[i] = 0;
-    polynum[i] = 0;
-  }
-
-  site_counter = 0;
-  num_vert = 0;
-  num_ep = 0;
-  num_trip = 0;
+  if(num_pars < 3) return;
+  xdat = (float *) grow_buffer(xdat,&xdat_size,num_pars,sizeof(float));
+  ydat = (float *) grow_buffer(ydat,&ydat_size,num_pars,sizeof(float));
 
   /* Pull required data out of frame: x,y positions only. */
   for(i=0;i<num_pars;i++){
@@ -3811,20 +5014,21 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
   }
 
   /* Now pass this info to the att voronoi program. */
-  calculate_voronoi(num_pars,xdat,ydat,linea,lineb,linec,&numlines,
-		    rx,ry,&site_counter,vertx,verty,&num_vert,
-		    cjoleft,cjoright,&num_ep,
-		    tripA,tripB,tripC,&num_trip);
-
-  /* Count the number of sides each vortex has */
-  for(i=0;i<MAX_OBJECT;i++)
-    sidenum[i] = 0;
-
-  for(i=0;i<num_trip;i++){
-    sidenum[tripA[i]]++;
-    sidenum[tripB[i]]++;
-    sidenum[tripC[i]]++;
-  }
+  if(periodic_voronoi && (syssizex > 0) && (syssizey > 0))
+    calculate_periodic_voronoi(t,num_pars,xdat,ydat,syssizex,syssizey,0.0);
+  else
+    calculate_voronoi(t,num_pars,xdat,ydat);
+  rx = t->rx;
+  ry = t->ry;
+  vertx = t->vertx;
+  verty = t->verty;
+  tripA = t->tripA;
+  tripB = t->tripB;
+  tripC = t->tripC;
+
+  /* The number of sides each vortex has */
+  for(i=0;i<num_pars;i++)
+    sidenum[i] = t->sidenum[i];
 
   /* At this point we have all the required data: the locations of the */
   /* sides of all the Voronoi triangles.  We next need to plot it to screen*/
@@ -3834,33 +5038,23 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
   /* Voronoi polyhedra and 2 for Delaunay triangles. */
   switch(flag){
   case 1:
-    /* We reconstruct the polygons based on data received from the program. */
-    for(i=0;i<num_trip;i++){
-      index = tripA[i];
-      polylist[index][polynum[index]] = i;
-      polynum[index]++;
-      index = tripB[i];
-      polylist[index][polynum[index]] = i;
-      polynum[index]++;
-      index = tripC[i];
-      polylist[index][polynum[index]] = i;
-      polynum[index]++;
-    }
-
-    /* Now plot these polygons directly, filled or unfilled according to  */
-    /* the number of sides. */
-    xwidth = (xmax - xmin)/2;
-    ywidth = (ymax - ymin)/2;
-    for(i=0;i<num_trip;i++){
-      plot_polygon(i,polynum[i],polylist,vertx,verty,rx[i],ry[i]);
+    /* The polygons were reconstructed by make_polygons.  Plot them */
+    /* directly, filled or unfilled according to the number of sides. */
+    xwidth = (t->xmax - t->xmin)/2;
+    ywidth = (t->ymax - t->ymin)/2;
+    for(i=0;i<num_pars;i++){
+      plot_polygon(t->sidenum[i],&t->polylist[t->polystart[i]],vertx,verty,
+		   rx[i],ry[i]);
     }
 
     /* Also draw lines around the outsides of the polygons. */
-    for(i=0;i<num_ep;i++){
-      x[0] = vertx[cjoleft[i]];
-      x[1] = vertx[cjoright[i]];
-      y[0] = verty[cjoleft[i]];
-      y[1] = verty[cjoright[i]];
+    for(i=0;i<t->num_ep;i++){
+      /* Edges going off to infinity have only one vertex */
+      if((t->cjoleft[i] < 0)||(t->cjoright[i] < 0)) continue;
+      x[0] = vertx[t->cjoleft[i]];
+      x[1] = vertx[t->cjoright[i]];
+      y[0] = verty[t->cjoleft[i]];
+      y[1] = verty[t->cjoright[i]];
       /* Clip lines that are longer than 1/2 the system size in x or y */
       if(fabs(x[0]-x[1])>xwidth) continue;
       if(fabs(y[0]-y[1])>ywidth) continue;
@@ -3875,64 +5069,46 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
     /* identify the longest and shortest lengths. */
     /* I also store the distances since I can't bring myself to */
     /* calculate them twice. */
-    xwidth = (xmax - xmin)/2;
-    ywidth = (ymax - ymin)/2;
+    dstore = (float (*)[3]) grow_buffer(dstore,&dstore_size,t->num_trip,
+					sizeof(*dstore));
+    xwidth = (t->xmax - t->xmin)/2;
+    ywidth = (t->ymax - t->ymin)/2;
     dmin=10000.0;
     dmax=0.0;
     avgdist=0;
     count=0;
-    for(i=0;i<num_trip;i++){
+    for(i=0;i<t->num_trip;i++){
       x[0] = rx[tripA[i]];
       x[1] = rx[tripB[i]];
       x[2] = rx[tripC[i]];
       y[0] = ry[tripA[i]];
       y[1] = ry[tripB[i]];
       y[2] = ry[tripC[i]];
-      dx=x[0]-x[1];
-      dy=y[0]-y[1];
-      if((fabs(x[0]-x[1])>xwidth)||(fabs(y[0]-y[1])>ywidth)){
-	/* Skip this line, it's an artifact. */
-	dstore[i][0]=-1;
-      }
-      else{
-	dist=(float)sqrt((double)(dx*dx+dy*dy));
-	dstore[i][0]=dist;
-	if(dist<dmin) dmin=dist;
-	if(dist>dmax) dmax=dist;
-	avgdist += dist;
-	count++;
+      /* Triangles of periodic images only are outside the box */
+      if((tripA[i] >= num_pars) && (tripB[i] >= num_pars) &&
+	 (tripC[i] >= num_pars)){
+	dstore[i][0] = dstore[i][1] = dstore[i][2] = -1;
+	continue;
       }
-      dx=x[1]-x[2];
-      dy=y[1]-y[2];
-      if((fabs(x[1]-x[2])>xwidth)||(fabs(y[1]-y[2])>ywidth)){
-	/* Skip this line, it's an artifact. */
-	dstore[i][1]=-1;
-      }
-      else{
-	dist=(float)sqrt((double)(dx*dx+dy*dy));
-	dstore[i][1]=dist;
-	if(dist<dmin) dmin=dist;
-	if(dist>dmax) dmax=dist;
-	avgdist += dist;
-	count++;
-      }
-      dx=x[2]-x[0];
-      dy=y[2]-y[0];
-      if((fabs(x[2]-x[0])>xwidth)||(fabs(y[2]-y[0])>ywidth)){
-	/* Skip this line, it's an artifact. */
-	dstore[i][2]=-1;
-      }
-      else{
-	dist=(float)sqrt((double)(dx*dx+dy*dy));
-	dstore[i][2]=dist;
-	if(dist<dmin) dmin=dist;
-	if(dist>dmax) dmax=dist;
-	avgdist += dist;
-	count++;
+      for(j=0;j<3;j++){
+	dx=x[j]-x[(j+1)%3];
+	dy=y[j]-y[(j+1)%3];
+	if((fabs(dx)>xwidth)||(fabs(dy)>ywidth)){
+	  /* Skip this line, it's an artifact. */
+	  dstore[i][j]=-1;
+	}
+	else{
+	  dist=(float)sqrt((double)(dx*dx+dy*dy));
+	  dstore[i][j]=dist;
+	  if(dist<dmin) dmin=dist;
+	  if(dist>dmax) dmax=dist;
+	  avgdist += dist;
+	  count++;
+	}
       }
     }
-    avgdist /= (float)count;
-    for(i=0;i<num_trip;i++){
+    if(count) avgdist /= (float)count;
+    for(i=0;i<t->num_trip;i++){
       x[0] = rx[tripA[i]];
       x[1] = rx[tripB[i]];
       x[2] = rx[tripC[i]];
@@ -3944,8 +5120,8 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
       /* with edge triangles. */
       if((dstore[i][0]>1.5*avgdist)||(dstore[i][1]>1.5*avgdist)
 	 ||(dstore[i][2]>1.5*avgdist)) continue;
-      plot_triangle(x[0],y[0],x[1],y[1],x[2],y[2],sidenum[tripA[i]],
-		    sidenum[tripB[i]],sidenum[tripC[i]],dmin,avgdist*1.5,
+      plot_triangle(x[0],y[0],x[1],y[1],x[2],y[2],t->sidenum[tripA[i]],
+		    t->sidenum[tripB[i]],t->sidenum[tripC[i]],dmin,avgdist*1.5,
 		    dstore,i,max_color);
     }
     break;
@@ -3956,6 +5132,7 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
 /* CIJOL making this a routine (was main()): */
 /* nVin:  Number of particles */
 /* xdatin[], ydatin[]: X,Y positions of particles */
+/* The results are left in t (see struct tessellation):   */
 /* linea[], lineb[], linec[]:  Equations of lines */
 /* numlines: Number of lines */
 /* vertx[], verty[]: Locations of vertices of Voronoi polygons */
@@ -3965,53 +5142,187 @@ void plot_Voronoi(int movie_type,int num_pars,int sidenum[],int voronoi_layer,
 /* num_ep: Number of these line segments */
 /* tripA[], tripB[], tripC[]: The vortex positions forming a triangle around */
 /*                            each of the Voronoi polygon vertex positions. */
-/* num_trip: The number of these triangles, probably equals num_vert? */
-
-void calculate_voronoi(int nVin,float xdatin[],float ydatin[],float linea[],
-		       float lineb[],float linec[],int *numlines,float rx[],
-		       float ry[],int *site_counter,float vertx[],
-		       float verty[],int *num_vert,int cjoleft[],
-		       int cjoright[],int *num_ep,int tripA[],int tripB[],
-		       int tripC[],int *num_trip)
-{
-  void read_program_sites(int *num_part,int nvin,float xdatin[],
-			  float ydatin[]);
-  void voronoi(struct Site *(*nextsite)(),float rx[],float ry[],
-	       int *site_counter,float vertx[],float verty[],int *num_vert,
-	       float linea[],float lineb[],float linec[],int *numlines,
-	       int cjoleft[],int cjoright[],int *num_ep,int tripA[],
-	       int tripB[],int tripC[],int *num_trip);
-  void geominit();
-  struct Site *nextone();
-  struct Site *(*next)();
-  void read_program_sites();
- 
-  /*CIJOL added:*/
-  int num_part;
- 
-  *numlines = 0;
+/* num_trip: The number of these triangles, equals num_vert. */
+/* sidenum[], polystart[], polylist[]: The polygon of each particle. */
+/* t must start zeroed; it is reused for the next call.   */
+void calculate_voronoi(struct tessellation *t,int nVin,float xdatin[],
+		       float ydatin[])
+{
+  tessellation_reserve(t,nVin);
 
-  freeinit(&sfl, sizeof *sites);
+  t->numlines = 0;
+  t->site_counter = 0;
+  t->num_vert = 0;
+  t->num_ep = 0;
+  t->num_trip = 0;
  
   /* CIJOL: Now receiving data directly from calling program.*/
-  read_program_sites(&num_part,nVin,xdatin,ydatin);
-  next = nextone;
+  read_program_sites(t,nVin,xdatin,ydatin);
+  sort_sites(t);
  
   /* We have now read in all of the data on particle positions. */
-  siteidx = 0;
-  geominit();
+  t->siteidx = 0;
+  geominit(t);
  
-  voronoi(next,rx,ry,site_counter,vertx,verty,num_vert,
-          linea,lineb,linec,numlines,cjoleft,cjoright,num_ep,
-          tripA,tripB,tripC,num_trip);
- 
-  return;
+  voronoi(t);
+  make_polygons(t);
+}
+
+/*=================== calculate_periodic_voronoi ==================*/
+/* Same as calculate_voronoi, for particles in a                   */
+/* periodic sx by sy box (0 <= x < sx, 0 <= y < sy).  Images of    */
+/* the particles within margin of an edge are added as extra sites */
+/* (numbered from nVin up; t->nreal is nVin), so the cells at the  */
+/* edges see their true neighbours.  Only the strips along the     */
+/* edges are imaged, not the whole 3x3 tiling.  margin <= 0 picks  */
+/* PERIODIC_MARGIN mean particle spacings. */
+void calculate_periodic_voronoi(struct tessellation *t,int nVin,
+				float xdatin[],float ydatin[],float sx,
+				float sy,float margin)
+{
+  int i,nghost;
+  float x,y,dx,dy;
+  struct Site *s;
+
+  if(margin <= 0)
+    margin = PERIODIC_MARGIN*sqrt((double)(sx*sy/nVin));
+  if(margin > sx/2) margin = sx/2;
+  if(margin > sy/2) margin = sy/2;
+
+  /* Count the images first, so the arrays are big enough. */
+  nghost = 0;
+  for(i=0;i<nVin;i++){
+    dx = (xdatin[i] < margin) || (xdatin[i] >= sx-margin);
+    dy = (ydatin[i] < margin) || (ydatin[i] >= sy-margin);
+    nghost += (dx != 0) + (dy != 0) + (dx != 0 && dy != 0);
+  }
+  tessellation_reserve(t,nVin+nghost);
+
+  t->numlines = 0;
+  t->site_counter = 0;
+  t->num_vert = 0;
+  t->num_ep = 0;
+  t->num_trip = 0;
+
+  read_program_sites(t,nVin,xdatin,ydatin);
+  for(i=0;i<nVin;i++){
+    x = xdatin[i];
+    y = ydatin[i];
+    dx = (x < margin) ? sx : ((x >= sx-margin) ? -sx : 0);
+    dy = (y < margin) ? sy : ((y >= sy-margin) ? -sy : 0);
+    if(dx != 0){
+      s = &t->sites[t->nsites];
+      s->coord.x = x+dx; s->coord.y = y; s->sitenbr = t->nsites++;
+    }
+    if(dy != 0){
+      s = &t->sites[t->nsites];
+      s->coord.x = x; s->coord.y = y+dy; s->sitenbr = t->nsites++;
+    }
+    if((dx != 0) && (dy != 0)){
+      s = &t->sites[t->nsites];
+      s->coord.x = x+dx; s->coord.y = y+dy; s->sitenbr = t->nsites++;
+    }
+  }
+  sort_sites(t);
+
+  t->siteidx = 0;
+  geominit(t);
+
+  voronoi(t);
+  make_polygons(t);
+}
+
+/*====================== tessellation_reserve ====================*/
+/* Makes room in t for a construction of n sites.  The capacity is */
+/* doubled, so a growing movie causes only a few reallocations.    */
+void tessellation_reserve(struct tessellation *t,int n)
+{
+  void *arena_alloc(void *p,size_t n,size_t item_size);
+  int cap,sq;
+
+  if(n <= t->capacity) return;
+  cap = (t->capacity) ? t->capacity : 1024;
+  while(cap < n) cap *= 2;
+  sq = (int) sqrt((double)(cap+4));
+
+  t->sites = arena_alloc(t->sites,cap,sizeof(struct Site));
+  t->sfl_avail = arena_alloc(t->sfl_avail,SITE_ARENA(cap),sizeof(struct Site));
+  t->efl_avail = arena_alloc(t->efl_avail,EDGE_ARENA(cap),sizeof(struct Edge));
+  t->hfl_avail = arena_alloc(t->hfl_avail,HALF_ARENA(cap),
+			     sizeof(struct Halfedge));
+  t->ELhash = arena_alloc(t->ELhash,2*sq,sizeof(struct Halfedge *));
+  t->PQhash = arena_alloc(t->PQhash,4*sq,sizeof(struct Halfedge));
+  t->rx = arena_alloc(t->rx,cap,sizeof(float));
+  t->ry = arena_alloc(t->ry,cap,sizeof(float));
+  t->vertx = arena_alloc(t->vertx,VERT_ARENA(cap),sizeof(float));
+  t->verty = arena_alloc(t->verty,VERT_ARENA(cap),sizeof(float));
+  t->tripA = arena_alloc(t->tripA,VERT_ARENA(cap),sizeof(int));
+  t->tripB = arena_alloc(t->tripB,VERT_ARENA(cap),sizeof(int));
+  t->tripC = arena_alloc(t->tripC,VERT_ARENA(cap),sizeof(int));
+  t->linea = arena_alloc(t->linea,EDGE_ARENA(cap),sizeof(float));
+  t->lineb = arena_alloc(t->lineb,EDGE_ARENA(cap),sizeof(float));
+  t->linec = arena_alloc(t->linec,EDGE_ARENA(cap),sizeof(float));
+  t->cjoleft = arena_alloc(t->cjoleft,EDGE_ARENA(cap),sizeof(int));
+  t->cjoright = arena_alloc(t->cjoright,EDGE_ARENA(cap),sizeof(int));
+  t->sidenum = arena_alloc(t->sidenum,cap,sizeof(int));
+  t->polystart = arena_alloc(t->polystart,cap+1,sizeof(int));
+  t->polylist = arena_alloc(t->polylist,3*VERT_ARENA(cap),sizeof(int));
+  t->capacity = cap;
+}
+
+/*====================== tessellation_free =======================*/
+/* Gives back the memory of t; t can be used again afterwards. */
+void tessellation_free(struct tessellation *t)
+{
+  free(t->sites);
+  free(t->sfl_avail);
+  free(t->efl_avail);
+  free(t->hfl_avail);
+  free(t->ELhash);
+  free(t->PQhash);
+  free(t->rx);
+  free(t->ry);
+  free(t->vertx);
+  free(t->verty);
+  free(t->tripA);
+  free(t->tripB);
+  free(t->tripC);
+  free(t->linea);
+  free(t->lineb);
+  free(t->linec);
+  free(t->cjoleft);
+  free(t->cjoright);
+  free(t->sidenum);
+  free(t->polystart);
+  free(t->polylist);
+  memset(t,0,sizeof(*t));
+}
+
+/*========================= arena_alloc ==========================*/
+void *arena_alloc(void *p,size_t n,size_t item_size)
+{
+  if((p = realloc(p,n*item_size)) == NULL){
+    printf("Out of memory for the Voronoi construction\n");
+    exit(-1);
+  }
+  return p;
+}
+
+/*======================== arena_overflow ========================*/
+/* The arenas are sized from the upper bounds above; this is only */
+/* reached if the sweep goes wrong. */
+void arena_overflow(char *what)
+{
+  printf("Voronoi construction ran out of %s\n",what);
+  exit(-1);
 }
  
 /*=============== scomp ===================*/
 /* sort sites on y, then x, coord */
-int scomp(struct Point *s1,struct Point *s2)
+int scomp(const void *p1,const void *p2)
 {
+  const struct Point *s1 = p1, *s2 = p2;
+
   if(s1 -> y < s2 -> y) return(-1);
   if(s1 -> y > s2 -> y) return(1);
   if(s1 -> x < s2 -> x) return(-1);
@@ -4021,47 +5332,52 @@ int scomp(struct Point *s1,struct Point *s2)
 
 /*============= nextone =============*/
 /* return a single in-storage site */
-struct Site *nextone()
+struct Site *nextone(struct tessellation *t)
 {
   struct Site *s;
-  if(siteidx < nsites){
-    s = &sites[siteidx];
-    siteidx += 1;
+  if(t->siteidx < t->nsites){
+    s = &t->sites[t->siteidx];
+    t->siteidx += 1;
     return(s);
   }
   else
     return( (struct Site *)NULL);
 }
 /*================== read_program_sites ===================*/
-/* read all sites, sort, and compute xmin, xmax, ymin, ymax */
+/* read all sites into t->sites */
 /* Assumes that it has already been passed the needed data.*/
 /* It just funnels this data into the correct structures.*/
-void read_program_sites(int *num_part,int nvin,float xdatin[],float ydatin[])
+void read_program_sites(struct tessellation *t,int nvin,float xdatin[],
+			float ydatin[])
 {
+  struct Site *sites = t->sites;
   int i;
  
-  nsites=0;
-  /* CIJOL altering sites to be a fixed-size array, 8.12.03 */
-  /*sites = (struct Site *) myalloc(4000*sizeof *sites);*/
-  
-  *num_part = nvin;
-  nsites = nvin;
-  for(i=0;i<*num_part;i++){
+  t->nsites = nvin;
+  t->nreal = nvin;
+  for(i=0;i<nvin;i++){
     sites[i].coord.x = xdatin[i];
     sites[i].coord.y = ydatin[i];
     sites[i].sitenbr = i;
-    sites[i].refcnt = 0;
   };
+}
+
+/*======================== sort_sites =====================*/
+/* sort the sites, and compute xmin, xmax, ymin, ymax */
+void sort_sites(struct tessellation *t)
+{
+  struct Site *sites = t->sites;
+  int i;
 
-  qsort(sites, nsites, sizeof *sites, scomp);
-  xmin=sites[0].coord.x;
-  xmax=sites[0].coord.x;
-  for(i=1; i<nsites; i+=1){
-    if(sites[i].coord.x < xmin) xmin = sites[i].coord.x;
-    if(sites[i].coord.x > xmax) xmax = sites[i].coord.x;
+  qsort(sites, t->nsites, sizeof *sites, scomp);
+  t->xmin=sites[0].coord.x;
+  t->xmax=sites[0].coord.x;
+  for(i=1; i<t->nsites; i+=1){
+    if(sites[i].coord.x < t->xmin) t->xmin = sites[i].coord.x;
+    if(sites[i].coord.x > t->xmax) t->xmax = sites[i].coord.x;
   }
-  ymin = sites[0].coord.y;
-  ymax = sites[nsites-1].coord.y;
+  t->ymin = sites[0].coord.y;
+  t->ymax = sites[t->nsites-1].coord.y;
 }
 
 /*======================= voronoi ===============*/
@@ -4070,22 +5386,8 @@ void read_program_sites(int *num_part,int nvin,float xdatin[],float ydatin[])
    Performance suffers if they are wrong; better to make nsites,
    deltax, and deltay too big than too small.  (?) */
  
-void voronoi(struct Site *(*nextsite)(),float rx[],float ry[],
-	     int *site_counter,float vertx[],float verty[],int *num_vert,
-	     float linea[],float lineb[],float linec[],int *numlines,
-	     int cjoleft[],int cjoright[],int *num_ep,int tripA[],
-	     int tripB[],int tripC[],int *num_trip)
-{
-  int out_ep(struct Edge *e,int cjoleft[],int cjoright[],int *num_ep);
-  int out_site(struct Site *s,float rx[],float ry[],int *site_counter);
-  int out_triple(struct Site *s1,struct Site *s2,struct Site *s3,int tripA[],
-		 int tripB[],int tripC[],int *num_trip);
-  int ELinsert(struct Halfedge *lb,struct Halfedge *new);
-  int ELdelete(struct Halfedge *he);
-  int endpoint(struct Edge *e,int lr,struct Site *s,int cjoleft[],
-	       int cjoright[],int *num_ep);
-  int PQinsert(struct Halfedge *he,struct Site *v,float offset);
-
+void voronoi(struct tessellation *t)
+{
   struct Site *newsite, *bot, *top, *temp, *p;
   struct Site *v;
   struct Point newintstar;
@@ -4093,305 +5395,250 @@ void voronoi(struct Site *(*nextsite)(),float rx[],float ry[],
   struct Halfedge *lbnd, *rbnd, *llbnd, *rrbnd, *bisector;
   struct Edge *e;
 
-  /* CIJOL new 8.12.03 */
-  next_free_hfl=0;
-  next_free_efl=0;
-  next_free_sfl=0;
+  /* CIJOL new 8.12.03: reset the arenas */
+  t->next_free_hfl=0;
+  t->next_free_efl=0;
+  t->next_free_sfl=0;
  
-  PQinitialize();
-  bottomsite = (*nextsite)();
+  PQinitialize(t);
+  t->bottomsite = nextone(t);
  
   /* Write out the coordinates of this "bottom" site:*/
-  out_site(bottomsite,rx,ry,site_counter);
+  out_site(t,t->bottomsite);
   
-  ELinitialize();
+  ELinitialize(t);
   
-  newsite = (*nextsite)();
+  newsite = nextone(t);
   while(1)
     {
-      if(!PQempty()) newintstar = PQ_min();
+      if(!PQempty(t)) newintstar = PQ_min(t);
       
       if (newsite != (struct Site *)NULL
-	  && (PQempty()
+	  && (PQempty(t)
               || newsite -> coord.y < newintstar.y
               || (newsite->coord.y == newintstar.y
                   && newsite->coord.x < newintstar.x)))
         {/* new site is smallest */
 	  
           /* Write out the coordinates of this "new" site: */
-          out_site(newsite,rx,ry,site_counter);
+          out_site(t,newsite);
  
-          lbnd = ELleftbnd(&(newsite->coord));
+          lbnd = ELleftbnd(t,&(newsite->coord));
 	  rbnd = ELright(lbnd);
-          bot = rightreg(lbnd);
-          e = bisect(bot, newsite,linea,lineb,linec,numlines);
-          bisector = HEcreate(e, le);
+          bot = rightreg(t,lbnd);
+          e = bisect(t,bot,newsite);
+          bisector = HEcreate(t,e,le);
           ELinsert(lbnd, bisector);
-          if ((p = intersect(lbnd, bisector)) != (struct Site *) NULL)
-            {   PQdelete(lbnd);
-                PQinsert(lbnd, p, dist(p,newsite));
+          if ((p = intersect(t,lbnd,bisector)) != (struct Site *) NULL)
+            {   PQdelete(t,lbnd);
+                PQinsert(t,lbnd,p,dist(p,newsite));
               };
           lbnd = bisector;
-          bisector = HEcreate(e, re);
+          bisector = HEcreate(t,e,re);
           ELinsert(lbnd, bisector);
-          if ((p = intersect(bisector, rbnd)) != (struct Site *) NULL)
-            {   PQinsert(bisector, p, dist(p,newsite));
+          if ((p = intersect(t,bisector,rbnd)) != (struct Site *) NULL)
+            {   PQinsert(t,bisector,p,dist(p,newsite));
               };
-          newsite = (*nextsite)();
+          newsite = nextone(t);
         }
-      else if (!PQempty())      /* intersection is smallest */
+      else if (!PQempty(t))      /* intersection is smallest */
         {
-          lbnd = PQextractmin();
+          lbnd = PQextractmin(t);
 	  llbnd = ELleft(lbnd);
           rbnd = ELright(lbnd);
           rrbnd = ELright(rbnd);
-          bot = leftreg(lbnd);
-          top = rightreg(rbnd);
+          bot = leftreg(t,lbnd);
+          top = rightreg(t,rbnd);
  
           /* Write out this triple of numbers: bot, top, and rightreg.*/
-          out_triple(bot, top, rightreg(lbnd),tripA,tripB,tripC,num_trip);
+          out_triple(t,bot,top,rightreg(t,lbnd));
  
           v = lbnd->vertex;
 
           /* Create a vertex; also write it out.*/
-          makevertex(v,vertx,verty,num_vert);
+          makevertex(t,v);
  
           /* Write out the two endpoints of this segment? */
-          endpoint(lbnd->ELedge,lbnd->ELpm,v,cjoleft,cjoright,num_ep);
-          endpoint(rbnd->ELedge,rbnd->ELpm,v,cjoleft,cjoright,num_ep);
+          endpoint(t,lbnd->ELedge,lbnd->ELpm,v);
+          endpoint(t,rbnd->ELedge,rbnd->ELpm,v);
  
           ELdelete(lbnd);
-          PQdelete(rbnd);
+          PQdelete(t,rbnd);
           ELdelete(rbnd);
           pm = le;
           if (bot->coord.y > top->coord.y)
             {   temp = bot; bot = top; top = temp; pm = re;}
  
           /* This will write out bisector location */
-          e = bisect(bot, top,linea,lineb,linec,numlines);
+          e = bisect(t,bot,top);
  
-          bisector = HEcreate(e, pm);
+          bisector = HEcreate(t,e,pm);
           ELinsert(llbnd, bisector);
  
           /*This will write out endpoints*/
-          endpoint(e, re-pm, v,cjoleft,cjoright,num_ep);
+          endpoint(t,e,re-pm,v);
  
-          deref(v);
-          if((p = intersect(llbnd, bisector)) != (struct Site *) NULL)
-            {   PQdelete(llbnd);
-                PQinsert(llbnd, p, dist(p,bot));
+          if((p = intersect(t,llbnd,bisector)) != (struct Site *) NULL)
+            {   PQdelete(t,llbnd);
+                PQinsert(t,llbnd,p,dist(p,bot));
               };
-          if ((p = intersect(bisector, rrbnd)) != (struct Site *) NULL)
-            {   PQinsert(bisector, p, dist(p,bot));
+          if ((p = intersect(t,bisector,rrbnd)) != (struct Site *) NULL)
+            {   PQinsert(t,bisector,p,dist(p,bot));
               };
         }
       else break;
     };
  
-  for(lbnd=ELright(ELleftend); lbnd != ELrightend; lbnd=ELright(lbnd))
+  for(lbnd=ELright(t->ELleftend); lbnd != t->ELrightend; lbnd=ELright(lbnd))
     {   e = lbnd -> ELedge;
         /* Write out endpoints */
-        out_ep(e,cjoleft,cjoright,num_ep);
+        out_ep(t,e);
       };
 }
+
+/*====================== make_polygons ===================*/
+/* Counts the sides of each site and lists the */
+/* vertices of its polygon, replacing the fixed polylist[][20] */
+/* that plot_Voronoi used to fill. */
+void make_polygons(struct tessellation *t)
+{
+  int *sidenum = t->sidenum, *polystart = t->polystart;
+  int i,index,k;
+
+  /* Each triangle i surrounds vertex i and adds one side to each */
+  /* of its three sites. */
+  for(i=0;i<t->nsites;i++)
+    sidenum[i] = 0;
+  for(i=0;i<t->num_trip;i++){
+    sidenum[t->tripA[i]]++;
+    sidenum[t->tripB[i]]++;
+    sidenum[t->tripC[i]]++;
+  }
+
+  polystart[0] = 0;
+  for(i=0;i<t->nsites;i++)
+    polystart[i+1] = polystart[i] + sidenum[i];
+
+  /* Fill in, using polystart[i] as the fill position of site i.  */
+  /* Afterwards it points at the start of site i+1: shift it back. */
+  for(i=0;i<t->num_trip;i++){
+    for(k=0;k<3;k++){
+      index = (k==0) ? t->tripA[i] : ((k==1) ? t->tripB[i] : t->tripC[i]);
+      t->polylist[polystart[index]++] = i;
+    }
+  }
+  for(i=t->nsites;i>0;i--)
+    polystart[i] = polystart[i-1];
+  polystart[0] = 0;
+}
+
 /*================= out_bisector ==========*/
 /* CIJOL Adding a pass of the lines data back to calling program.*/
-out_bisector(struct Edge *e,float linea[],float lineb[],float linec[],
-	     int *numlines)
+void out_bisector(struct tessellation *t,struct Edge *e)
 {
   int num;
  
-  num = *numlines;
+  num = t->numlines;
  
   /*fprintf(out,"l %f %f %f", e->a, e->b, e->c);*/
   /*Put this data into structure.*/
-  linea[num] = e->a;
-  lineb[num] = e->b;
-  linec[num] = e->c;
+  t->linea[num] = e->a;
+  t->lineb[num] = e->b;
+  t->linec[num] = e->c;
   num++;
-  if(num>10000){
-    printf("Not enough room for lines\n");
-    exit(-1);
-  }
-  *numlines = num;
- 
+  t->numlines = num;
 }
  
 /*================ out_ep =============*/
 /* Writes out an end point.*/
 /* Each edge is numbered, and the other two numbers give the */
 /* vertices at either end of this edge.*/
-out_ep(struct Edge *e,int cjoleft[],int cjoright[],int *num_ep)
+void out_ep(struct tessellation *t,struct Edge *e)
 {
-  int clip_line(struct Edge *e);
-  int tmp;
- 
-  clip_line(e);
- 
   /*fprintf(out,"e %d", e->edgenbr);
   fprintf(out," %d ", e->ep[le] != (struct Site *)NULL ? e->ep[le]->sitenbr : -1);
   fprintf(out,"%d\n", e->ep[re] != (struct Site *)NULL ? e->ep[re]->sitenbr : -1);*/
  
-  tmp = *num_ep;
-  cjoleft[e->edgenbr]=
+  t->cjoleft[e->edgenbr]=
    (e->ep[le] != (struct Site *)NULL ? e->ep[le]->sitenbr : -1);
-  cjoright[e->edgenbr]=
+  t->cjoright[e->edgenbr]=
     (e->ep[re] != (struct Site *)NULL ? e->ep[re]->sitenbr : -1);
-  tmp++;
-  *num_ep = tmp;
+  t->num_ep++;
 }
  
 /*======================== out_vertex ===================*/
 /*This routine outputs the x and y coordinates of a vertex*/
 /* Passes back to program vertices indexed by vertex number.*/
-out_vertex(struct Site *v,float vertx[],float verty[],int *num_vert)
+void out_vertex(struct tessellation *t,struct Site *v)
 {
-  int tmp;
   /*fprintf (out,"v %f %f\n", v->coord.x, v->coord.y);*/
-  vertx[v->sitenbr] = v->coord.x;
-  verty[v->sitenbr] = v->coord.y;
-  tmp = *num_vert;
-  tmp++;
-  *num_vert = tmp;
- 
+  t->vertx[v->sitenbr] = v->coord.x;
+  t->verty[v->sitenbr] = v->coord.y;
+  t->num_vert++;
 }
  
 /*======================= out_site ==============================*/
 /*This routine outputs the x and y coordinates of an input particle*/
 /* CIJOL changing a bit... should now pass back coords. indexed*/
 /* by site number.*/
-out_site(struct Site *s,float rx[],float ry[],int *site_counter)
+void out_site(struct tessellation *t,struct Site *s)
 {
-  int tmp;
- 
  /*fprintf(out,"s %f %f\n", s->coord.x, s->coord.y);*/
-  rx[s->sitenbr] = s->coord.x;
-  ry[s->sitenbr] = s->coord.y;
-  tmp = *site_counter;
-  tmp++;
-  *site_counter = tmp;
- 
+  t->rx[s->sitenbr] = s->coord.x;
+  t->ry[s->sitenbr] = s->coord.y;
+  t->site_counter++;
 }
  
 /*============== out_triple ===========*/
 /* For delaunay triangulation */
-out_triple(struct Site *s1,struct Site *s2,struct Site *s3,int tripA[],
-	   int tripB[],int tripC[],int *num_trip)
+void out_triple(struct tessellation *t,struct Site *s1,struct Site *s2,
+		struct Site *s3)
 {
   int tmp;
   /*fprintf(out,"%d %d %d\n", s1->sitenbr, s2->sitenbr, s3->sitenbr);*/
-  tmp = *num_trip;
-  tripA[tmp] = s1->sitenbr;
-  tripB[tmp] = s2->sitenbr;
-  tripC[tmp] = s3->sitenbr;
-  tmp++;
-  *num_trip = tmp;
- 
-}
- 
-/*============== clip_line =============*/
-int clip_line(struct Edge *e)
-{
-  struct Site *s1, *s2;
-  float x1,x2,y1,y2;
- 
-  if(e -> a == 1.0 && e ->b >= 0.0){
-    s1 = e -> ep[1];
-    s2 = e -> ep[0];
-  }
-  else{
-    s1 = e -> ep[0];
-    s2 = e -> ep[1];
-  };
- 
-  if(e -> a == 1.0){
-    y1 = pymin;
-    if (s1!=(struct Site *)NULL && s1->coord.y > pymin)
-      y1 = s1->coord.y;
-    if(y1>pymax) return(0);
-    x1 = e -> c - e -> b * y1;
-    y2 = pymax;
-    if (s2!=(struct Site *)NULL && s2->coord.y < pymax)
-      y2 = s2->coord.y;
-    if(y2<pymin) return(0);
-    x2 = e -> c - e -> b * y2;
-    if ((x1> pxmax & x2>pxmax) | (x1<pxmin&x2<pxmin)) return(0);
-    if(x1> pxmax){
-      x1 = pxmax; y1 = (e -> c - x1)/e -> b;};
-    if(x1<pxmin){
-      x1 = pxmin; y1 = (e -> c - x1)/e -> b;};
-    if(x2>pxmax){
-      x2 = pxmax; y2 = (e -> c - x2)/e -> b;};
-    if(x2<pxmin){
-      x2 = pxmin; y2 = (e -> c - x2)/e -> b;};
-  }
-  else{
-    x1 = pxmin;
-    if (s1!=(struct Site *)NULL && s1->coord.x > pxmin)
-      x1 = s1->coord.x;
-    if(x1>pxmax) return(0);
-    y1 = e -> c - e -> a * x1;
-    x2 = pxmax;
-    if (s2!=(struct Site *)NULL && s2->coord.x < pxmax)
-      x2 = s2->coord.x;
-    if(x2<pxmin) return(0);
-    y2 = e -> c - e -> a * x2;
-    if ((y1> pymax & y2>pymax) | (y1<pymin&y2<pymin)) return(0);
-    if(y1> pymax){
-      y1 = pymax; x1 = (e -> c - y1)/e -> a;
-    };
-    if(y1<pymin){
-      y1 = pymin; x1 = (e -> c - y1)/e -> a;
-    };
-    if(y2>pymax){
-      y2 = pymax; x2 = (e -> c - y2)/e -> a;
-    };
-    if(y2<pymin){
-      y2 = pymin; x2 = (e -> c - y2)/e -> a;
-    };
-  };
- 
+  tmp = t->num_trip;
+  t->tripA[tmp] = s1->sitenbr;
+  t->tripB[tmp] = s2->sitenbr;
+  t->tripC[tmp] = s3->sitenbr;
+  t->num_trip = tmp + 1;
 }
  
 /*============== ELinitialize ================*/
-ELinitialize()
+void ELinitialize(struct tessellation *t)
 {
   int i;
  
-  freeinit(&hfl, sizeof **ELhash);
-  ELhashsize = 2 * sqrt_nsites;
-  /* CIJOL Using a fixed size array 8.12.03 */
-  /*ELhash = (struct Halfedge **) myalloc ( sizeof *ELhash * ELhashsize);*/
-  for(i=0; i<ELhashsize; i +=1) ELhash[i] = (struct Halfedge *)NULL;
-  ELleftend = HEcreate( (struct Edge *)NULL, 0);
-  ELrightend = HEcreate( (struct Edge *)NULL, 0);
-  ELleftend -> ELleft = (struct Halfedge *)NULL;
-  ELleftend -> ELright = ELrightend;
-  ELrightend -> ELleft = ELleftend;
-  ELrightend -> ELright = (struct Halfedge *)NULL;
-  ELhash[0] = ELleftend;
-  ELhash[ELhashsize-1] = ELrightend;
+  t->ELhashsize = 2 * t->sqrt_nsites;
+  for(i=0; i<t->ELhashsize; i +=1) t->ELhash[i] = (struct Halfedge *)NULL;
+  t->ELleftend = HEcreate(t, (struct Edge *)NULL, 0);
+  t->ELrightend = HEcreate(t, (struct Edge *)NULL, 0);
+  t->ELleftend -> ELleft = (struct Halfedge *)NULL;
+  t->ELleftend -> ELright = t->ELrightend;
+  t->ELrightend -> ELleft = t->ELleftend;
+  t->ELrightend -> ELright = (struct Halfedge *)NULL;
+  t->ELhash[0] = t->ELleftend;
+  t->ELhash[t->ELhashsize-1] = t->ELrightend;
 }
  
 /*============ HEcreate ==============*/
-struct Halfedge *HEcreate(struct Edge *e,int pm)
+struct Halfedge *HEcreate(struct tessellation *t,struct Edge *e,int pm)
 {
   struct Halfedge *answer;
+
   /* CIJOL Use precreated array 8.12.03 */
-  /*answer = (struct Halfedge *) getfree(&hfl);*/
-  answer=&(hfl_avail[next_free_hfl]);
-  next_free_hfl++;
+  if(t->next_free_hfl >= HALF_ARENA(t->capacity)) arena_overflow("halfedges");
+  answer=&(t->hfl_avail[t->next_free_hfl]);
+  t->next_free_hfl++;
 
   answer -> ELedge = e;
   answer -> ELpm = pm;
   answer -> PQnext = (struct Halfedge *) NULL;
   answer -> vertex = (struct Site *) NULL;
-  answer -> ELrefcnt = 0;
   return(answer);
 }
  
 /*========== ELinsert ==============*/
-ELinsert(struct Halfedge *lb,struct Halfedge *new)
+void ELinsert(struct Halfedge *lb,struct Halfedge *new)
 {
   new -> ELleft = lb;
   new -> ELright = lb -> ELright;
@@ -4401,64 +5648,59 @@ ELinsert(struct Halfedge *lb,struct Halfedge *new)
  
 /*============ ELgethash ===============*/
 /* Get entry from hash table, pruning any deleted nodes */
-struct Halfedge *ELgethash(int b)
+struct Halfedge *ELgethash(struct tessellation *t,int b)
 {
   struct Halfedge *he;
  
-  if(b<0 || b>=ELhashsize) return((struct Halfedge *) NULL);
-  he = ELhash[b];
+  if(b<0 || b>=t->ELhashsize) return((struct Halfedge *) NULL);
+  he = t->ELhash[b];
   if (he == (struct Halfedge *) NULL ||
       he -> ELedge != (struct Edge *) DELETED ) return (he);
  
   /* Hash table points to deleted half edge.  Patch as necessary. */
-  ELhash[b] = (struct Halfedge *) NULL;
-  if ((he -> ELrefcnt -= 1) == 0) makefree(he, &hfl);
+  t->ELhash[b] = (struct Halfedge *) NULL;
   return ((struct Halfedge *) NULL);
 }
  
 /*============== ELleftbnd =================*/
-struct Halfedge *ELleftbnd(struct Point *p)
+struct Halfedge *ELleftbnd(struct tessellation *t,struct Point *p)
 {
   int i, bucket;
   struct Halfedge *he;
  
   /* Use hash table to get close to desired halfedge */
-  bucket = (p->x - xmin)/deltax * ELhashsize;
+  bucket = (p->x - t->xmin)/t->deltax * t->ELhashsize;
   if(bucket<0) bucket =0;
-  if(bucket>=ELhashsize) bucket = ELhashsize - 1;
-  he = ELgethash(bucket);
+  if(bucket>=t->ELhashsize) bucket = t->ELhashsize - 1;
+  he = ELgethash(t,bucket);
   if(he == (struct Halfedge *) NULL){
     for(i=1; 1 ; i += 1){
-      if ((he=ELgethash(bucket-i)) != (struct Halfedge *) NULL) break;
-      if ((he=ELgethash(bucket+i)) != (struct Halfedge *) NULL) break;
+      if ((he=ELgethash(t,bucket-i)) != (struct Halfedge *) NULL) break;
+      if ((he=ELgethash(t,bucket+i)) != (struct Halfedge *) NULL) break;
     };
   };
   /* Now search linear list of halfedges for the corect one */
-  if (he==ELleftend  || (he != ELrightend && right_of(he,p))){
+  if (he==t->ELleftend  || (he != t->ELrightend && right_of(he,p))){
     do{
       he = he -> ELright;
-    } while (he!=ELrightend && right_of(he,p));
+    } while (he!=t->ELrightend && right_of(he,p));
     he = he -> ELleft;
   }
   else
     do {
       he = he -> ELleft;
-    } while (he!=ELleftend && !right_of(he,p));
+    } while (he!=t->ELleftend && !right_of(he,p));
  
-  /* Update hash table and reference counts */
-  if(bucket > 0 && bucket <ELhashsize-1){
-    if(ELhash[bucket] != (struct Halfedge *) NULL)
-      ELhash[bucket] -> ELrefcnt -= 1;
-    ELhash[bucket] = he;
-    ELhash[bucket] -> ELrefcnt += 1;
-  };
+  /* Update hash table */
+  if(bucket > 0 && bucket <t->ELhashsize-1)
+    t->ELhash[bucket] = he;
   return (he);
 }
  
 /*=============== ELdelete =================*/
 /* This delete routine can't reclaim node, since pointers from hash
    table may be present.   */
-ELdelete(struct Halfedge *he)
+void ELdelete(struct Halfedge *he)
 {
   (he -> ELleft) -> ELright = he -> ELright;
   (he -> ELright) -> ELleft = he -> ELleft;
@@ -4478,52 +5720,47 @@ struct Halfedge *ELleft(struct Halfedge *he)
 }
  
 /*=============== leftreg ===============*/
-struct Site *leftreg(struct Halfedge *he)
+struct Site *leftreg(struct tessellation *t,struct Halfedge *he)
 {
-  if(he -> ELedge == (struct Edge *)NULL) return(bottomsite);
+  if(he -> ELedge == (struct Edge *)NULL) return(t->bottomsite);
   return( he -> ELpm == le ?
          he -> ELedge -> reg[le] : he -> ELedge -> reg[re]);
 }
  
 /*=============== rightreg ===================*/
-struct Site *rightreg(struct Halfedge *he)
+struct Site *rightreg(struct tessellation *t,struct Halfedge *he)
 {
-  if(he -> ELedge == (struct Edge *)NULL) return(bottomsite);
+  if(he -> ELedge == (struct Edge *)NULL) return(t->bottomsite);
   return( he -> ELpm == le ?
          he -> ELedge -> reg[re] : he -> ELedge -> reg[le]);
 }
 
 /*===================== geominit ================*/
-void geominit()
+void geominit(struct tessellation *t)
 {
-  struct Edge e;
   float sn;
  
-  freeinit(&efl, sizeof e);
-  nvertices = 0;
-  nedges = 0;
-  sn = nsites+4;
-  sqrt_nsites = sqrt(sn);
-  deltay = ymax - ymin;
-  deltax = xmax - xmin;
+  t->nvertices = 0;
+  t->nedges = 0;
+  sn = t->nsites+4;
+  t->sqrt_nsites = sqrt(sn);
+  t->deltay = t->ymax - t->ymin;
+  t->deltax = t->xmax - t->xmin;
 }
  
 /*===================== bisect ==================*/
-struct Edge *bisect(struct Site *s1,struct Site *s2,float linea[],
-		    float lineb[],float linec[],int *numlines)
+struct Edge *bisect(struct tessellation *t,struct Site *s1,struct Site *s2)
 {
-  float dx,dy,adx,ady;
+  double dx,dy,adx,ady;
   struct Edge *newedge;
  
   /* CIJOL Use precreated array 8.12.03 */
-  /*newedge = (struct Edge *) getfree(&efl);*/
-  newedge = &(efl_avail[next_free_efl]);
-  next_free_efl++;
+  if(t->next_free_efl >= EDGE_ARENA(t->capacity)) arena_overflow("edges");
+  newedge = &(t->efl_avail[t->next_free_efl]);
+  t->next_free_efl++;
  
   newedge -> reg[0] = s1;
   newedge -> reg[1] = s2;
-  ref(s1);
-  ref(s2);
   newedge -> ep[0] = (struct Site *) NULL;
   newedge -> ep[1] = (struct Site *) NULL;
  
@@ -4539,21 +5776,22 @@ struct Edge *bisect(struct Site *s1,struct Site *s2,float linea[],
     newedge -> b = 1.0; newedge -> a = dx/dy; newedge -> c /= dy;
   }
  
-  newedge -> edgenbr = nedges;
+  newedge -> edgenbr = t->nedges;
  
   /* Write out location of the bisecting line, part of Voronoi construct.*/
-  out_bisector(newedge,linea,lineb,linec,numlines);
+  out_bisector(t,newedge);
  
-  nedges += 1;
+  t->nedges += 1;
   return(newedge);
 }
  
 /*======================== intersect ==============*/
-struct Site *intersect(struct Halfedge *el1,struct Halfedge *el2)
+struct Site *intersect(struct tessellation *t,struct Halfedge *el1,
+		       struct Halfedge *el2)
 {
   struct        Edge *e1,*e2, *e;
   struct  Halfedge *el;
-  float d, xint, yint;
+  double d, xint, yint;
   int right_of_site;
   struct Site *v;
  
@@ -4582,11 +5820,10 @@ struct Site *intersect(struct Halfedge *el1,struct Halfedge *el2)
       (!right_of_site && el -> ELpm == re)) return ((struct Site *) NULL);
  
   /* CIJOL Use preconstructed array 8.12.03 */
-  /*v = (struct Site *) getfree(&sfl);*/
-  v = &(sfl_avail[next_free_sfl]);
-  next_free_sfl++;
+  if(t->next_free_sfl >= SITE_ARENA(t->capacity)) arena_overflow("vertices");
+  v = &(t->sfl_avail[t->next_free_sfl]);
+  t->next_free_sfl++;
 
-  v -> refcnt = 0;
   v -> coord.x = xint;
   v -> coord.y = yint;
   return(v);
@@ -4599,7 +5836,7 @@ int right_of(struct Halfedge *el,struct Point *p)
   struct Edge *e;
   struct Site *topsite;
   int right_of_site, above, fast;
-  float dxp, dyp, dxs, t1, t2, t3, yl;
+  double dxp, dyp, dxs, t1, t2, t3, yl;
  
   e = el -> ELedge;
   topsite = e -> reg[1];
@@ -4638,57 +5875,39 @@ int right_of(struct Halfedge *el,struct Point *p)
 }
  
 /*=================== endpoint ==================*/
-endpoint(struct Edge *e,int lr,struct Site *s,int cjoleft[],int cjoright[],
-	 int *num_ep)
+void endpoint(struct tessellation *t,struct Edge *e,int lr,struct Site *s)
 {
   e -> ep[lr] = s;
-  ref(s);
-  if(e -> ep[re-lr]== (struct Site *) NULL) return(0);
-  out_ep(e,cjoleft,cjoright,num_ep);
-  deref(e->reg[le]);
-  deref(e->reg[re]);
-  makefree(e, &efl);
+  if(e -> ep[re-lr]== (struct Site *) NULL) return;
+  out_ep(t,e);
 }
  
 /*==================== dist =======================*/
-float dist(struct Site *s,struct Site *t)
+double dist(struct Site *s,struct Site *t)
 {
-  float dx,dy;
+  double dx,dy;
   dx = s->coord.x - t->coord.x;
   dy = s->coord.y - t->coord.y;
   return(sqrt(dx*dx + dy*dy));
 }
  
 /*===================== makevertex ===================*/
-int makevertex(struct Site *v,float vertx[],float verty[],int *num_vert)
-{
-  v -> sitenbr = nvertices;
-  nvertices += 1;
-  out_vertex(v,vertx,verty,num_vert);
-}
- 
-/*================== deref ===============*/
-deref(struct Site *v)
-{
-  v -> refcnt -= 1;
-  if (v -> refcnt == 0 ) makefree(v, &sfl);
-}
- 
-/*=================== ref ==============*/
-ref(struct Site *v)
+void makevertex(struct tessellation *t,struct Site *v)
 {
-  v -> refcnt += 1;
+  v -> sitenbr = t->nvertices;
+  t->nvertices += 1;
+  out_vertex(t,v);
 }
  
 /*================ PQinsert ===============*/
-PQinsert(struct Halfedge *he,struct Site *v,float offset)
+void PQinsert(struct tessellation *t,struct Halfedge *he,struct Site *v,
+	      double offset)
 {
   struct Halfedge *last, *next;
  
   he -> vertex = v;
-  ref(v);
   he -> ystar = v -> coord.y + offset;
-  last = &PQhash[PQbucket(he)];
+  last = &t->PQhash[PQbucket(t,he)];
   while ((next = last -> PQnext) != (struct Halfedge *) NULL &&
          (he -> ystar   > next -> ystar  ||
           (he -> ystar == next -> ystar && v -> coord.x > next->vertex->coord.x))){
@@ -4696,91 +5915,75 @@ PQinsert(struct Halfedge *he,struct Site *v,float offset)
   }
   he -> PQnext = last -> PQnext;
   last -> PQnext = he;
-  PQcount += 1;
+  t->PQcount += 1;
 }
  
 /*============== PQdelete ===========*/
-PQdelete(struct Halfedge *he)
+void PQdelete(struct tessellation *t,struct Halfedge *he)
 {
   struct Halfedge *last;
  
   if(he ->  vertex != (struct Site *) NULL){
-    last = &PQhash[PQbucket(he)];
+    last = &t->PQhash[PQbucket(t,he)];
     while (last -> PQnext != he) last = last -> PQnext;
     last -> PQnext = he -> PQnext;
-    PQcount -= 1;
-    deref(he -> vertex);
+    t->PQcount -= 1;
     he -> vertex = (struct Site *) NULL;
   };
 }
  
 /*=============== PQbucket =============*/
-int PQbucket(struct Halfedge *he)
+int PQbucket(struct tessellation *t,struct Halfedge *he)
 {
   int bucket;
  
-  bucket = (he->ystar - ymin)/deltay * PQhashsize;
+  bucket = (he->ystar - t->ymin)/t->deltay * t->PQhashsize;
   if (bucket<0) bucket = 0;
-  if (bucket>=PQhashsize) bucket = PQhashsize-1 ;
-  if (bucket < PQmin) PQmin = bucket;
+  if (bucket>=t->PQhashsize) bucket = t->PQhashsize-1 ;
+  if (bucket < t->PQmin) t->PQmin = bucket;
   return(bucket);
 }
  
  
 /*============== PQempty ==============*/
-int PQempty()
+int PQempty(struct tessellation *t)
 {
-  return(PQcount==0);
+  return(t->PQcount==0);
 }
  
 /*============== PQ_min ===============*/
-struct Point PQ_min()
+struct Point PQ_min(struct tessellation *t)
 {
   struct Point answer;
  
-  while(PQhash[PQmin].PQnext == (struct Halfedge *)NULL) {PQmin += 1;};
-  answer.x = PQhash[PQmin].PQnext -> vertex -> coord.x;
-  answer.y = PQhash[PQmin].PQnext -> ystar;
+  while(t->PQhash[t->PQmin].PQnext == (struct Halfedge *)NULL) {t->PQmin += 1;};
+  answer.x = t->PQhash[t->PQmin].PQnext -> vertex -> coord.x;
+  answer.y = t->PQhash[t->PQmin].PQnext -> ystar;
   return (answer);
 }
  
 /*================ PQextractmin ============*/
-struct Halfedge *PQextractmin()
+struct Halfedge *PQextractmin(struct tessellation *t)
 {
   struct Halfedge *curr;
  
-  curr = PQhash[PQmin].PQnext;
-  PQhash[PQmin].PQnext = curr -> PQnext;
-  PQcount -= 1;
+  curr = t->PQhash[t->PQmin].PQnext;
+  t->PQhash[t->PQmin].PQnext = curr -> PQnext;
+  t->PQcount -= 1;
   return(curr);
 }
 
 /*===================== PQinitialize ===========*/
-PQinitialize()
+void PQinitialize(struct tessellation *t)
 {
   int i;
  
-  PQcount = 0;
-  PQmin = 0;
-  PQhashsize = 4 * sqrt_nsites;
-  /* CIJOL using fixed array 8.12.03 */
-  /*PQhash = (struct Halfedge *) myalloc(PQhashsize * sizeof *PQhash);*/
-  for(i=0; i<PQhashsize; i+=1) PQhash[i].PQnext = (struct Halfedge *)NULL;
+  t->PQcount = 0;
+  t->PQmin = 0;
+  t->PQhashsize = 4 * t->sqrt_nsites;
+  for(i=0; i<t->PQhashsize; i+=1) t->PQhash[i].PQnext = (struct Halfedge *)NULL;
 }
  
-/*================ freeinit ===========*/
-freeinit(struct Freelist *fl,int size)
-{
-  fl -> head = (struct Freenode *) NULL;
-  fl -> nodesize = size;
-}
- 
-/*=========== makefree ============*/
-makefree(struct Freenode *curr,struct Freelist *fl)
-{
-  curr -> nextfree = fl -> head;
-  fl -> head = curr;
-}
 /*========================= plot_poly_line ==================*/
 /* This function draws lines for Voronoi construction on screen. */
 /* Called by: plot_voronoi$.*/
@@ -4808,36 +6011,25 @@ void plot_poly_line(float x1,float y1,float x2,float y2)
   XDrawLine(display,pixmap,pixmap_gc,(par_x1),(par_y1),(par_x2),(par_y2));
 }
 
-/*====================== plot_polygon ==========================*/
-/* Plots Voronoi polygons as solid 2D objects, rather than with the older */
-/* line-by-line disconnected method. */
-void plot_polygon(int index,int sidenum,int polylist[][20],float vertx[],
-		  float verty[],float xcenter,float ycenter)
+/*====================== order_polygon =========================*/
+/* To plot the polygons properly, the vertices need to be in */
+/* counterclockwise order.  Sorts xlist[],ylist[] (n vertices) by */
+/* the angle around xcenter,ycenter; angle[] is scratch space.   */
+/* Called by: plot_polygon$, render_voronoi$. */
+void order_polygon(int n,float xlist[],float ylist[],float angle[],
+		   float xcenter,float ycenter)
 {
   float radial(float xin,float yin,float xcenter,float ycenter);
-
   int i,j;
-  float x1,y1,a,b,c;
-  /* CIJOL: type XPoint consists of pairs of shorts, x y. */
-  float xlist[20],ylist[20];
-  XPoint points[20];
-  float angle[20];
-
-  /* Generate list of vertices */
-  for(i=0;i<sidenum;i++){
-    xlist[i] = vertx[polylist[index][i]];
-    ylist[i] = verty[polylist[index][i]];
-  }
+  float a,b,c;
 
-  /* To plot the polygons properly, the vertices need to be in */
-  /* counterclockwise order.  Convert x and y coordinates of each vertex */
-  /* to a positive angle. */
-  for(i=0;i<sidenum;i++){
+  /* Convert x and y coordinates of each vertex to a positive angle. */
+  for(i=0;i<n;i++){
     angle[i] = radial(xlist[i],ylist[i],xcenter,ycenter);
   }
   /* Sort angles into ascending order using standard algorithm for */
   /* small N from Numerical Recipes */
-  for(j=1;j<sidenum;j++){
+  for(j=1;j<n;j++){
     a = angle[j];
     b = xlist[j];
     c = ylist[j];
@@ -4852,6 +6044,37 @@ void plot_polygon(int index,int sidenum,int polylist[][20],float vertx[],
     xlist[i+1]=b;
     ylist[i+1]=c;
   }
+}
+
+/*====================== plot_polygon ==========================*/
+/* Plots Voronoi polygons as solid 2D objects, rather than with the older */
+/* line-by-line disconnected method. */
+/* polylist[0..sidenum-1] are the numbers of the vertices. */
+void plot_polygon(int sidenum,int polylist[],float vertx[],
+		  float verty[],float xcenter,float ycenter)
+{
+  void order_polygon(int n,float xlist[],float ylist[],float angle[],
+		     float xcenter,float ycenter);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+
+  int i;
+  /* CIJOL: type XPoint consists of pairs of shorts, x y. */
+  static float *xlist = NULL,*ylist = NULL,*angle = NULL;
+  static XPoint *points = NULL;
+  static int xlist_size = 0,ylist_size = 0,angle_size = 0,points_size = 0;
+
+  if(sidenum < 3) return;
+  xlist = (float *) grow_buffer(xlist,&xlist_size,sidenum,sizeof(float));
+  ylist = (float *) grow_buffer(ylist,&ylist_size,sidenum,sizeof(float));
+  angle = (float *) grow_buffer(angle,&angle_size,sidenum,sizeof(float));
+  points = (XPoint *) grow_buffer(points,&points_size,sidenum,sizeof(XPoint));
+
+  /* Generate list of vertices */
+  for(i=0;i<sidenum;i++){
+    xlist[i] = vertx[polylist[i]];
+    ylist[i] = verty[polylist[i]];
+  }
+  order_polygon(sidenum,xlist,ylist,angle,xcenter,ycenter);
 
   /* Convert x,y location into plotting coordinates */
   for(i=0;i<sidenum;i++){
@@ -4928,6 +6151,9 @@ void plot_triangle(float x1,float y1,float x2,float y2,float x3,float y3,
   int color[3];
   float diffd=dmax-dmin;
 
+  /* A perfect lattice has all lines equally long */
+  if(diffd <= 0) diffd = 1.0;
+
   /* New: Determine the color of each of the three lines based on */
   /* their relative lengths compared to dmin,dmax. */
   /* Depending on the colormap you're using you may want a reversed value. */
@@ -5022,3 +6248,872 @@ void plot_vertex(float x,float y,int sideA,int sideB,int sideC)
   }*/
 }
 
+/*===================== Batch analysis routines ===================*/
+/* plot -batch <gfile> runs the commands of gfile without an X     */
+/* display.  "plot <file>" then does not draw the movie but calls  */
+/* batch_analyze, which writes one line of numbers per frame.      */
+
+/*======================== batch_frame_data =======================*/
+/* Collects frame f (counting from 0) of all nodes: the positions  */
+/* used for the Voronoi construction in x[],y[] (*n of them), and  */
+/* the particle count and species counts in r.  The frame is read */
+/* where it is in the mapped file, so any thread may call this     */
+/* (packed frames are decoded with the thread's own u[]).          */
+void batch_frame_data(struct batch_job *job,int f,int *n,float **x,float **y,
+		      int *x_size,int *y_size,struct batch_frame *r,
+		      struct unpacker *u)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  char *frame_data(int j,int f,int movie_type,int *num_pars,int *num_layers,
+		   struct unpacker *u);
+  int j,i,ll,num_pars,num_layers,species;
+  char *p;
+  struct smdata *sm;
+  struct kmdata *km;
+  struct cmdata *cm;
+  struct tmdata *tm;
+
+  *n = 0;
+  for(j=0;j<job->num_nodes;j++){
+    p = frame_data(j,f,job->movie_type,&num_pars,&num_layers,u);
+    if(j == 0) r->md_time = merged.md_time[f];
+    *x = (float *) grow_buffer(*x,x_size,*n+num_pars,sizeof(float));
+    *y = (float *) grow_buffer(*y,y_size,*n+num_pars,sizeof(float));
+
+    for(ll=0;ll<num_layers;ll++){
+      for(i=0;i<num_pars;i++){
+	switch(job->movie_type){
+	case SMOVIE:
+	  sm = (struct smdata *) p + i;
+	  (*x)[*n] = sm->x; (*y)[*n] = sm->y; (*n)++;
+	  species = 0;
+	  break;
+	case KMOVIE:
+	  km = (struct kmdata *) p + i;
+	  (*x)[*n] = km->x; (*y)[*n] = km->y; (*n)++;
+	  species = 0;
+	  break;
+	case CMOVIE:
+	  cm = (struct cmdata *) p + i;
+	  (*x)[*n] = cm->x; (*y)[*n] = cm->y; (*n)++;
+	  species = cm->color;
+	  break;
+	default:
+	  tm = (struct tmdata *) p + i;
+	  /* Like plot_Voronoi, only the voronoi_layer is tessellated */
+	  if(ll + num_layers*j == job->layer){
+	    (*x)[*n] = tm->x; (*y)[*n] = tm->y; (*n)++;
+	  }
+	  species = tm->layr;
+	  break;
+	}
+	if(species < 0) species = 0;
+	if(species >= BATCH_SPECIES) species = BATCH_SPECIES-1;
+	r->species[species]++;
+	r->num_pars++;
+      }
+      switch(job->movie_type){
+      case SMOVIE: p += num_pars*sizeof(smdata); break;
+      case KMOVIE: p += num_pars*sizeof(kmdata); break;
+      case CMOVIE: p += num_pars*sizeof(cmdata); break;
+      default:     p += num_pars*sizeof(tmdata); break;
+      }
+    }
+  }
+}
+
+/*========================= batch_worker ==========================*/
+/* Thread of batch_analyze: takes frames from the job one at a     */
+/* time until none are left.  Each thread has its own tessellation */
+/* and position buffers, which are reused from frame to frame.     */
+void *batch_worker(void *arg)
+{
+  void batch_frame_data(struct batch_job *job,int f,int *n,float **x,
+			float **y,int *x_size,int *y_size,
+			struct batch_frame *r,struct unpacker *u);
+  void unpackers_free(struct unpacker *u,int n);
+  struct batch_job *job = (struct batch_job *) arg;
+  struct tessellation t;
+  struct batch_frame *r;
+  float *x = NULL,*y = NULL;
+  int x_size = 0,y_size = 0;
+  int f,i,n,s;
+  struct unpacker *u;
+
+  memset(&t,0,sizeof(t));
+  u = (struct unpacker *) calloc(job->num_nodes,sizeof(struct unpacker));
+  while(1){
+    pthread_mutex_lock(&job->lock);
+    f = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(f >= job->n_frames) break;
+
+    r = &job->result[f];
+    batch_frame_data(job,f,&n,&x,&y,&x_size,&y_size,r,u);
+    if(n < 3) continue;
+    if(job->periodic)
+      calculate_periodic_voronoi(&t,n,x,y,job->syssizex,job->syssizey,0.0);
+    else
+      calculate_voronoi(&t,n,x,y);
+    for(i=0;i<n;i++){
+      s = t.sidenum[i];
+      if(s != 6) r->defects++;
+      if(s >= BATCH_SIDES) s = BATCH_SIDES-1;
+      r->sides[s]++;
+    }
+  }
+
+  tessellation_free(&t);
+  unpackers_free(u,job->num_nodes);
+  free(x);
+  free(y);
+  return NULL;
+}
+
+/*========================= batch_analyze =========================*/
+/* Analyzes every frame of the open movie (all num_nodes nodes)    */
+/* and writes to batch.output, or <filename>.analysis:             */
+/*   frame time particles defects n0..n(BATCH_SIDES-1)             */
+/*   species0..species(BATCH_SPECIES-1)                            */
+/* n<k> is the number of particles whose Voronoi cell has k sides  */
+/* (the last column: that many or more), a defect is a particle    */
+/* without 6 sides.  Frames are spread over batch.threads threads. */
+/* Called by: main$.*/
+void batch_analyze(char filename[],int num_nodes,int movie_type,
+		   int voronoi_layer,int periodic_voronoi,float syssizex,
+		   float syssizey)
+{
+  void *batch_worker(void *arg);
+  struct batch_job job;
+  pthread_t *threads;
+  int n_threads,i,k;
+  char outname[220];
+  FILE *out;
+  struct batch_frame *r;
+
+  job.n_frames = merged.n_frames;
+  if(job.n_frames == 0){
+    printf("No frames to analyze\n");
+    return;
+  }
+  pthread_mutex_init(&job.lock,NULL);
+  job.next = 0;
+  job.num_nodes = num_nodes;
+  job.movie_type = movie_type;
+  job.layer = voronoi_layer;
+  job.periodic = periodic_voronoi && (syssizex > 0) && (syssizey > 0);
+  job.syssizex = syssizex;
+  job.syssizey = syssizey;
+  job.result = (struct batch_frame *) calloc(job.n_frames,
+					     sizeof(struct batch_frame));
+  if(job.result == NULL){
+    printf("Out of memory for %d frames\n",job.n_frames);
+    return;
+  }
+
+  if(batch.output[0] != '\0')
+    strcpy(outname,batch.output);
+  else
+    sprintf(outname,"%.200s.analysis",filename);
+  if((out = fopen(outname,"w")) == NULL){
+    printf("Cannot write %s\n",outname);
+    free(job.result);
+    return;
+  }
+
+  n_threads = batch.threads;
+  if(n_threads <= 0) n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads <= 0) n_threads = 1;
+  if(n_threads > job.n_frames) n_threads = job.n_frames;
+  threads = (pthread_t *) malloc(n_threads*sizeof(pthread_t));
+  for(i=0;i<n_threads;i++)
+    pthread_create(&threads[i],NULL,batch_worker,&job);
+  for(i=0;i<n_threads;i++)
+    pthread_join(threads[i],NULL);
+  free(threads);
+  pthread_mutex_destroy(&job.lock);
+
+  fprintf(out,"# frame time particles defects");
+  for(k=0;k<BATCH_SIDES;k++) fprintf(out," n%d",k);
+  for(k=0;k<BATCH_SPECIES;k++) fprintf(out," species%d",k);
+  fprintf(out,"\n");
+  for(i=0;i<job.n_frames;i++){
+    r = &job.result[i];
+    fprintf(out,"%d %d %d %d",i+1,r->md_time,r->num_pars,r->defects);
+    for(k=0;k<BATCH_SIDES;k++) fprintf(out," %d",r->sides[k]);
+    for(k=0;k<BATCH_SPECIES;k++) fprintf(out," %d",r->species[k]);
+    fprintf(out,"\n");
+  }
+  fclose(out);
+  free(job.result);
+  printf("Analyzed %d frames with %d threads into %s\n",job.n_frames,
+	 n_threads,outname);
+}
+
+/*====================== Offscreen rendering ======================*/
+/* With "render <prefix>" in batch mode, plot draws every frame    */
+/* into a framebuffer in memory and writes <prefix>NNNNN.ppm.  The */
+/* picture follows plot_frame: background or pinning contour,      */
+/* trajectories, Voronoi/Delaunay construction, then particles.    */
+/* Frames are split into one run of consecutive frames per thread. */
+/* With trajectories, the picture each run starts from is drawn    */
+/* first, in one pass over the frames that draws only the lines.   */
+
+/* An RGB picture of w by h pixels, 3 bytes per pixel */
+struct framebuffer {
+  int w,h;
+  unsigned char *rgb;
+};
+
+/* The plotting window of the renderer, as set up by setwindow */
+struct render_view {
+  int w,h;
+  float x_offset,y_offset;
+  float x_scale,y_scale;
+};
+
+/* One particle to draw: plot_frame's color and radius (Box) */
+struct render_particle {
+  float x,y;
+  int color;
+  int box;
+};
+
+/* Trajectory picture and the last pixel position of every       */
+/* particle: what a run of frames starts from with trajectories.  */
+struct render_traj {
+  struct framebuffer fb;
+  int *old_x,*old_y;
+  int old_x_size,old_y_size;
+  int n_old;
+};
+
+/* Work shared by the render_worker threads; read only */
+struct render_job {
+  struct batch_job frames;   /* movie, nodes, Voronoi settings */
+  struct render_view view;
+  int n_threads;
+  int do_voronoi;
+  int traj_on;
+  int do_S_contour;
+  int num_pins;
+  int ntypes;
+  int max_color;
+  int color;                 /* a colormap was loaded */
+  struct framebuffer back;   /* background with the pinning contour */
+  struct render_traj *start; /* traj_on: one for each thread's run */
+};
+
+/*========================== fb_pixel ============================*/
+void fb_pixel(struct framebuffer *fb,int x,int y,
+		     unsigned char rgb[3])
+{
+  unsigned char *p;
+
+  if((x < 0)||(y < 0)||(x >= fb->w)||(y >= fb->h)) return;
+  p = fb->rgb + 3*((size_t)y*fb->w + x);
+  p[0] = rgb[0];
+  p[1] = rgb[1];
+  p[2] = rgb[2];
+}
+
+/*========================== fb_span =============================*/
+/* Fills pixels x1..x2 of row y */
+void fb_span(struct framebuffer *fb,int x1,int x2,int y,
+		    unsigned char rgb[3])
+{
+  int x;
+
+  if((y < 0)||(y >= fb->h)) return;
+  if(x1 < 0) x1 = 0;
+  if(x2 >= fb->w) x2 = fb->w-1;
+  for(x=x1;x<=x2;x++) fb_pixel(fb,x,y,rgb);
+}
+
+/*========================== fb_line =============================*/
+/* Bresenham line, like XDrawLine */
+void fb_line(struct framebuffer *fb,int x1,int y1,int x2,int y2,
+	     unsigned char rgb[3])
+{
+  int dx,dy,sx,sy,err,e2;
+
+  dx = (x2 > x1) ? x2-x1 : x1-x2;
+  dy = (y2 > y1) ? y1-y2 : y2-y1;
+  sx = (x1 < x2) ? 1 : -1;
+  sy = (y1 < y2) ? 1 : -1;
+  err = dx+dy;
+  while(1){
+    fb_pixel(fb,x1,y1,rgb);
+    if((x1 == x2)&&(y1 == y2)) break;
+    e2 = 2*err;
+    if(e2 >= dy){ err += dy; x1 += sx; }
+    if(e2 <= dx){ err += dx; y1 += sy; }
+  }
+}
+
+/*========================= fb_fill_circle =======================*/
+/* Filled circle of radius r around cx,cy, like the XFillArc of   */
+/* plot_object with width Box2 = 2*r. */
+void fb_fill_circle(struct framebuffer *fb,int cx,int cy,int r,
+		    unsigned char rgb[3])
+{
+  int dy,dx;
+
+  for(dy=-r;dy<=r;dy++){
+    dx = (int) sqrt((double)(r*r - dy*dy));
+    fb_span(fb,cx-dx,cx+dx,cy+dy,rgb);
+  }
+}
+
+/*========================= fb_ellipse ===========================*/
+/* Outline of an ellipse with diameters rx, ry, as the pins of   */
+/* draw_contour. */
+void fb_ellipse(struct framebuffer *fb,int cx,int cy,int rx,int ry,
+		unsigned char rgb[3])
+{
+  int k,steps;
+  double phi;
+
+  steps = 4*(rx+ry)+8;
+  for(k=0;k<steps;k++){
+    phi = 2.0*PI*k/steps;
+    fb_pixel(fb,cx + (int)(0.5*rx*cos(phi)),cy + (int)(0.5*ry*sin(phi)),rgb);
+  }
+}
+
+/*======================== fb_fill_polygon =======================*/
+/* Even-odd scanline fill of the polygon px[],py[] (n corners).  */
+void fb_fill_polygon(struct framebuffer *fb,int n,int px[],int py[],
+		     unsigned char rgb[3])
+{
+  int ymin,ymax,y,i,j,k,nx,t;
+  int xs[64];
+
+  if(n < 3) return;
+  ymin = ymax = py[0];
+  for(i=1;i<n;i++){
+    if(py[i] < ymin) ymin = py[i];
+    if(py[i] > ymax) ymax = py[i];
+  }
+  if(ymin < 0) ymin = 0;
+  if(ymax >= fb->h) ymax = fb->h-1;
+  for(y=ymin;y<=ymax;y++){
+    nx = 0;
+    for(i=0,j=n-1;i<n;j=i++){
+      if(((py[i] <= y)&&(py[j] > y))||((py[j] <= y)&&(py[i] > y))){
+	if(nx == 64) break;
+	xs[nx++] = px[i] + (int)((double)(y-py[i])*(px[j]-px[i])/(py[j]-py[i]));
+      }
+    }
+    for(i=1;i<nx;i++){
+      t = xs[i];
+      for(k=i-1;(k>=0)&&(xs[k]>t);k--) xs[k+1] = xs[k];
+      xs[k+1] = t;
+    }
+    for(i=0;i+1<nx;i+=2) fb_span(fb,xs[i],xs[i+1],y,rgb);
+  }
+}
+
+/*========================== write_ppm ===========================*/
+int write_ppm(char *name,struct framebuffer *fb)
+{
+  FILE *out;
+  int ok;
+
+  if((out = fopen(name,"wb")) == NULL) return 0;
+  fprintf(out,"P6\n%d %d\n255\n",fb->w,fb->h);
+  ok = (fwrite(fb->rgb,3,(size_t)fb->w*fb->h,out) == (size_t)fb->w*fb->h);
+  fclose(out);
+  return ok;
+}
+
+/*========================= render_coords ========================*/
+/* Same conversion to window coordinates as plot_object. */
+void render_coords(struct render_view *v,float x,float y,
+			  int *px,int *py)
+{
+  *px = (int) ((x + v->x_offset) * v->x_scale + BORDER);
+  *py = (int) (((float)v->h) - (y + v->y_offset) * v->y_scale - BORDERY);
+}
+
+/*========================= render_color =========================*/
+/* The RGB value of color c of the colormap (white/black without) */
+unsigned char *render_color(struct render_job *job,int c)
+{
+  static unsigned char white[3] = {255,255,255};
+  static unsigned char black[3] = {0,0,0};
+
+  if(!job->color) return (c == 0) ? white : black;
+  if(c < 0) c = 0;
+  if(c > 255) c = 255;
+  return c_rgb[c];
+}
+
+/*========================= render_particles =====================*/
+/* Lists the particles of frame f as plot_frame draws them: layers */
+/* from the last to the first, so that layer 0 is on top.         */
+int render_particles(struct render_job *job,int f,
+		     struct render_particle **list,int *list_size,
+		     struct unpacker *u)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  char *frame_data(int j,int f,int movie_type,int *num_pars,int *num_layers,
+		   struct unpacker *u);
+  int layer_box(int ll,int ntypes);
+  struct render_particle *q;
+  int j,ll,i,num_pars,num_layers,num_nodes,layr,n,index;
+  char *p;
+  struct tmdata *tm;
+
+  num_nodes = job->frames.num_nodes;
+  n = 0;
+  for(j=0;j<num_nodes;j++){
+    frame_data(j,f,job->frames.movie_type,&num_pars,&num_layers,u);
+    n += num_layers*num_pars;
+  }
+  *list = (struct render_particle *) grow_buffer(*list,list_size,n,
+						 sizeof(**list));
+
+  n = 0;
+  for(j=num_nodes-1;j>=0;j--){
+    p = frame_data(j,f,job->frames.movie_type,&num_pars,&num_layers,u);
+    for(ll=num_layers-1;ll>=0;ll--){
+      index = ll + num_layers*j;
+      for(i=0;i<num_pars;i++){
+	q = &(*list)[n++];
+	q->box = 3;
+	switch(job->frames.movie_type){
+	case SMOVIE:
+	  q->x = ((struct smdata *) p)[i].x;
+	  q->y = ((struct smdata *) p)[i].y;
+	  q->color = 1;
+	  break;
+	case KMOVIE:
+	  q->x = ((struct kmdata *) p)[i].x;
+	  q->y = ((struct kmdata *) p)[i].y;
+	  q->color = 1;
+	  break;
+	case CMOVIE:
+	  q->x = ((struct cmdata *) p)[i].x;
+	  q->y = ((struct cmdata *) p)[i].y;
+	  q->color = ((struct cmdata *) p)[i].color;
+	  break;
+	case TMOVIE:
+	  tm = (struct tmdata *) p + (size_t)ll*num_pars + i;
+	  q->x = tm->x;
+	  q->y = tm->y;
+	  layr = tm->layr;
+	  if(tm->p_num < 0)
+	    q->color = num_layers*num_nodes - layr;
+	  else
+	    q->color = layr + 1;
+	  q->box = layer_box((job->ntypes > 1) ? layr : index,job->ntypes);
+	  break;
+	}
+	if(q->color > 125) q->color = 125;
+      }
+    }
+  }
+  return n;
+}
+
+/*========================= render_voronoi =======================*/
+/* Draws the construction in t the way plot_Voronoi does. */
+void render_voronoi(struct render_job *job,struct framebuffer *fb,
+		    struct tessellation *t,int num_pars,float **dstore,
+		    int *dstore_size)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  void order_polygon(int n,float xlist[],float ylist[],float angle[],
+		     float xcenter,float ycenter);
+  struct render_view *v = &job->view;
+  unsigned char black[3] = {0,0,0},white[3] = {255,255,255};
+  float xl[64],yl[64],an[64];
+  int px[64],py[64];
+  int i,k,n,a,b,c,color;
+  float xwidth,ywidth,dx,dy,d,dmin,dmax,avgdist,diffd;
+  int count,skip;
+  unsigned char *fill;
+
+  xwidth = (t->xmax - t->xmin)/2;
+  ywidth = (t->ymax - t->ymin)/2;
+  if(job->do_voronoi == 1){
+    for(i=0;i<num_pars;i++){
+      n = t->sidenum[i];
+      if((n < 3)||(n > 64)) continue;
+      for(k=0;k<n;k++){
+	xl[k] = t->vertx[t->polylist[t->polystart[i]+k]];
+	yl[k] = t->verty[t->polylist[t->polystart[i]+k]];
+      }
+      order_polygon(n,xl,yl,an,t->rx[i],t->ry[i]);
+      skip = 0;
+      for(k=0;k<n;k++){
+	render_coords(v,xl[k],yl[k],&px[k],&py[k]);
+	if((px[k] < BORDER-10)||(py[k] < BORDERY-10)||
+	   (px[k] >= v->w-(BORDER-10))||(py[k] >= v->h-(BORDERY-10)))
+	  skip = 1;
+      }
+      if(skip) continue;
+      switch(n){
+      case 6:  fill = white; break;
+      case 5:  fill = render_color(job,4); break;
+      case 7:  fill = render_color(job,5); break;
+      default: fill = render_color(job,6); break;
+      }
+      fb_fill_polygon(fb,n,px,py,fill);
+    }
+    for(i=0;i<t->num_ep;i++){
+      if((t->cjoleft[i] < 0)||(t->cjoright[i] < 0)) continue;
+      dx = t->vertx[t->cjoleft[i]] - t->vertx[t->cjoright[i]];
+      dy = t->verty[t->cjoleft[i]] - t->verty[t->cjoright[i]];
+      if((fabs(dx) > xwidth)||(fabs(dy) > ywidth)) continue;
+      render_coords(v,t->vertx[t->cjoleft[i]],t->verty[t->cjoleft[i]],
+		    &px[0],&py[0]);
+      render_coords(v,t->vertx[t->cjoright[i]],t->verty[t->cjoright[i]],
+		    &px[1],&py[1]);
+      fb_line(fb,px[0],py[0],px[1],py[1],black);
+    }
+    return;
+  }
+
+  /* Delaunay: lines colored by length, as plot_triangle */
+  *dstore = (float *) grow_buffer(*dstore,dstore_size,3*t->num_trip,
+				  sizeof(float));
+  dmin = 10000.0;
+  dmax = 0.0;
+  avgdist = 0;
+  count = 0;
+  for(i=0;i<t->num_trip;i++){
+    a = t->tripA[i]; b = t->tripB[i]; c = t->tripC[i];
+    for(k=0;k<3;k++){
+      (*dstore)[3*i+k] = -1;
+      if((a >= num_pars)&&(b >= num_pars)&&(c >= num_pars)) continue;
+      dx = t->rx[k==0 ? a : (k==1 ? b : c)] - t->rx[k==0 ? b : (k==1 ? c : a)];
+      dy = t->ry[k==0 ? a : (k==1 ? b : c)] - t->ry[k==0 ? b : (k==1 ? c : a)];
+      if((fabs(dx) > xwidth)||(fabs(dy) > ywidth)) continue;
+      d = sqrt(dx*dx + dy*dy);
+      (*dstore)[3*i+k] = d;
+      if(d < dmin) dmin = d;
+      if(d > dmax) dmax = d;
+      avgdist += d;
+      count++;
+    }
+  }
+  if(count) avgdist /= count;
+  diffd = 1.5*avgdist - dmin;
+  if(diffd <= 0) diffd = 1.0;
+  for(i=0;i<t->num_trip;i++){
+    a = t->tripA[i]; b = t->tripB[i]; c = t->tripC[i];
+    skip = 0;
+    for(k=0;k<3;k++)
+      if(((*dstore)[3*i+k] < 0)||((*dstore)[3*i+k] > 1.5*avgdist)) skip = 1;
+    if(skip) continue;
+    render_coords(v,t->rx[a],t->ry[a],&px[0],&py[0]);
+    render_coords(v,t->rx[b],t->ry[b],&px[1],&py[1]);
+    render_coords(v,t->rx[c],t->ry[c],&px[2],&py[2]);
+    for(k=0;k<3;k++){
+      color = (((*dstore)[3*i+k]-dmin)/diffd)*(job->max_color-1)+1;
+      fb_line(fb,px[k],py[k],px[(k+1)%3],py[(k+1)%3],render_color(job,color));
+    }
+  }
+}
+
+/*======================= render_traj_lines ======================*/
+/* Draws into tr the lines from the last positions to the n        */
+/* particles of list, which become the last positions.             */
+void render_traj_lines(struct render_view *v,struct render_traj *tr,
+		       struct render_particle *list,int n)
+{
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  unsigned char black[3] = {0,0,0};
+  int i,px,py,dxp,dyp;
+
+  tr->old_x = (int *) grow_buffer(tr->old_x,&tr->old_x_size,n,sizeof(int));
+  tr->old_y = (int *) grow_buffer(tr->old_y,&tr->old_y_size,n,sizeof(int));
+  for(i=0;i<n;i++){
+    render_coords(v,list[i].x,list[i].y,&px,&py);
+    if(i < tr->n_old){
+      dxp = (px > tr->old_x[i]) ? px-tr->old_x[i] : tr->old_x[i]-px;
+      dyp = (py > tr->old_y[i]) ? py-tr->old_y[i] : tr->old_y[i]-py;
+      if((dxp < v->w/3)&&(dyp < v->h/3)&&((dxp > 0)||(dyp > 0)))
+	fb_line(&tr->fb,tr->old_x[i],tr->old_y[i],px,py,black);
+    }
+    tr->old_x[i] = px;
+    tr->old_y[i] = py;
+  }
+  tr->n_old = n;
+}
+
+/*======================= render_traj_copy =======================*/
+/* dst becomes a copy of src, with its own arrays */
+void render_traj_copy(struct render_traj *dst,struct render_traj *src)
+{
+  size_t bytes;
+
+  bytes = (size_t)3*src->fb.w*src->fb.h;
+  dst->fb = src->fb;
+  dst->fb.rgb = (unsigned char *) malloc(bytes);
+  dst->n_old = dst->old_x_size = dst->old_y_size = src->n_old;
+  dst->old_x = (int *) malloc((src->n_old+1)*sizeof(int));
+  dst->old_y = (int *) malloc((src->n_old+1)*sizeof(int));
+  if((dst->fb.rgb == NULL)||(dst->old_x == NULL)||(dst->old_y == NULL)){
+    printf("Out of memory for the trajectories\n");
+    exit(-1);
+  }
+  memcpy(dst->fb.rgb,src->fb.rgb,bytes);
+  memcpy(dst->old_x,src->old_x,src->n_old*sizeof(int));
+  memcpy(dst->old_y,src->old_y,src->n_old*sizeof(int));
+}
+
+/*======================= render_traj_free =======================*/
+void render_traj_free(struct render_traj *tr)
+{
+  free(tr->fb.rgb);
+  free(tr->old_x);
+  free(tr->old_y);
+  memset(tr,0,sizeof(*tr));
+}
+
+/*====================== render_traj_starts ======================*/
+/* The trajectory pictures the runs of the threads start from:    */
+/* one serial pass up to the first frame of the last run, which   */
+/* reads the particles and draws the lines, nothing else.         */
+void render_traj_starts(struct render_job *job)
+{
+  int render_particles(struct render_job *job,int f,
+		       struct render_particle **list,int *list_size,
+		       struct unpacker *u);
+  void unpackers_free(struct unpacker *u,int n);
+  struct render_traj cur;
+  struct render_particle *list = NULL;
+  int list_size = 0;
+  struct unpacker *u;
+  size_t bytes;
+  int f,k,n;
+
+  job->start = (struct render_traj *) calloc(job->n_threads,
+					     sizeof(struct render_traj));
+  u = (struct unpacker *) calloc(job->frames.num_nodes,sizeof(struct unpacker));
+  memset(&cur,0,sizeof(cur));
+  cur.fb = job->back;
+  bytes = (size_t)3*cur.fb.w*cur.fb.h;
+  cur.fb.rgb = (unsigned char *) malloc(bytes);
+  if((job->start == NULL)||(u == NULL)||(cur.fb.rgb == NULL)){
+    printf("Out of memory for the trajectories\n");
+    exit(-1);
+  }
+  memcpy(cur.fb.rgb,job->back.rgb,bytes);
+
+  k = 0;
+  for(f=0;;f++){
+    /* Thread k starts at frame n_frames*k/n_threads */
+    while((k < job->n_threads)&&
+	  (f == (int)((long)job->frames.n_frames*k/job->n_threads)))
+      render_traj_copy(&job->start[k++],&cur);
+    if(k == job->n_threads) break;
+    n = render_particles(job,f,&list,&list_size,u);
+    render_traj_lines(&job->view,&cur,list,n);
+  }
+
+  render_traj_free(&cur);
+  free(list);
+  unpackers_free(u,job->frames.num_nodes);
+}
+
+/*========================= render_worker ========================*/
+/* Renders the run of frames [first,last) given by the thread      */
+/* number.  With trajectories it goes on from the picture that     */
+/* render_traj_starts drew up to first.                            */
+void *render_worker(void *arg)
+{
+  void batch_frame_data(struct batch_job *job,int f,int *n,float **x,
+			float **y,int *x_size,int *y_size,
+			struct batch_frame *r,struct unpacker *u);
+  void unpackers_free(struct unpacker *u,int n);
+  void *grow_buffer(void *p,int *allocated,int n,size_t item_size);
+  int render_particles(struct render_job *job,int f,
+		       struct render_particle **list,int *list_size,
+		       struct unpacker *u);
+  void render_voronoi(struct render_job *job,struct framebuffer *fb,
+		      struct tessellation *t,int num_pars,float **dstore,
+		      int *dstore_size);
+  struct render_job *job = ((void **) arg)[0];
+  int thread = *(int *)((void **) arg)[1];
+  void render_traj_lines(struct render_view *v,struct render_traj *tr,
+			 struct render_particle *list,int n);
+  void render_traj_free(struct render_traj *tr);
+  struct render_view *v = &job->view;
+  struct framebuffer fb;
+  struct render_traj *traj;
+  struct tessellation t;
+  struct batch_frame r;
+  struct render_particle *list = NULL;
+  int list_size = 0;
+  float *x = NULL,*y = NULL,*dstore = NULL;
+  int x_size = 0,y_size = 0,dstore_size = 0;
+  size_t bytes;
+  int first,last,f,i,n,nv,px,py;
+  char name[256];
+  struct unpacker *u;
+
+  first = (int)((long)job->frames.n_frames*thread/job->n_threads);
+  last = (int)((long)job->frames.n_frames*(thread+1)/job->n_threads);
+  bytes = (size_t)3*v->w*v->h;
+  fb.w = v->w;
+  fb.h = v->h;
+  fb.rgb = (unsigned char *) malloc(bytes);
+  if(fb.rgb == NULL){
+    printf("Out of memory for a %dx%d picture\n",v->w,v->h);
+    exit(-1);
+  }
+  /* This thread's own copy, drawn on from here */
+  traj = job->traj_on ? &job->start[thread] : NULL;
+  memset(&t,0,sizeof(t));
+  u = (struct unpacker *) calloc(job->frames.num_nodes,sizeof(struct unpacker));
+
+  for(f=first;f<last;f++){
+    n = render_particles(job,f,&list,&list_size,u);
+
+    /* Trajectories: from the position in the previous frame */
+    if(traj != NULL){
+      render_traj_lines(v,traj,list,n);
+      memcpy(fb.rgb,traj->fb.rgb,bytes);
+    }
+    else
+      memcpy(fb.rgb,job->back.rgb,bytes);
+
+    if(job->do_voronoi){
+      memset(&r,0,sizeof(r));
+      batch_frame_data(&job->frames,f,&nv,&x,&y,&x_size,&y_size,&r,u);
+      if(nv >= 3){
+	if(job->frames.periodic)
+	  calculate_periodic_voronoi(&t,nv,x,y,job->frames.syssizex,
+				     job->frames.syssizey,0.0);
+	else
+	  calculate_voronoi(&t,nv,x,y);
+	render_voronoi(job,&fb,&t,nv,&dstore,&dstore_size);
+      }
+    }
+
+    for(i=0;i<n;i++){
+      render_coords(v,list[i].x,list[i].y,&px,&py);
+      if((px < BORDER-10)||(py < BORDERY-10)||
+	 (px >= v->w-(BORDER-10))||(py >= v->h-(BORDERY-10))) continue;
+      fb_fill_circle(&fb,px,py,list[i].box,render_color(job,list[i].color));
+    }
+
+    sprintf(name,"%.200s%05d.ppm",batch.render,f+1);
+    if(!write_ppm(name,&fb)) printf("Cannot write %s\n",name);
+  }
+
+  tessellation_free(&t);
+  free(fb.rgb);
+  if(traj != NULL) render_traj_free(traj);
+  free(list);
+  free(x);
+  free(y);
+  free(dstore);
+  unpackers_free(u,job->frames.num_nodes);
+  return NULL;
+}
+
+/*========================= batch_render =========================*/
+/* Renders all frames of the open movie to batch.render<frame>.ppm */
+/* in batch.width by batch.height pixels, for the plotting region  */
+/* xmin..xmax, ymin..ymax.  Called by: main$.                      */
+void batch_render(int num_nodes,int movie_type,int voronoi_layer,
+		  int periodic_voronoi,float syssizex,float syssizey,
+		  float xmin,float ymin,float xmax,float ymax,int do_voronoi,
+		  int traj_on,int do_S_contour,int num_pins,int ntypes,
+		  int max_color)
+{
+  void *render_worker(void *arg);
+  void render_traj_starts(struct render_job *job);
+  struct render_job job;
+  struct render_view *v = &job.view;
+  pthread_t *threads;
+  void *(*args)[2];
+  int *number;
+  int i,n_threads,px,py,rx,ry;
+  size_t bytes;
+  unsigned char *bg,black[3] = {0,0,0};
+
+  memset(&job,0,sizeof(job));
+  job.frames.n_frames = merged.n_frames;
+  if(job.frames.n_frames == 0){
+    printf("No frames to render\n");
+    return;
+  }
+  job.frames.num_nodes = num_nodes;
+  job.frames.movie_type = movie_type;
+  job.frames.layer = voronoi_layer;
+  job.frames.periodic = periodic_voronoi && (syssizex > 0) && (syssizey > 0);
+  job.frames.syssizex = syssizex;
+  job.frames.syssizey = syssizey;
+  job.do_voronoi = do_voronoi;
+  job.traj_on = traj_on;
+  job.do_S_contour = do_S_contour;
+  job.num_pins = num_pins;
+  job.ntypes = ntypes;
+  job.max_color = max_color;
+  job.color = (c_rgb_loaded > 0);
+
+  /* The same window geometry as setwindow */
+  v->w = batch.width;
+  v->h = batch.height;
+  v->x_offset = 0 - xmin;
+  v->y_offset = 0 - ymin;
+  v->x_scale = (v->w-2*BORDER)/(xmax-xmin);
+  v->y_scale = (v->h-2*BORDERY)/(ymax-ymin);
+
+  /* Background: white with the pins of draw_contour, else color 0 */
+  bytes = (size_t)3*v->w*v->h;
+  job.back.w = v->w;
+  job.back.h = v->h;
+  if((job.back.rgb = (unsigned char *) malloc(bytes)) == NULL){
+    printf("Out of memory for a %dx%d picture\n",v->w,v->h);
+    return;
+  }
+  if(do_S_contour){
+    memset(job.back.rgb,255,bytes);
+    for(i=0;i<num_pins;i++){
+      render_coords(v,pin_sites[i].x,pin_sites[i].y,&px,&py);
+      if((px >= v->w-(BORDER-10))||(py >= v->h-(BORDERY-10))||
+	 (py < BORDERY-10)||(px < BORDER-10)) continue;
+      rx = (int)(pin_sites[i].radiusx*2.0*v->x_scale);
+      ry = (int)(pin_sites[i].radiusy*2.0*v->x_scale);
+      if(rx <= 0) rx = 1;
+      if(ry <= 0) ry = 1;
+      fb_ellipse(&job.back,px,py,rx,ry,black);
+    }
+  }
+  else{
+    bg = render_color(&job,0);
+    for(i=0;i<v->w*v->h;i++) memcpy(job.back.rgb+3*i,bg,3);
+  }
+
+  n_threads = batch.threads;
+  if(n_threads <= 0) n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads <= 0) n_threads = 1;
+  if(n_threads > job.frames.n_frames) n_threads = job.frames.n_frames;
+  job.n_threads = n_threads;
+  if(traj_on) render_traj_starts(&job);
+  threads = (pthread_t *) malloc(n_threads*sizeof(pthread_t));
+  args = malloc(n_threads*sizeof(*args));
+  number = (int *) malloc(n_threads*sizeof(int));
+  for(i=0;i<n_threads;i++){
+    number[i] = i;
+    args[i][0] = &job;
+    args[i][1] = &number[i];
+    pthread_create(&threads[i],NULL,render_worker,args[i]);
+  }
+  for(i=0;i<n_threads;i++)
+    pthread_join(threads[i],NULL);
+  free(threads);
+  free(args);
+  free(number);
+  free(job.start);
+  free(job.back.rgb);
+  printf("Rendered %d frames with %d threads to %s*.ppm\n",
+	 job.frames.n_frames,n_threads,batch.render);
+}